@@ -0,0 +1,293 @@
+// memory arena for the slab pages
+//
+#include "arena.h"
+#include "config.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+using namespace mc;
+
+namespace
+{
+	const char FILE_MAGIC[8] = {'m', 'c', 'a', 'r', 'e', 'n', 'a', '1'};
+
+	std::runtime_error file_error(const char* what, const std::string& path)
+	{
+		std::stringstream se;
+		se << what << " " << path << ": " << errno;
+		return std::runtime_error(se.str());
+	}
+}
+
+// the page states follow it, the pages start at the next huge page
+struct arena::file_header
+{
+	char magic_[8];
+	uint64_t layout_;
+	uint64_t size_;
+	uint64_t page_size_;
+	uint64_t base_; //address of the pages in the process that mapped them last
+	uint64_t next_;
+};
+
+arena::arena(size_t size, size_t page_size, const config& cfg)
+	:map_(nullptr)
+	,map_size_(0)
+	,base_(nullptr)
+	,size_((size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1))
+	,page_size_(page_size)
+	,backing_(backing::pages)
+	,locked_(false)
+	,fd_(-1)
+	,header_(nullptr)
+	,states_(nullptr)
+	,extra_(nullptr)
+	,shift_(0)
+	,restored_(false)
+	,closed_(false)
+	,free_(nullptr)
+	,next_(0)
+{
+	assert(page_size_ && page_size_ <= HUGE_PAGE_SIZE && size_);
+
+	if (cfg.path_.empty()) {
+		map_anonymous(cfg);
+	}
+	else {
+		map_file(cfg);
+	}
+	if (cfg.huge_pages_ && backing_ == backing::pages) {
+		std::clog << "warning: no huge pages for the cache memory, it uses the normal pages" << std::endl;
+	}
+
+	if (cfg.prefault_) {
+		prefault();
+	}
+}
+
+arena::~arena()
+{
+	::munmap(map_, map_size_);
+	if (fd_ != -1) {
+		::close(fd_);
+	}
+}
+
+void arena::map_anonymous(const config& cfg)
+{
+#ifdef MAP_HUGETLB
+	if (cfg.huge_pages_) { //fails unless there are enough reserved huge pages
+		void* p = ::mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED) {
+			map_ = base_ = static_cast<unsigned char*>(p);
+			map_size_ = size_;
+			backing_ = backing::hugetlb;
+		}
+	}
+#endif
+	if (!map_) {
+		bool thp = false;
+#ifdef MADV_HUGEPAGE
+		thp = cfg.huge_pages_;
+#endif
+		//the transparent huge pages need the addresses aligned to the huge page size
+		map_size_ = size_ + (thp ? HUGE_PAGE_SIZE : 0);
+		int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+		flags |= MAP_NORESERVE;
+#endif
+		void* p = ::mmap(nullptr, map_size_, PROT_READ | PROT_WRITE, flags, -1, 0);
+		if (p == MAP_FAILED) {
+			std::stringstream se;
+			se << "cache arena mmap error: " << errno;
+			throw std::runtime_error(se.str());
+		}
+		map_ = static_cast<unsigned char*>(p);
+		base_ = reinterpret_cast<unsigned char*>((uintptr_t(map_) + (thp ? HUGE_PAGE_SIZE - 1 : 0)) & ~uintptr_t(thp ? HUGE_PAGE_SIZE - 1 : 0));
+#ifdef MADV_HUGEPAGE
+		if (thp && !::madvise(base_, size_, MADV_HUGEPAGE)) {
+			backing_ = backing::thp;
+		}
+#endif
+	}
+}
+
+void arena::map_file(const config& cfg)
+{
+	fd_ = ::open(cfg.path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd_ == -1) {
+		throw file_error("can't open the cache file", cfg.path_);
+	}
+	size_t extra_pos = (sizeof(file_header) + size_/page_size_ + 63) & ~size_t(63);
+	size_t header_size = (extra_pos + cfg.extra_ + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+	map_size_ = header_size + size_;
+	file_header h;
+	bool reuse = false;
+	void* p = MAP_FAILED;
+	try {
+		if (::flock(fd_, LOCK_EX | LOCK_NB)) {
+			throw file_error("the cache file is used by another process", cfg.path_);
+		}
+
+		struct stat st;
+		if (::fstat(fd_, &st)) {
+			throw file_error("can't stat the cache file", cfg.path_);
+		}
+		reuse = size_t(st.st_size) == map_size_
+			&& ::pread(fd_, &h, sizeof(h), 0) == ssize_t(sizeof(h))
+			&& !::memcmp(h.magic_, FILE_MAGIC, sizeof(FILE_MAGIC))
+			&& h.layout_ == cfg.layout_ && h.size_ == size_ && h.page_size_ == page_size_
+			&& h.next_ <= size_ && !(h.next_ % page_size_);
+		if (!reuse) {
+			if (st.st_size) {
+				std::clog << "warning: the cache file " << cfg.path_ << " was made for another cache, it starts empty" << std::endl;
+			}
+			//the old pages go, the new ones are holes until they are used
+			if (::ftruncate(fd_, 0) || ::ftruncate(fd_, map_size_)) {
+				throw file_error("can't size the cache file", cfg.path_);
+			}
+		}
+
+		if (reuse) { //at the same place the pointers in the pages are right as they are
+			int flags = MAP_SHARED;
+#ifdef MAP_FIXED_NOREPLACE
+			flags |= MAP_FIXED_NOREPLACE;
+#endif
+			p = ::mmap(reinterpret_cast<void*>(h.base_ - header_size), map_size_, PROT_READ | PROT_WRITE, flags, fd_, 0);
+		}
+		if (p == MAP_FAILED) {
+			//the pages are aligned for THP, the address space is reserved with some room first
+			size_t room = map_size_ + HUGE_PAGE_SIZE;
+			void* r = ::mmap(nullptr, room, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			if (r == MAP_FAILED) {
+				throw file_error("can't map the cache file", cfg.path_);
+			}
+			uintptr_t start = (uintptr_t(r) + HUGE_PAGE_SIZE - 1) & ~uintptr_t(HUGE_PAGE_SIZE - 1);
+			p = ::mmap(reinterpret_cast<void*>(start), map_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd_, 0);
+			if (p == MAP_FAILED) {
+				::munmap(r, room);
+				throw file_error("can't map the cache file", cfg.path_);
+			}
+			if (start != uintptr_t(r)) {
+				::munmap(r, start - uintptr_t(r));
+			}
+			size_t tail = uintptr_t(r) + room - (start + map_size_);
+			if (tail) {
+				::munmap(reinterpret_cast<void*>(start + map_size_), tail);
+			}
+		}
+	}
+	catch (const std::exception&) {
+		::close(fd_);
+		throw;
+	}
+
+	map_ = static_cast<unsigned char*>(p);
+	header_ = reinterpret_cast<file_header*>(map_);
+	states_ = reinterpret_cast<uint8_t*>(header_ + 1);
+	extra_ = cfg.extra_ ? map_ + extra_pos : nullptr;
+	base_ = map_ + header_size;
+	if (reuse) {
+		shift_ = ptrdiff_t(uintptr_t(base_) - uintptr_t(h.base_));
+		next_ = h.next_;
+		for (size_t i = pages(); i--; ) {
+			if (!states_[i]) {
+				::memcpy(page(i), &free_, sizeof(free_));
+				free_ = page(i);
+			}
+		}
+		restored_ = next_ != 0;
+	}
+	else {
+		::memcpy(header_->magic_, FILE_MAGIC, sizeof(FILE_MAGIC));
+		header_->layout_ = cfg.layout_;
+		header_->size_ = size_;
+		header_->page_size_ = page_size_;
+		header_->next_ = 0;
+	}
+	header_->base_ = uintptr_t(base_);
+
+#ifdef MADV_HUGEPAGE
+	//shared memory gets THP if the system lets it (shmem_enabled)
+	if (cfg.huge_pages_ && !(uintptr_t(base_) & (HUGE_PAGE_SIZE - 1)) && !::madvise(base_, size_, MADV_HUGEPAGE)) {
+		backing_ = backing::thp;
+	}
+#endif
+}
+
+unsigned char* arena::alloc()
+{
+	std::lock_guard<std::mutex> lock(m_);
+	unsigned char* p = free_;
+	if (p) {
+		::memcpy(&free_, p, sizeof(free_));
+	}
+	else {
+		if (size_ - next_ < page_size_)
+			return nullptr;
+		p = base_ + next_;
+		next_ += page_size_;
+		if (header_) {
+			header_->next_ = next_;
+		}
+	}
+	if (states_) {
+		states_[page_index(p)] = 1;
+	}
+	return p;
+}
+
+void arena::free(unsigned char* page)
+{
+	assert(owns(page) && (page - base_) % page_size_ == 0);
+	std::lock_guard<std::mutex> lock(m_);
+	if (closed_)
+		return;
+	if (states_) {
+		states_[page_index(page)] = 0;
+	}
+	::memcpy(page, &free_, sizeof(free_));
+	free_ = page;
+}
+
+const char* arena::backing_name(backing b)
+{
+	switch (b) {
+		case backing::pages:
+			return "pages";
+		case backing::thp:
+			return "thp";
+		case backing::hugetlb:
+			return "hugetlb";
+	}
+	return "unknown";
+}
+
+void arena::prefault()
+{
+	auto start = std::chrono::steady_clock::now();
+	if (!::mlock(base_, size_)) { //faults in the whole range too
+		locked_ = true;
+	}
+	else { //likely over RLIMIT_MEMLOCK, at least don't take the faults later
+		std::clog << "warning: can't lock the cache memory (" << errno << "), check ulimit -l" << std::endl;
+		size_t step = ::sysconf(_SC_PAGESIZE);
+		for (size_t off = 0; off < size_; off += step) {
+			volatile unsigned char* b = base_ + off; //the pages of a file may be in use
+			*b = *b;
+		}
+	}
+	std::clog << "cache memory prefaulted in "
+		<< std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count() << "ms" << std::endl;
+}
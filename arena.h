@@ -0,0 +1,164 @@
+// memory arena for the slab pages
+//
+#ifndef MC_ARENA_H
+#define MC_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <mutex>
+
+namespace mc
+{
+	// One mapping for all the slab pages of a cache instead of a heap allocation per page.
+	// The address space is reserved up front and the memory comes in as the pages are
+	// first used, unless it's prefaulted at the start. With huge pages the whole cache takes
+	// few TLB entries: MAP_HUGETLB if the system has enough of them reserved (vm.nr_hugepages),
+	// otherwise transparent huge pages (madvise), otherwise the normal pages.
+	//
+	// The pages are all of one size, a freed page goes to a free list and it's never given
+	// back to the system. alloc and free are thread safe.
+	//
+	// With a file the pages are a shared mapping of it (on /dev/shm it's just shared memory),
+	// so they outlive the process. The file starts with a header that tells which pages are in use,
+	// a new process with the same layout maps the file where it was before if it can
+	// and takes the pages over (see restored), the owner checks what's in them.
+	// The owner may keep a few bytes of its own in the header as well (see extra).
+	// Another layout or a broken header starts the file over.
+	struct arena
+	{
+		enum class backing
+		{
+			pages, //normal pages
+			thp, //transparent huge pages
+			hugetlb //reserved huge pages
+		};
+
+		struct config
+		{
+			bool huge_pages_;
+			bool prefault_; //fault in and lock all the memory at the start
+			std::string path_; //the file to keep the pages in, empty for the anonymous memory
+			uint64_t layout_; //set by the owner, the pages in a file of another layout aren't reused
+			size_t extra_; //bytes the owner keeps in the file header, see extra
+
+			config()
+				:huge_pages_(false)
+				,prefault_(false)
+				,layout_(0)
+				,extra_(0)
+			{}
+
+			bool enabled() const
+			{
+				return huge_pages_ || prefault_ || !path_.empty();
+			}
+		};
+
+		//size is rounded up to the huge page size, throws if the address space can't be mapped
+		//or the file can't be used (another process has it too)
+		explicit arena(size_t size, size_t page_size, const config& cfg);
+		~arena();
+
+		//nullptr if all the pages are taken
+		unsigned char* alloc();
+		void free(unsigned char* page);
+
+		bool owns(const unsigned char* p) const
+		{
+			return p >= base_ && p < base_ + size_;
+		}
+		size_t page_size() const
+		{
+			return page_size_;
+		}
+		backing get_backing() const
+		{
+			return backing_;
+		}
+		bool locked() const //prefaulted and locked in memory
+		{
+			return locked_;
+		}
+
+		bool persistent() const //the pages are kept in a file
+		{
+			return fd_ != -1;
+		}
+		//the pages in use were taken over from the file, the free ones are on the free list already
+		bool restored() const
+		{
+			return restored_;
+		}
+		//config::extra_ bytes in the file, zeros in a new file and as the last process left them
+		//in a restored one, nullptr if the arena isn't persistent
+		void* extra() const
+		{
+			return extra_;
+		}
+		//the pages ever used, the ones past it are untouched
+		size_t pages() const
+		{
+			return next_/page_size_;
+		}
+		unsigned char* page(size_t idx) const
+		{
+			return base_ + idx*page_size_;
+		}
+		size_t page_index(const unsigned char* p) const
+		{
+			return (p - base_)/page_size_;
+		}
+		bool page_used(size_t idx) const //persistent arena only
+		{
+			return states_[idx] != 0;
+		}
+		//how far the restored pages moved since the last process mapped them,
+		//the pointers in the pages are off by it
+		ptrdiff_t shift() const
+		{
+			return shift_;
+		}
+		//the pages stay in the file as they are, free doesn't change them anymore
+		void close()
+		{
+			std::lock_guard<std::mutex> lock(m_);
+			closed_ = true;
+		}
+
+		static const char* backing_name(backing b);
+
+	private:
+		struct file_header;
+
+		unsigned char* map_; //the whole mapping, it's bigger than the arena if it's aligned for THP
+		size_t map_size_;
+		unsigned char* base_;
+		size_t size_;
+		const size_t page_size_;
+		backing backing_;
+		bool locked_;
+
+		//the file, if it's persistent
+		int fd_;
+		file_header* header_; //at the start of the mapping
+		uint8_t* states_; //follow the header, one per page, 0 is free
+		unsigned char* extra_; //after the states
+		ptrdiff_t shift_;
+		bool restored_;
+		bool closed_;
+
+		std::mutex m_;
+		unsigned char* free_; //free pages, the link is in the first bytes of the page
+		size_t next_; //offset of the pages that were never used
+
+		void map_anonymous(const config& cfg);
+		void map_file(const config& cfg);
+		void prefault();
+
+		arena(const arena&) = delete;
+		arena& operator=(const arena&) = delete;
+	};
+}
+
+#endif
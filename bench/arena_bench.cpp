@@ -0,0 +1,136 @@
+// cache memory benchmark, GET latency with the slab pages on the heap vs in a huge page arena
+//
+// usage: arena_bench [cache MB] [seconds per run]
+// the cache is filled with small items (the fill time shows the first touch
+// page faults), then one thread GETs random keys and every GET is timed, so the TLB misses
+// of a working set much bigger than the TLB reach show in the latency
+//
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "../cache.h"
+
+using namespace mc;
+
+namespace
+{
+	const size_t VALUE_LEN = 400;
+
+	//builds a SET request the same way the session receives it
+	buffer make_request(const std::string& k, size_t value_len)
+	{
+		protocol_binary_request_header h;
+		memset(&h, 0, sizeof(h));
+		h.request.magic = PROTOCOL_BINARY_REQ;
+		h.request.opcode = PROTOCOL_BINARY_CMD_SET;
+		h.request.extlen = 8;
+		h.request.keylen = k.size();
+		h.request.bodylen = h.request.extlen + k.size() + value_len;
+
+		buffer d(sizeof(h) + h.request.bodylen, 'v');
+		memcpy(d.data(), &h, sizeof(h));
+		memcpy(d.data() + sizeof(h) + h.request.extlen, k.data(), k.size());
+		return d;
+	}
+
+	//the keys are made on the fly, a table of them would add its own cache and TLB misses
+	size_t make_key(char* buf, size_t i)
+	{
+		return ::snprintf(buf, 32, "bench:key:%zu", i);
+	}
+
+	struct result
+	{
+		double fill_s_;
+		double avg_ns_;
+		double p50_ns_;
+		double p99_ns_;
+		double p999_ns_;
+		double hit_ratio_;
+	};
+
+	result run(const char* name, size_t mb, unsigned int seconds, bool huge_pages, bool prefault)
+	{
+		cache::config cfg;
+		cfg.arena_.huge_pages_ = huge_pages;
+		cfg.arena_.prefault_ = prefault;
+		cache c(mb*1024*1024, false, cfg);
+		std::cerr << name << ": memory " << c.memory_backing() << std::endl;
+
+		//the items take about the value, the key and the 64 byte header, rounded up to the slab class
+		size_t keys = mb*1024*1024/(VALUE_LEN + 200);
+		char k[32];
+		result r;
+		auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i != keys; ++i) {
+			buffer d = make_request(std::string(k, make_key(k, i)), VALUE_LEN);
+			c.set(cache::request(d.data(), d.size(), *reinterpret_cast<const protocol_binary_request_header*>(d.data())));
+		}
+		r.fill_s_ = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		std::mt19937 rnd(1);
+		std::vector<uint32_t> lat;
+		lat.reserve(size_t(seconds)*4000000);
+		unsigned long long hits = 0;
+		auto end = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+		while (lat.size() % 1024 || std::chrono::steady_clock::now() < end) {
+			size_t len = make_key(k, rnd() % keys);
+			auto t0 = std::chrono::steady_clock::now();
+			{
+				cache::item_view v = c.get(cache::key(reinterpret_cast<const unsigned char*>(k), len));
+				if (v && v->get_value()[0] == 'v') //reads the value like a session does
+					++hits;
+			}
+			lat.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count());
+		}
+
+		double sum = 0;
+		for (auto l: lat) {
+			sum += l;
+		}
+		r.avg_ns_ = sum/lat.size();
+		std::sort(lat.begin(), lat.end());
+		r.p50_ns_ = lat[lat.size()/2];
+		r.p99_ns_ = lat[lat.size()*99/100];
+		r.p999_ns_ = lat[lat.size()*999/1000];
+		r.hit_ratio_ = double(hits)/lat.size();
+		return r;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	size_t mb = argc > 1 ? atoi(argv[1]) : 1024;
+	unsigned int seconds = argc > 2 ? atoi(argv[2]) : 3;
+
+	if (!mb || !seconds) {
+		std::cerr << "usage: " << argv[0] << " [cache MB] [seconds per run]" << std::endl;
+		return 1;
+	}
+
+	struct setup
+	{
+		const char* name_;
+		bool huge_pages_;
+		bool prefault_;
+	};
+	const setup setups[] = {
+		{"heap", false, false}
+		,{"arena prefault", false, true}
+		,{"arena huge", true, false}
+		,{"arena huge prefault", true, true}
+	};
+
+	std::cout << "memory\tfill s\tGET avg ns\tp50\tp99\tp99.9\thit ratio" << std::endl;
+	for (auto& s: setups) {
+		result r = run(s.name_, mb, seconds, s.huge_pages_, s.prefault_);
+		std::cout << s.name_ << "\t" << r.fill_s_ << "\t" << r.avg_ns_ << "\t" << r.p50_ns_ << "\t" << r.p99_ns_
+			<< "\t" << r.p999_ns_ << "\t" << r.hit_ratio_ << std::endl;
+	}
+	return 0;
+}
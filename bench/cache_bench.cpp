@@ -0,0 +1,122 @@
+// cache throughput benchmark, ops/sec vs number of threads
+//
+// usage: cache_bench [max threads] [shards] [seconds per run]
+// every thread count is measured twice, with a single shard (one global lock)
+// and with the given number of shards
+//
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <string.h>
+#include <stdlib.h>
+#include "../cache.h"
+
+using namespace mc;
+
+namespace
+{
+	const size_t KEYS = 100000;
+	const size_t VALUE_LEN = 100;
+	const unsigned int SET_PERCENT = 10;
+
+	//builds a SET request the same way the session receives it
+	buffer make_request(const std::string& k, size_t value_len)
+	{
+		protocol_binary_request_header h;
+		memset(&h, 0, sizeof(h));
+		h.request.magic = PROTOCOL_BINARY_REQ;
+		h.request.opcode = PROTOCOL_BINARY_CMD_SET;
+		h.request.extlen = 8;
+		h.request.keylen = k.size();
+		h.request.bodylen = h.request.extlen + k.size() + value_len;
+
+		buffer d(sizeof(h) + h.request.bodylen, 'v');
+		memcpy(d.data(), &h, sizeof(h));
+		memcpy(d.data() + sizeof(h) + h.request.extlen, k.data(), k.size());
+		return d;
+	}
+
+	cache::request get_request(const buffer& d)
+	{
+		return cache::request(d.data(), d.size(), *reinterpret_cast<const protocol_binary_request_header*>(d.data()));
+	}
+
+	std::string make_key(size_t i)
+	{
+		std::stringstream ss;
+		ss << "bench:key:" << i;
+		return ss.str();
+	}
+
+	double run(unsigned int threads, size_t shards, unsigned int seconds)
+	{
+		cache::config cfg;
+		cfg.shards_ = shards;
+		cache c(512*1024*1024, true, cfg);
+
+		std::vector<std::string> keys;
+		std::vector<buffer> reqs;
+		keys.reserve(KEYS);
+		reqs.reserve(KEYS);
+		for (size_t i = 0; i != KEYS; ++i) {
+			keys.push_back(make_key(i));
+			reqs.push_back(make_request(keys.back(), VALUE_LEN));
+			c.set(get_request(reqs.back()));
+		}
+
+		std::atomic<bool> stop(false);
+		std::atomic<unsigned long long> total(0);
+
+		auto worker = [&](unsigned int seed) {
+			std::mt19937 rnd(seed);
+			unsigned long long ops = 0;
+			while (!stop.load(std::memory_order_relaxed)) {
+				size_t i = rnd() % keys.size();
+				const std::string& k = keys[i];
+				if (rnd() % 100 < SET_PERCENT) {
+					c.set(get_request(reqs[i]));
+				}
+				else {
+					c.get(cache::key(reinterpret_cast<const unsigned char*>(k.data()), k.size()));
+				}
+				++ops;
+			}
+			total += ops;
+		};
+
+		std::vector<std::thread> ts;
+		for (unsigned int i = 0; i != threads; ++i) {
+			ts.emplace_back(worker, i + 1);
+		}
+		std::this_thread::sleep_for(std::chrono::seconds(seconds));
+		stop = true;
+		for (auto& t: ts) {
+			t.join();
+		}
+		return double(total)/seconds;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned int max_threads = argc > 1 ? atoi(argv[1]) : std::thread::hardware_concurrency();
+	size_t shards = argc > 2 ? atoi(argv[2]) : max_threads*4;
+	unsigned int seconds = argc > 3 ? atoi(argv[3]) : 2;
+
+	if (!max_threads || !shards || !seconds) {
+		std::cerr << "usage: " << argv[0] << " [max threads] [shards] [seconds per run]" << std::endl;
+		return 1;
+	}
+
+	std::cout << "threads\t1 shard ops/s\t" << shards << " shards ops/s" << std::endl;
+	for (unsigned int t = 1; t <= max_threads; t *= 2) {
+		double before = run(t, 1, seconds);
+		double after = run(t, shards, seconds);
+		std::cout << t << "\t" << (unsigned long long)before << "\t" << (unsigned long long)after << std::endl;
+	}
+	return 0;
+}
@@ -0,0 +1,175 @@
+// eviction policy benchmark, hit ratio and ops/sec of lru vs clock, with and without the admission filter
+//
+// usage: eviction_bench [max threads] [cache MB] [seconds per run] [scan %]
+// the keys are zipf distributed and don't fit in the cache,
+// a miss is followed by a SET like a cache-aside client does,
+// the scan ops SET keys that are never used again
+//
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+#include <stdlib.h>
+#include "../cache.h"
+
+using namespace mc;
+
+namespace
+{
+	const size_t KEYS = 1000000;
+	const size_t VALUE_LEN = 100;
+	const double ZIPF_S = 0.99;
+
+	//builds a SET request the same way the session receives it
+	buffer make_request(const std::string& k, size_t value_len)
+	{
+		protocol_binary_request_header h;
+		memset(&h, 0, sizeof(h));
+		h.request.magic = PROTOCOL_BINARY_REQ;
+		h.request.opcode = PROTOCOL_BINARY_CMD_SET;
+		h.request.extlen = 8;
+		h.request.keylen = k.size();
+		h.request.bodylen = h.request.extlen + k.size() + value_len;
+
+		buffer d(sizeof(h) + h.request.bodylen, 'v');
+		memcpy(d.data(), &h, sizeof(h));
+		memcpy(d.data() + sizeof(h) + h.request.extlen, k.data(), k.size());
+		return d;
+	}
+
+	cache::request get_request(const buffer& d)
+	{
+		return cache::request(d.data(), d.size(), *reinterpret_cast<const protocol_binary_request_header*>(d.data()));
+	}
+
+	std::string make_key(size_t i)
+	{
+		std::stringstream ss;
+		ss << "bench:key:" << i;
+		return ss.str();
+	}
+
+	//cumulative zipf distribution, the rank is found by binary search
+	std::vector<double> make_zipf(size_t n, double s)
+	{
+		std::vector<double> cdf(n);
+		double sum = 0;
+		for (size_t i = 0; i != n; ++i) {
+			sum += 1.0/::pow(double(i + 1), s);
+			cdf[i] = sum;
+		}
+		for (auto& v: cdf) {
+			v /= sum;
+		}
+		return cdf;
+	}
+
+	struct result
+	{
+		double ops_;
+		double hit_ratio_;
+	};
+
+	struct policy
+	{
+		const char* name_;
+		cache::eviction eviction_;
+		bool admission_;
+	};
+
+	const policy POLICIES[] = {
+		{"lru", cache::eviction::lru, false}
+		,{"clock", cache::eviction::clock, false}
+		,{"lru+tinylfu", cache::eviction::lru, true}
+		,{"clock+tinylfu", cache::eviction::clock, true}
+	};
+
+	result run(const policy& pol, unsigned int threads, size_t mem, unsigned int seconds, unsigned int scan
+			,const std::vector<buffer>& reqs, const std::vector<double>& zipf)
+	{
+		cache::config cfg;
+		cfg.shards_ = threads > 1 ? threads*4 : 1;
+		cfg.eviction_ = pol.eviction_;
+		cfg.admission_ = pol.admission_;
+		cache c(mem, threads > 1, cfg);
+
+		std::atomic<bool> stop(false);
+		std::atomic<unsigned long long> total(0);
+
+		auto worker = [&](unsigned int seed) {
+			std::mt19937 rnd(seed);
+			std::uniform_real_distribution<double> u(0, 1);
+			unsigned long long ops = 0;
+			unsigned long long scanned = 0;
+			while (!stop.load(std::memory_order_relaxed)) {
+				if (rnd() % 100 < scan) {
+					std::stringstream ss;
+					ss << "bench:scan:" << seed << ":" << scanned++;
+					buffer d = make_request(ss.str(), VALUE_LEN);
+					c.set(get_request(d));
+					++ops;
+					continue;
+				}
+				size_t i = std::lower_bound(zipf.begin(), zipf.end(), u(rnd)) - zipf.begin();
+				i = std::min(i, reqs.size() - 1);
+				cache::request r = get_request(reqs[i]);
+				if (!c.get(r.get_key())) { //the view is gone before the SET
+					c.set(r);
+				}
+				++ops;
+			}
+			total += ops;
+		};
+
+		std::vector<std::thread> ts;
+		for (unsigned int i = 0; i != threads; ++i) {
+			ts.emplace_back(worker, i + 1);
+		}
+		std::this_thread::sleep_for(std::chrono::seconds(seconds));
+		stop = true;
+		for (auto& t: ts) {
+			t.join();
+		}
+
+		cache::stats st = c.get_stats();
+		result res;
+		res.ops_ = double(total)/seconds;
+		res.hit_ratio_ = double(st.get_hits_)/std::max<uint64_t>(1, st.get_hits_ + st.get_misses_);
+		return res;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned int max_threads = argc > 1 ? atoi(argv[1]) : std::thread::hardware_concurrency();
+	size_t mem = size_t(argc > 2 ? atoi(argv[2]) : 32)*1024*1024;
+	unsigned int seconds = argc > 3 ? atoi(argv[3]) : 2;
+	unsigned int scan = argc > 4 ? atoi(argv[4]) : 10;
+
+	if (!max_threads || !mem || !seconds || scan >= 100) {
+		std::cerr << "usage: " << argv[0] << " [max threads] [cache MB] [seconds per run] [scan %]" << std::endl;
+		return 1;
+	}
+
+	std::vector<buffer> reqs;
+	reqs.reserve(KEYS);
+	for (size_t i = 0; i != KEYS; ++i) {
+		reqs.push_back(make_request(make_key(i), VALUE_LEN));
+	}
+	std::vector<double> zipf = make_zipf(KEYS, ZIPF_S);
+
+	std::cout << "policy\tthreads\tops/s\thit ratio" << std::endl;
+	for (auto& pol: POLICIES) {
+		for (unsigned int t = 1; t <= max_threads; t *= 2) {
+			result r = run(pol, t, mem, seconds, scan, reqs, zipf);
+			std::cout << pol.name_ << "\t" << t << "\t" << (unsigned long long)r.ops_ << "\t" << r.hit_ratio_ << std::endl;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,69 @@
+// key hashing benchmark, millions of keys/sec of the old murmur3 (32 bit) vs wyhash (64 bit)
+//
+// usage: hash_bench [seconds per run]
+// the keys are random bytes of the lengths the clients use (20 to 250),
+// a few thousand of them so they stay in the CPU cache like the key of a request does
+//
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <stdint.h>
+#include <stdlib.h>
+#include "../murmur3_hash.h"
+#include "../wyhash.h"
+
+namespace
+{
+	const size_t KEYS = 4096;
+	const size_t KEY_LENS[] = {20, 32, 48, 64, 100, 128, 250};
+
+	std::vector<std::vector<unsigned char>> make_keys(size_t len)
+	{
+		std::mt19937 rnd(len);
+		std::vector<std::vector<unsigned char>> keys(KEYS);
+		for (auto& k: keys) {
+			k.resize(len);
+			for (auto& c: k) {
+				c = (unsigned char)rnd();
+			}
+		}
+		return keys;
+	}
+
+	//keys hashed per second, the hashes are summed so the compiler keeps the calls
+	template <typename Hash>
+	double run(const std::vector<std::vector<unsigned char>>& keys, unsigned int seconds, Hash h, uint64_t& sink)
+	{
+		auto start = std::chrono::steady_clock::now();
+		auto end = start + std::chrono::seconds(seconds);
+		unsigned long long n = 0;
+		do {
+			for (auto& k: keys) {
+				sink += h(k.data(), k.size());
+			}
+			n += keys.size();
+		} while (std::chrono::steady_clock::now() < end);
+		return n/std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned int seconds = argc > 1 ? atoi(argv[1]) : 1;
+
+	if (!seconds) {
+		std::cerr << "usage: " << argv[0] << " [seconds per run]" << std::endl;
+		return 1;
+	}
+
+	uint64_t sink = 0;
+	std::cout << "key len\tmurmur3 Mkeys/s\twyhash Mkeys/s\tspeedup" << std::endl;
+	for (size_t len: KEY_LENS) {
+		auto keys = make_keys(len);
+		double murmur = run(keys, seconds, [](const void* d, size_t n) { return uint64_t(MurmurHash3_x86_32(d, n)); }, sink);
+		double wy = run(keys, seconds, [](const void* d, size_t n) { return wyhash(d, n, 0); }, sink);
+		std::cout << len << "\t" << murmur/1e6 << "\t" << wy/1e6 << "\t" << wy/murmur << std::endl;
+	}
+	return sink == 42; //never, the sum only keeps the hashing alive
+}
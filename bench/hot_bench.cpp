@@ -0,0 +1,115 @@
+// hot keys benchmark, GETs/sec vs number of threads with and without the read cache of the threads
+//
+// usage: hot_bench [max threads] [hot keys] [seconds per run]
+// most of the GETs go to a few hot keys, the rest to the other keys, every thread has
+// its own read cache (l1_cache) like a server thread
+//
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <string.h>
+#include <stdlib.h>
+#include "../cache.h"
+#include "../l1.h"
+
+using namespace mc;
+
+namespace
+{
+	const size_t KEYS = 100000;
+	const size_t VALUE_LEN = 100;
+	const unsigned int HOT_PERCENT = 90;
+
+	//builds a SET request the same way the session receives it
+	buffer make_request(const std::string& k, size_t value_len)
+	{
+		protocol_binary_request_header h;
+		memset(&h, 0, sizeof(h));
+		h.request.magic = PROTOCOL_BINARY_REQ;
+		h.request.opcode = PROTOCOL_BINARY_CMD_SET;
+		h.request.extlen = 8;
+		h.request.keylen = k.size();
+		h.request.bodylen = h.request.extlen + k.size() + value_len;
+
+		buffer d(sizeof(h) + h.request.bodylen, 'v');
+		memcpy(d.data(), &h, sizeof(h));
+		memcpy(d.data() + sizeof(h) + h.request.extlen, k.data(), k.size());
+		return d;
+	}
+
+	std::string make_key(size_t i)
+	{
+		std::stringstream ss;
+		ss << "bench:key:" << i;
+		return ss.str();
+	}
+
+	double run(unsigned int threads, size_t hot, size_t l1_entries, unsigned int seconds)
+	{
+		cache::config cfg;
+		cfg.shards_ = threads*4;
+		cfg.l1_entries_ = l1_entries;
+		cache c(512*1024*1024, true, cfg);
+
+		std::vector<std::string> keys;
+		keys.reserve(KEYS);
+		for (size_t i = 0; i != KEYS; ++i) {
+			keys.push_back(make_key(i));
+			buffer d = make_request(keys.back(), VALUE_LEN);
+			c.set(cache::request(d.data(), d.size(), *reinterpret_cast<const protocol_binary_request_header*>(d.data())));
+		}
+
+		std::atomic<bool> stop(false);
+		std::atomic<unsigned long long> total(0);
+
+		auto worker = [&](unsigned int seed) {
+			std::unique_ptr<l1_cache> l1(l1_entries ? new l1_cache(c) : nullptr);
+			std::mt19937 rnd(seed);
+			unsigned long long ops = 0;
+			while (!stop.load(std::memory_order_relaxed)) {
+				const std::string& k = keys[rnd() % 100 < HOT_PERCENT ? rnd() % hot : rnd() % keys.size()];
+				cache::key ck(reinterpret_cast<const unsigned char*>(k.data()), k.size());
+				uint64_t hv = cache::hasher()(ck);
+				cache::item_view it = l1 ? l1->get(ck, hv) : c.get(ck, hv);
+				++ops;
+			}
+			total += ops;
+		};
+
+		std::vector<std::thread> ts;
+		for (unsigned int i = 0; i != threads; ++i) {
+			ts.emplace_back(worker, i + 1);
+		}
+		std::this_thread::sleep_for(std::chrono::seconds(seconds));
+		stop = true;
+		for (auto& t: ts) {
+			t.join();
+		}
+		return double(total)/seconds;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned int max_threads = argc > 1 ? atoi(argv[1]) : std::thread::hardware_concurrency();
+	size_t hot = argc > 2 ? atoi(argv[2]) : 8;
+	unsigned int seconds = argc > 3 ? atoi(argv[3]) : 2;
+
+	if (!max_threads || !hot || hot > KEYS || !seconds) {
+		std::cerr << "usage: " << argv[0] << " [max threads] [hot keys] [seconds per run]" << std::endl;
+		return 1;
+	}
+
+	std::cout << "threads\tno read cache GETs/s\tread cache GETs/s" << std::endl;
+	for (unsigned int t = 1; t <= max_threads; t *= 2) {
+		double before = run(t, hot, 0, seconds);
+		double after = run(t, hot, 64, seconds);
+		std::cout << t << "\t" << (unsigned long long)before << "\t" << (unsigned long long)after << std::endl;
+	}
+	return 0;
+}
@@ -0,0 +1,76 @@
+// index growth benchmark, the slowest SETs while the cache fills up
+//
+// usage: index_bench [millions of keys] [shards] [start index items]
+// the keys are new, so the index of a shard doubles again and again, the worst and
+// the 99.99th percentile SET times show the pauses of the growth
+//
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <string.h>
+#include <stdlib.h>
+#include "../cache.h"
+
+using namespace mc;
+
+namespace
+{
+	const size_t VALUE_LEN = 16;
+
+	//builds a SET request the same way the session receives it
+	buffer make_request(const std::string& k, size_t value_len)
+	{
+		protocol_binary_request_header h;
+		memset(&h, 0, sizeof(h));
+		h.request.magic = PROTOCOL_BINARY_REQ;
+		h.request.opcode = PROTOCOL_BINARY_CMD_SET;
+		h.request.extlen = 8;
+		h.request.keylen = k.size();
+		h.request.bodylen = h.request.extlen + k.size() + value_len;
+
+		buffer d(sizeof(h) + h.request.bodylen, 'v');
+		memcpy(d.data(), &h, sizeof(h));
+		memcpy(d.data() + sizeof(h) + h.request.extlen, k.data(), k.size());
+		return d;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	size_t keys = (argc > 1 ? atoi(argv[1]) : 4)*1000000ul;
+	size_t shards = argc > 2 ? atoi(argv[2]) : 1;
+	size_t index_items = argc > 3 ? atoi(argv[3]) : 0;
+
+	if (!keys || !shards) {
+		std::cerr << "usage: " << argv[0] << " [millions of keys] [shards] [start index items]" << std::endl;
+		return 1;
+	}
+
+	cache::config cfg;
+	cfg.shards_ = shards;
+	cfg.index_items_ = index_items;
+	cache c(keys*256, false, cfg);
+
+	typedef std::chrono::steady_clock clock;
+	std::vector<uint32_t> ns;
+	ns.reserve(keys);
+	clock::time_point start = clock::now();
+	for (size_t i = 0; i != keys; ++i) {
+		std::stringstream ss;
+		ss << "bench:key:" << i;
+		buffer d = make_request(ss.str(), VALUE_LEN);
+		cache::request r(d.data(), d.size(), *reinterpret_cast<const protocol_binary_request_header*>(d.data()));
+		clock::time_point t = clock::now();
+		c.set(r);
+		ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - t).count());
+	}
+	double secs = std::chrono::duration<double>(clock::now() - start).count();
+
+	std::sort(ns.begin(), ns.end());
+	std::cout << "keys\tSETs/s\tp99.99 us\tmax us" << std::endl;
+	std::cout << keys << "\t" << (unsigned long long)(keys/secs) << "\t" << ns[ns.size()*9999/10000]/1000.0
+		<< "\t" << ns.back()/1000.0 << std::endl;
+	return 0;
+}
@@ -0,0 +1,119 @@
+// multi-get benchmark, keys/sec of GETs one by one vs the batch lookup
+//
+// usage: multiget_bench [keys per multi-get] [shards] [seconds per run]
+// the keys of a multi-get are random ones of a cache that is much bigger than the cpu caches,
+// so most of the index slots and items are cache misses, like the session sees them
+//
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <string.h>
+#include <stdlib.h>
+#include "../cache.h"
+
+using namespace mc;
+
+namespace
+{
+	const size_t KEYS = 2000000;
+	const size_t VALUE_LEN = 100;
+
+	//builds a SET request the same way the session receives it
+	buffer make_request(const std::string& k, size_t value_len)
+	{
+		protocol_binary_request_header h;
+		memset(&h, 0, sizeof(h));
+		h.request.magic = PROTOCOL_BINARY_REQ;
+		h.request.opcode = PROTOCOL_BINARY_CMD_SET;
+		h.request.extlen = 8;
+		h.request.keylen = k.size();
+		h.request.bodylen = h.request.extlen + k.size() + value_len;
+
+		buffer d(sizeof(h) + h.request.bodylen, 'v');
+		memcpy(d.data(), &h, sizeof(h));
+		memcpy(d.data() + sizeof(h) + h.request.extlen, k.data(), k.size());
+		return d;
+	}
+
+	std::string make_key(size_t i)
+	{
+		std::stringstream ss;
+		ss << "bench:key:" << i;
+		return ss.str();
+	}
+
+	//the keys/sec, the values are read like the session copies them out
+	double run(cache& c, const std::vector<std::string>& keys, size_t batch, bool batched, unsigned int seconds)
+	{
+		std::mt19937 rnd(1);
+		std::vector<cache::lookup> ls;
+		ls.reserve(batch);
+		cache::lookups pl;
+		unsigned long long found = 0;
+		unsigned long long total = 0;
+
+		auto start = std::chrono::steady_clock::now();
+		auto end = start + std::chrono::seconds(seconds);
+		while (std::chrono::steady_clock::now() < end) {
+			for (unsigned int r = 0; r != 100; ++r) {
+				ls.clear();
+				pl.clear();
+				for (size_t i = 0; i != batch; ++i) {
+					const std::string& k = keys[rnd() % keys.size()];
+					cache::key ck(reinterpret_cast<const unsigned char*>(k.data()), k.size());
+					ls.emplace_back(ck, cache::hasher()(ck));
+					pl.push_back(&ls.back());
+				}
+				if (batched) {
+					c.get(pl, [&found](cache::lookup& l) {
+							found += l.it_ ? *l.it_->get_value() : 0;
+						});
+				}
+				else {
+					for (cache::lookup* l: pl) {
+						cache::item_view it = c.get(l->k_, l->hv_);
+						found += it ? *it->get_value() : 0;
+					}
+				}
+				total += batch;
+			}
+		}
+		double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		if (!found)
+			std::cerr << "nothing found" << std::endl;
+		return total/secs;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	size_t batch = argc > 1 ? atoi(argv[1]) : 100;
+	unsigned int shards = argc > 2 ? atoi(argv[2]) : 16;
+	unsigned int seconds = argc > 3 ? atoi(argv[3]) : 2;
+
+	if (!batch || !shards || !seconds) {
+		std::cerr << "usage: " << argv[0] << " [keys per multi-get] [shards] [seconds per run]" << std::endl;
+		return 1;
+	}
+
+	cache::config cfg;
+	cfg.shards_ = shards;
+	cache c(1024*1024*1024, true, cfg);
+	std::vector<std::string> keys;
+	keys.reserve(KEYS);
+	for (size_t i = 0; i != KEYS; ++i) {
+		keys.push_back(make_key(i));
+		buffer d = make_request(keys.back(), VALUE_LEN);
+		c.set(cache::request(d.data(), d.size(), *reinterpret_cast<const protocol_binary_request_header*>(d.data())));
+	}
+
+	std::cout << "keys per multi-get\tone by one keys/s\tbatch keys/s" << std::endl;
+	for (size_t b = 1; b <= batch; b *= 4) {
+		double single = run(c, keys, b, false, seconds);
+		double batched = run(c, keys, b, true, seconds);
+		std::cout << b << "\t" << (unsigned long long)single << "\t" << (unsigned long long)batched << std::endl;
+	}
+	return 0;
+}
@@ -0,0 +1,141 @@
+// namespace benchmark, dropping the keys of a tenant with DELETEs vs one invalidate,
+// and the GETs of the namespace keys with and without the namespaces
+//
+// usage: ns_bench [keys of the tenant, thousands] [shards] [seconds per run]
+// the cache has the keys of the tenant and as many of another one, the time of a DELETE
+// is the cache alone, a client also waits for the round trips
+//
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <string.h>
+#include <stdlib.h>
+#include "../cache.h"
+
+using namespace mc;
+
+namespace
+{
+	const size_t VALUE_LEN = 100;
+
+	//builds a request the same way the session receives it
+	buffer make_request(uint8_t opcode, const std::string& k, size_t value_len)
+	{
+		protocol_binary_request_header h;
+		memset(&h, 0, sizeof(h));
+		h.request.magic = PROTOCOL_BINARY_REQ;
+		h.request.opcode = opcode;
+		h.request.extlen = opcode == PROTOCOL_BINARY_CMD_SET ? 8 : 0;
+		h.request.keylen = k.size();
+		h.request.bodylen = h.request.extlen + k.size() + value_len;
+
+		buffer d(sizeof(h) + h.request.bodylen, 'v');
+		memcpy(d.data(), &h, sizeof(h));
+		memcpy(d.data() + sizeof(h) + h.request.extlen, k.data(), k.size());
+		return d;
+	}
+
+	cache::request as_request(const buffer& d)
+	{
+		return cache::request(d.data(), d.size(), *reinterpret_cast<const protocol_binary_request_header*>(d.data()));
+	}
+
+	std::string make_key(const std::string& tenant, size_t i)
+	{
+		std::stringstream ss;
+		ss << tenant << ":key:" << i;
+		return ss.str();
+	}
+
+	void fill(cache& c, const std::vector<std::string>& keys)
+	{
+		for (const std::string& k: keys) {
+			buffer d = make_request(PROTOCOL_BINARY_CMD_SET, k, VALUE_LEN);
+			c.set(as_request(d));
+		}
+	}
+
+	size_t found(cache& c, const std::vector<std::string>& keys)
+	{
+		size_t n = 0;
+		for (const std::string& k: keys) {
+			n += bool(c.get(cache::key(reinterpret_cast<const unsigned char*>(k.data()), k.size())));
+		}
+		return n;
+	}
+
+	//GETs/sec of random keys
+	double gets(cache& c, const std::vector<std::string>& keys, unsigned int seconds)
+	{
+		std::mt19937 rnd(1);
+		unsigned long long total = 0;
+		unsigned long long hits = 0;
+		auto start = std::chrono::steady_clock::now();
+		auto end = start + std::chrono::seconds(seconds);
+		while (std::chrono::steady_clock::now() < end) {
+			for (unsigned int r = 0; r != 1000; ++r) {
+				const std::string& k = keys[rnd() % keys.size()];
+				cache::item_view it = c.get(cache::key(reinterpret_cast<const unsigned char*>(k.data()), k.size()));
+				hits += it ? *it->get_value() : 0;
+			}
+			total += 1000;
+		}
+		double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		if (!hits)
+			std::cerr << "nothing found" << std::endl;
+		return total/secs;
+	}
+
+	double since(std::chrono::steady_clock::time_point start)
+	{
+		return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	size_t count = argc > 1 ? atoi(argv[1])*1000 : 200000;
+	unsigned int shards = argc > 2 ? atoi(argv[2]) : 16;
+	unsigned int seconds = argc > 3 ? atoi(argv[3]) : 2;
+
+	if (!count || !shards || !seconds) {
+		std::cerr << "usage: " << argv[0] << " [keys of the tenant, thousands] [shards] [seconds per run]" << std::endl;
+		return 1;
+	}
+
+	std::vector<std::string> tenant;
+	std::vector<std::string> other;
+	for (size_t i = 0; i != count; ++i) {
+		tenant.push_back(make_key("tenant1", i));
+		other.push_back(make_key("tenant2", i));
+	}
+
+	std::cout << "namespaces\tGETs/s\tdrop the tenant us\tkeys left\tother tenant keys" << std::endl;
+	for (bool ns: {false, true}) {
+		cache::config cfg;
+		cfg.shards_ = shards;
+		cfg.ns_delimiter_ = ns ? ':' : 0;
+		cache c(1024*1024*1024, true, cfg);
+		fill(c, tenant);
+		fill(c, other);
+		double rate = gets(c, tenant, seconds);
+
+		auto start = std::chrono::steady_clock::now();
+		if (ns) {
+			const char name[] = "tenant1";
+			c.invalidate(cache::key(reinterpret_cast<const unsigned char*>(name), sizeof(name) - 1));
+		}
+		else {
+			for (const std::string& k: tenant) {
+				buffer d = make_request(PROTOCOL_BINARY_CMD_DELETE, k, 0);
+				c.remove(as_request(d), 0);
+			}
+		}
+		double us = since(start);
+		std::cout << (ns ? "on" : "off") << "\t" << (unsigned long long)rate << "\t" << (unsigned long long)us
+			<< "\t" << found(c, tenant) << "\t" << found(c, other) << std::endl;
+	}
+	return 0;
+}
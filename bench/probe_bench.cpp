@@ -0,0 +1,104 @@
+// hash index benchmark, ns per GET hit and miss at a few load factors of the index
+//
+// usage: probe_bench [index slots, millions] [seconds per run]
+// the index is made with that many slots (a power of 2) and filled up to the load factor,
+// the GETs are random keys, so the slots are cache misses once the index is bigger than the cpu caches
+//
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <string.h>
+#include <stdlib.h>
+#include "../cache.h"
+
+using namespace mc;
+
+namespace
+{
+	const size_t VALUE_LEN = 8;
+	const double LOADS[] = {0.25, 0.5, 0.75, 0.85};
+
+	//builds a SET request the same way the session receives it
+	buffer make_request(const std::string& k, size_t value_len)
+	{
+		protocol_binary_request_header h;
+		memset(&h, 0, sizeof(h));
+		h.request.magic = PROTOCOL_BINARY_REQ;
+		h.request.opcode = PROTOCOL_BINARY_CMD_SET;
+		h.request.extlen = 8;
+		h.request.keylen = k.size();
+		h.request.bodylen = h.request.extlen + k.size() + value_len;
+
+		buffer d(sizeof(h) + h.request.bodylen, 'v');
+		memcpy(d.data(), &h, sizeof(h));
+		memcpy(d.data() + sizeof(h) + h.request.extlen, k.data(), k.size());
+		return d;
+	}
+
+	std::string make_key(size_t i)
+	{
+		std::stringstream ss;
+		ss << "bench:key:" << i;
+		return ss.str();
+	}
+
+	//ns per GET of the keys [from, to), they are there or not
+	double run(cache& c, size_t from, size_t to, unsigned int seconds)
+	{
+		std::vector<std::string> keys;
+		std::vector<uint64_t> hvs;
+		std::mt19937 rnd(1);
+		for (size_t i = 0; i != 1000000; ++i) {
+			keys.push_back(make_key(from + rnd() % (to - from)));
+			hvs.push_back(cache::hasher()(cache::key(reinterpret_cast<const unsigned char*>(keys.back().data()), keys.back().size())));
+		}
+
+		unsigned long long found = 0;
+		unsigned long long total = 0;
+		auto start = std::chrono::steady_clock::now();
+		auto end = start + std::chrono::seconds(seconds);
+		while (std::chrono::steady_clock::now() < end) {
+			for (size_t i = 0; i != keys.size(); ++i) {
+				cache::key k(reinterpret_cast<const unsigned char*>(keys[i].data()), keys[i].size());
+				found += bool(c.get(k, hvs[i]));
+			}
+			total += keys.size();
+		}
+		double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+		if (found != 0 && found != total)
+			std::cerr << "the keys are half there" << std::endl;
+		return ns/total;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	size_t slots = argc > 1 ? atoi(argv[1]) : 2;
+	unsigned int seconds = argc > 2 ? atoi(argv[2]) : 2;
+
+	if (!slots || !seconds) {
+		std::cerr << "usage: " << argv[0] << " [index slots, millions] [seconds per run]" << std::endl;
+		return 1;
+	}
+	slots *= 1024*1024;
+
+	std::cout << "load\thit ns\tmiss ns" << std::endl;
+	for (double load: LOADS) {
+		cache::config cfg;
+		cfg.shards_ = 1;
+		cfg.index_items_ = slots/8*7; //the index gets that many slots
+		cache c(slots*(VALUE_LEN + 128), false, cfg);
+
+		size_t n = slots*load;
+		for (size_t i = 0; i != n; ++i) {
+			buffer d = make_request(make_key(i), VALUE_LEN);
+			c.set(cache::request(d.data(), d.size(), *reinterpret_cast<const protocol_binary_request_header*>(d.data())));
+		}
+		double hit = run(c, 0, n, seconds);
+		double miss = run(c, n, 2*n, seconds);
+		std::cout << load << "\t" << hit << "\t" << miss << std::endl;
+	}
+	return 0;
+}
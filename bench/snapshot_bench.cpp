@@ -0,0 +1,88 @@
+// snapshot benchmark, dump and load throughput of a full cache
+//
+// usage: snapshot_bench [cache MB] [value size] [max threads] [file]
+// the cache is filled with items of the value size and dumped to the file (default /tmp/snapshot_bench),
+// then the snapshot is loaded into an empty cache with 1, 2, 4... threads up to the max
+// (default the number of cores). The file is written once, the loads read it from the page cache
+// unless it's bigger than the memory, so it's the parsing and the SETs that are measured
+//
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "../cache.h"
+#include "../snapshot.h"
+
+using namespace mc;
+
+namespace
+{
+	//builds a SET request the same way the session receives it
+	buffer make_request(const std::string& k, size_t value_len)
+	{
+		protocol_binary_request_header h;
+		memset(&h, 0, sizeof(h));
+		h.request.magic = PROTOCOL_BINARY_REQ;
+		h.request.opcode = PROTOCOL_BINARY_CMD_SET;
+		h.request.extlen = 8;
+		h.request.keylen = k.size();
+		h.request.bodylen = h.request.extlen + k.size() + value_len;
+
+		buffer d(sizeof(h) + h.request.bodylen, 'v');
+		memcpy(d.data(), &h, sizeof(h));
+		memcpy(d.data() + sizeof(h) + h.request.extlen, k.data(), k.size());
+		return d;
+	}
+
+	double gbps(uint64_t bytes, uint64_t us)
+	{
+		return us ? double(bytes)/us/1000 : 0;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	size_t mb = argc > 1 ? atoi(argv[1]) : 1024;
+	size_t value_len = argc > 2 ? atoi(argv[2]) : 400;
+	unsigned int max_threads = argc > 3 ? atoi(argv[3]) : std::max(1u, std::thread::hardware_concurrency());
+	std::string path = argc > 4 ? argv[4] : "/tmp/snapshot_bench";
+
+	cache::config cfg;
+	cfg.shards_ = 16;
+	cfg.max_value_len_ = std::max<size_t>(cfg.max_value_len_, value_len);
+	snapshot::stats dumped;
+	{
+		cache c(mb*1024*1024, true, cfg);
+		//until the evictions start, the cache is full then
+		char k[32];
+		for (size_t i = 0; i % 1024 || !c.get_stats().evictions_; ++i) {
+			buffer d = make_request(std::string(k, ::snprintf(k, sizeof(k), "bench:key:%zu", i)), value_len);
+			c.set(cache::request(d.data(), d.size(), *reinterpret_cast<const protocol_binary_request_header*>(d.data())));
+		}
+		cache::stats cs = c.get_stats();
+		std::cout << "cache: " << cs.curr_items_ << " items, " << cs.bytes_/(1024*1024) << "MB" << std::endl;
+
+		dumped = snapshot::dump(c, path);
+		std::cout << "dump: " << dumped.items_ << " items, " << dumped.bytes_/(1024*1024) << "MB in " << dumped.us_/1000 << "ms, "
+			<< gbps(dumped.bytes_, dumped.us_) << "GB/s" << std::endl;
+	}
+
+	for (unsigned int threads = 1; ; threads = std::min(threads*2, max_threads)) {
+		cache c(mb*1024*1024, true, cfg);
+		snapshot::stats st = snapshot::load(c, path, threads);
+		std::cout << "load, " << threads << " threads: " << st.items_ << " items in " << st.us_/1000 << "ms, "
+			<< gbps(st.bytes_, st.us_) << "GB/s, " << (st.us_ ? st.items_/st.us_ : 0) << "M items/s" << std::endl;
+		if (st.items_ + st.skipped_ != dumped.items_) {
+			std::cerr << "loaded " << st.items_ << " of " << dumped.items_ << " items" << std::endl;
+			return 1;
+		}
+		if (threads == max_threads)
+			break;
+	}
+	::unlink(path.c_str());
+	return 0;
+}
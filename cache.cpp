@@ -1,210 +1,2052 @@
 #include "cache.h"
 #include "session.h"
-#include "murmur3_hash.h"
+#include "wyhash.h"
 #include <assert.h>
 #include <algorithm>
 #include <stdexcept>
+#include <exception>
 #include <iostream>
+#include <new>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace mc;
 
-size_t cache::hasher::operator()(const key& k) const
+namespace
 {
-	return MurmurHash3_x86_32(k.d_, k.len_);
+	// writes the value at the reader position, the item isn't shared yet
+	void copy_value(cache::value_reader& pos, const unsigned char* d, size_t len)
+	{
+		while (len) {
+			auto p = pos.next();
+			assert(p.second);
+			size_t n = std::min(len, p.second);
+			::memcpy(const_cast<unsigned char*>(p.first), d, n);
+			pos.move(n);
+			d += n;
+			len -= n;
+		}
+	}
+
+	slab_allocator::config on_node(slab_allocator::config cfg, int node)
+	{
+		cfg.node_ = node;
+		return cfg;
+	}
 }
 
-cache::cache(size_t maxmemsize, bool thread_safe)
-	:maxmemsize_(maxmemsize)
-	,used_mem_(0)
+const size_t cache::hash::MOVE_STEP;
+const size_t cache::hash::GROUP;
+const size_t cache::config::INDEX_GUESS;
+const unsigned int cache::shard::BAD_PAGE;
+const size_t cache::shard::VERSIONS;
+
+uint64_t cache::hasher::operator()(const key& k) const
 {
-	assert(maxmemsize);
+	return wyhash(k.d_, k.len_, 0);
+}
 
-	if (thread_safe)
-		m_.reset(new std::mutex);
+cache::hash::hash(size_t size_hint)
+	:count_(0)
+	,moved_(0)
+	,next_(0)
+{
+	size_t n = GROUP;
+	while (n*7 < size_hint*8) {
+		n <<= 1;
+	}
+	t_.resize(n);
+	mask_ = n - 1;
+}
+
+cache::item* cache::hash::find(const key& k, uint64_t hv) const
+{
+	item* it = lookup(t_, k, hv);
+	if (it || old_.empty())
+		return it;
+	return lookup(old_, k, hv);
+}
+
+namespace
+{
+	//the slots of the group whose tag is c, a bit per slot
+	uint32_t match_group(const uint8_t* g, uint8_t c)
+	{
+#ifdef __SSE2__
+		__m128i tags = _mm_loadu_si128(reinterpret_cast<const __m128i*>(g));
+		return _mm_movemask_epi8(_mm_cmpeq_epi8(tags, _mm_set1_epi8(char(c))));
+#else
+		uint32_t m = 0;
+		for (unsigned int i = 0; i != 16; ++i) {
+			m |= uint32_t(g[i] == c) << i;
+		}
+		return m;
+#endif
+	}
+}
+
+// The run of the key ends with an empty slot (see move), only the slots before it
+// whose tag matches are read
+cache::item* cache::hash::lookup(const table& t, const key& k, uint64_t hv)
+{
+	static_assert(GROUP == 16, "a group is a 16 byte vector");
+	size_t mask = t.size() - 1;
+	uint8_t c = tag_of(hv);
+	__builtin_prefetch(&t[hv & mask]); //a hit is there most of the time, it's read along with the tags
+	for (size_t pos = hv & mask; ; pos = (pos + GROUP) & mask) {
+		const uint8_t* g = t.tags_.data() + pos;
+		uint32_t empty = match_group(g, 0);
+		uint32_t m = match_group(g, c);
+		if (empty)
+			m &= (empty & (0 - empty)) - 1; //the slots before the first empty one
+		for (; m; m &= m - 1) {
+			const slot& s = t[(pos + __builtin_ctz(m)) & mask];
+			if (s.hv_ == hv && s.p_->get_key() == k)
+				return s.p_;
+		}
+		if (empty)
+			return nullptr;
+	}
+}
+
+size_t cache::hash::probe(const table& t, const key& k, uint64_t hv, bool& found)
+{
+	size_t mask = t.size() - 1;
+	size_t pos = hv & mask;
+	for (size_t d = 0; ; ++d, pos = (pos + 1) & mask) {
+		const slot& s = t[pos];
+		if (!s.p_ || distance(t, pos) < d) { //the key would have been here
+			found = false;
+			return pos;
+		}
+		if (s.hv_ == hv && s.p_->get_key() == k) {
+			found = true;
+			return pos;
+		}
+	}
+}
+
+size_t cache::hash::locate(const key& k, uint64_t hv, table*& t)
+{
+	bool found = false;
+	size_t pos = probe(t_, k, hv, found);
+	if (found) {
+		t = &t_;
+		return pos;
+	}
+	if (!old_.empty()) {
+		size_t old_pos = probe(old_, k, hv, found);
+		if (found) {
+			t = &old_;
+			return old_pos;
+		}
+	}
+	t = nullptr;
+	return pos;
+}
+
+void cache::hash::place(table& t, size_t pos, slot s)
+{
+	size_t mask = t.size() - 1;
+	size_t d = (pos - s.hv_) & mask;
+	for (; ; ++d, pos = (pos + 1) & mask) {
+		const slot& cur = t[pos];
+		if (!cur.p_) {
+			t.set(pos, s);
+			return;
+		}
+		size_t cd = distance(t, pos);
+		if (cd < d) { //take the place of the richer one and move it further
+			slot richer = cur;
+			t.set(pos, s);
+			s = richer;
+			d = cd;
+		}
+	}
+}
+
+void cache::hash::remove_at(table& t, size_t pos)
+{
+	//shift the following entries back until an empty slot or an entry at its home
+	size_t mask = t.size() - 1;
+	size_t next = (pos + 1) & mask;
+	while (t[next].p_ && distance(t, next)) {
+		t.set(pos, t[next]);
+		pos = next;
+		next = (next + 1) & mask;
+	}
+	t.clear(pos);
+	--count_;
+}
+
+void cache::hash::erase(item* it, uint64_t hv)
+{
+	move(MOVE_STEP);
+	for (table* t: {&t_, &old_}) {
+		if (t->empty())
+			continue;
+		size_t mask = t->size() - 1;
+		size_t pos = hv & mask;
+		for (size_t d = 0; (*t)[pos].p_ && distance(*t, pos) >= d; ++d, pos = (pos + 1) & mask) {
+			if ((*t)[pos].p_ == it) {
+				remove_at(*t, pos);
+				return;
+			}
+		}
+	}
+	throw std::runtime_error("cache integrity error");
+}
+
+void cache::hash::prefetch_item(uint64_t hv) const
+{
+	size_t pos = hv & mask_;
+	for (size_t d = 0; t_[pos].p_ && distance(t_, pos) >= d; ++d, pos = (pos + 1) & mask_) {
+		if (t_[pos].hv_ == hv) {
+			const item* it = t_[pos].p_;
+			__builtin_prefetch(it);
+			__builtin_prefetch(it + 1); //the key
+			return;
+		}
+	}
+}
+
+void cache::hash::grow()
+{
+	move(old_.size());
+	table t;
+	t.resize(t_.size()*2);
+	old_.swap(t_);
+	t_.swap(t);
+	mask_ = t_.size() - 1;
+	//the old table is never full, the moves start after an empty slot and end with a whole run
+	moved_ = 0;
+	next_ = 0;
+	while (old_[next_].p_) {
+		++next_;
+	}
+}
+
+// A run of slots ends with an empty slot, the entries of a run never probe past it,
+// so the probes of the old table find the keys of the runs that aren't moved yet
+void cache::hash::move(size_t max)
+{
+	if (old_.empty())
+		return;
+	size_t mask = old_.size() - 1;
+	for (size_t n = 0; moved_ != old_.size() && (n < max || old_[next_].p_); ++n) {
+		const slot& s = old_[next_];
+		if (s.p_) {
+			place(t_, s.hv_ & mask_, s);
+			old_.clear(next_);
+		}
+		++moved_;
+		next_ = (next_ + 1) & mask;
+	}
+	if (moved_ == old_.size()) {
+		old_.release();
+	}
+}
+
+void cache::lru::push_back(item* it)
+{
+	it->next_ = nullptr;
+	it->prev_ = tail_;
+	if (tail_)
+		tail_->next_ = it;
+	else
+		head_ = it;
+	tail_ = it;
+	++size_;
+}
+
+void cache::lru::erase(item* it)
+{
+	if (it->prev_)
+		it->prev_->next_ = it->next_;
+	else
+		head_ = it->next_;
+	if (it->next_)
+		it->next_->prev_ = it->prev_;
+	else
+		tail_ = it->prev_;
+	it->prev_ = it->next_ = nullptr;
+	--size_;
+}
+
+cache::timer_wheel::timer_wheel(uint32_t now)
+	:now_(now)
+{
+	for (auto& level: slots_) {
+		for (auto& slot: level) {
+			slot = nullptr;
+		}
+	}
+}
+
+void cache::timer_wheel::add(item* it)
+{
+	uint32_t exp = it->exptime_;
+	unsigned int level = 0;
+	size_t idx = now_ & (SLOTS - 1); //due now if it's expired already
+	if (int32_t(exp - now_) > 0) {
+		//the lowest level that reaches it
+		while (level != LEVELS && (exp >> (SLOT_BITS*level)) - (now_ >> (SLOT_BITS*level)) >= SLOTS) {
+			++level;
+		}
+		if (level == LEVELS) { //too far, wait in the farthest slot
+			level = LEVELS - 1;
+			idx = ((now_ >> (SLOT_BITS*level)) + SLOTS - 1) & (SLOTS - 1);
+		}
+		else {
+			idx = (exp >> (SLOT_BITS*level)) & (SLOTS - 1);
+		}
+	}
+
+	item*& head = slots_[level][idx];
+	it->tnext_ = head;
+	if (head)
+		head->tpprev_ = &it->tnext_;
+	head = it;
+	it->tpprev_ = &head;
+}
+
+void cache::timer_wheel::remove(item* it)
+{
+	*it->tpprev_ = it->tnext_;
+	if (it->tnext_)
+		it->tnext_->tpprev_ = it->tpprev_;
+	it->tnext_ = nullptr;
+	it->tpprev_ = nullptr;
+}
+
+uint32_t cache::timer_wheel::next() const
+{
+	uint32_t next = 0;
+	for (unsigned int level = 0; level != LEVELS; ++level) {
+		unsigned int shift = SLOT_BITS*level;
+		//the current slot of a higher level is empty, its items went down already
+		for (unsigned int i = level ? 1 : 0; i != SLOTS; ++i) {
+			if (slots_[level][((now_ >> shift) + i) & (SLOTS - 1)]) {
+				uint32_t due = ((now_ >> shift) + i) << shift; //a higher level slot goes down then
+				if (!next || int32_t(due - next) < 0)
+					next = due;
+				break;
+			}
+		}
+	}
+	return next;
+}
+
+void cache::timer_wheel::cascade(unsigned int level)
+{
+	item*& slot = slots_[level][(now_ >> (SLOT_BITS*level)) & (SLOTS - 1)];
+	item* it = slot;
+	slot = nullptr;
+	while (it) {
+		item* next = it->tnext_;
+		add(it);
+		it = next;
+	}
+}
+
+uint32_t cache::expiry(uint32_t exptime, uint32_t now)
+{
+	static const uint32_t MAX_RELATIVE = 60*60*24*30; //30 days
+	if (!exptime)
+		return 0;
+	if (exptime <= MAX_RELATIVE)
+		return now + exptime;
+	return exptime; //the past ones are expired right away
+}
+
+const char* cache::eviction_name(eviction e)
+{
+	switch (e) {
+		case eviction::lru:
+			return "lru";
+		case eviction::clock:
+			return "clock";
+	}
+	return "unknown";
+}
+
+size_t cache::slab_page_size(const config& cfg, size_t maxmemsize)
+{
+	//every shard has its own slab classes, smaller pages keep them from
+	//fighting over few pages when there is not much memory per shard
+	assert(cfg.shards_);
+	const slab_allocator::config& slabs = cfg.slabs_;
+	size_t page_size = slabs.page_size_;
+	while (page_size > MIN_SLAB_PAGE_SIZE && page_size >= slabs.min_chunk_*4
+			&& maxmemsize/cfg.shards_/page_size < MIN_SHARD_PAGES) {
+		page_size /= 2;
+	}
+	return page_size;
+}
+
+size_t cache::max_shards(const config& cfg, size_t maxmemsize)
+{
+	//the smallest page slab_page_size goes down to
+	const slab_allocator::config& slabs = cfg.slabs_;
+	size_t page_size = slabs.page_size_;
+	while (page_size > MIN_SLAB_PAGE_SIZE && page_size >= slabs.min_chunk_*4) {
+		page_size /= 2;
+	}
+	return std::max<size_t>(maxmemsize/(MIN_SHARD_PAGES*page_size), 1);
+}
+
+arena::config cache::arena_config(const config& cfg, size_t maxmemsize)
+{
+	static const uint64_t FORMAT = 2; //of the items and the value chunks, it goes up when they change
+
+	uint64_t layout[] = {FORMAT, sizeof(item), sizeof(chain), sizeof(value_chunk), slab_allocator::CHUNK_HEADER, MAX_KEYLEN
+		, cfg.shards_, slab_page_size(cfg, maxmemsize), cfg.slabs_.min_chunk_, cfg.slabs_.small_chunk_, 0, cfg.ns_delimiter_, MAX_NAMESPACES};
+	static_assert(sizeof(cfg.slabs_.factor_) == sizeof(layout[0]), "the slab factor doesn't fit");
+	::memcpy(&layout[10], &cfg.slabs_.factor_, sizeof(layout[10]));
+	arena::config ac = cfg.arena_;
+	ac.layout_ = wyhash(layout, sizeof(layout), 0);
+	//the namespace generations go along with the items
+	ac.extra_ = cfg.ns_delimiter_ ? namespace_table::memory(MAX_NAMESPACES) : 0;
+	return ac;
+}
+
+cache::cache(size_t maxmemsize, bool thread_safe, const config& cfg)
+	:cfg_(cfg)
+	,pool_(maxmemsize, slab_page_size(cfg, maxmemsize), arena_config(cfg, maxmemsize), cfg.numa_nodes_ != 0)
+	,flash_(cfg.flash_.enabled() ? new flash_log(cfg.flash_) : nullptr)
+	,ns_(cfg.ns_delimiter_ ? new namespace_table(cfg.ns_delimiter_, MAX_NAMESPACES, pool_.get_arena() ? pool_.get_arena()->extra() : nullptr) : nullptr)
+	,stop_(false)
+	,alarm_(false)
+	,deadline_(0)
+	,ready_(false)
+	,max_item_(0)
+	,compressed_(0)
+	,compress_skipped_(0)
+	,compress_in_(0)
+	,compress_out_(0)
+	,compress_ns_(0)
+	,decompress_ns_(0)
+	,restored_items_(0)
+	,restore_us_(0)
+{
+	assert(maxmemsize);
+	assert(cfg_.shards_);
+	if (cfg_.high_watermark_) {
+		if (!thread_safe) {
+			throw std::runtime_error("the cache reclaimer needs a thread safe cache");
+		}
+		if (cfg_.low_watermark_ >= cfg_.high_watermark_ || cfg_.high_watermark_ > 100) {
+			throw std::runtime_error("bad cache watermarks");
+		}
+	}
+	if (cfg_.numa_nodes_ > numa::host().nodes() || cfg_.numa_nodes_ > cfg_.shards_) {
+		throw std::runtime_error("bad number of cache NUMA nodes");
+	}
+	size_t shards = cfg_.shards_;
+	slab_allocator::config& slabs = cfg_.slabs_;
+	slabs.page_size_ = slab_page_size(cfg_, maxmemsize);
 
 	//some initial hints for the hash
-	//assuming the average value size is 1% of the max
-	size_t itemmem = (MAX_VALUELEN + MAX_KEYLEN)/100 + sizeof(protocol_binary_request_header);
-	if (itemmem) {
-		size_t items = maxmemsize_/itemmem;
-		std::clog << "cache params: itemmem=" << itemmem << " maxmemsize=" << maxmemsize_ << " items=" << items << std::endl;
+	//assuming the average value size is 1% of the max, unless it's given
+	size_t itemmem = (MAX_VALUELEN + MAX_KEYLEN)/100 + sizeof(item);
+	size_t items = cfg_.index_items_ != config::INDEX_GUESS ? cfg_.index_items_/shards : maxmemsize/itemmem/shards;
+	//the admission sketch is sized for small items, about 2 bytes per 128 bytes of memory
+	size_t sketch_width = cfg_.admission_ ? maxmemsize/shards/128 : 0;
+
+	//the shards share the memory budget
+	if (ns_ && !pool_.reserve(ns_->memory())) {
+		throw std::runtime_error("the cache memory is too small for the namespaces");
+	}
+	shards_.reserve(shards);
+	for (size_t i = 0; i != shards; ++i) {
+		shards_.emplace_back(new shard(pool_, cfg_, items, sketch_width, thread_safe, flash_.get(), shard_node(i), ns_.get(), thread_safe ? this : nullptr));
+	}
+	max_item_ = shards_[0]->max_item_size();
+	if (maxmemsize/shards/slabs.page_size_ < MIN_SHARD_PAGES) {
+		std::clog << "warning: the cache memory is too small for " << shards << " shards, some items may not fit" << std::endl;
+	}
+	const arena* a = pool_.get_arena();
+	if (a && a->restored()) {
+		restore();
+	}
+	std::clog << "cache params: maxmemsize=" << maxmemsize << " shards=" << shards
+		<< " slab page=" << slabs.page_size_ << " min chunk=" << slabs.min_chunk_ << " small chunks to=" << slabs.small_chunk_ << " factor=" << slabs.factor_
+		<< " eviction=" << eviction_name(cfg_.eviction_) << " admission=" << (cfg_.admission_ ? "tinylfu" : "none")
+		<< " watermarks=" << cfg_.low_watermark_ << "%," << cfg_.high_watermark_ << "%"
+		<< " compress=" << cfg_.compress_min_ << " max value=" << cfg_.max_value_len_ << " chunked from=" << max_item_
+		<< " memory=" << memory_backing() << (a && a->locked() ? ",locked" : "") << (a && a->persistent() ? ",file" : "")
+		<< " flash=" << (flash_ ? cfg_.flash_.size_/(1024*1024) : 0) << "MB"
+		<< " numa nodes=" << cfg_.numa_nodes_
+		<< " namespaces=" << (ns_ ? std::string(1, ns_->delimiter()) : "off")
+		<< std::endl;
 
-		h_.reserve(items); //this is just a hint for the hash table to pre-allocate some buckets
+	ready_ = true;
+	if (thread_safe && (cfg_.high_watermark_ || deadline_)) { //the restored items may expire
+		start_reclaimer();
 	}
 }
 
 cache::~cache()
 {
+	if (reclaimer_) {
+		{
+			std::unique_lock<std::mutex> lock(reclaimer_m_);
+			stop_ = true;
+		}
+		reclaimer_cv_.notify_one();
+		reclaimer_->join();
+	}
+	//the items stay in the cache file for the next process
+	arena* a = pool_.get_arena();
+	if (a && a->persistent()) {
+		a->close();
+	}
+	if (ns_)
+		pool_.release(ns_->memory());
 }
 
-bool cache::remove(const item& v, uint64_t cas)
+// Warm restart: the arena pages are the ones the previous process left in the cache file.
+// Only the items are there, the index, LRU lists and timers are made again: the linked items
+// are checked and linked in the shards their keys go to, in their LRU order (by the access tick).
+// The items that don't check out are freed, they were being written or removed when the process
+// went down, or they expired meanwhile. The pages nobody has go back to the arena
+void cache::restore()
 {
-	if (m_) {
-		std::unique_lock<std::mutex> lock(*m_);
-		return do_remove(v, cas);
+	typedef std::vector<restored_item> shard_items;
+
+	auto start = std::chrono::steady_clock::now();
+	arena& a = *pool_.get_arena();
+	shard& slabs = *shards_[0]; //the slab classes are the same in every shard
+	uint32_t now = cache::now();
+	size_t pages = a.pages();
+	std::vector<unsigned int> classes(pages, shard::BAD_PAGE);
+	std::vector<unsigned int> owners(pages, shard::BAD_PAGE); //shard of the page
+	std::vector<bool> claimed(pages*2); //the value chunks (half a page) of the restored items
+	std::vector<shard_items> items(shards_.size());
+	auto value_index = [&a](void* p) {
+		return size_t(static_cast<unsigned char*>(p) - a.page(0))/(a.page_size()/2);
+	};
+
+	for (size_t i = 0; i != pages; ++i) {
+		if (a.page_used(i))
+			classes[i] = slabs.restore_class(a.page(i));
 	}
-	else {
-		return do_remove(v, cas);
+
+	//the items first, their value chunks are claimed as they check out
+	size_t linked = 0;
+	for (size_t i = 0; i != pages; ++i) {
+		unsigned int cls = classes[i];
+		if (cls == shard::BAD_PAGE || slabs.value_page(cls))
+			continue;
+		slabs.for_each_chunk(a.page(i), cls, [&](void* p) {
+				item* it = static_cast<item*>(p);
+				if (!it->linked_)
+					return;
+				++linked;
+				it->linked_ = 0; //unless it checks out
+				if (!slabs.restore_item(it, cls, now))
+					return;
+				uint64_t hv = hasher()(it->get_key());
+				size_t s = shard_index(hv);
+				//all the items of a page are of one shard
+				if (owners[i] != shard::BAD_PAGE && owners[i] != s)
+					return;
+				if (it->chunked_ && !slabs.restore_chain(it, a, classes, claimed))
+					return;
+				it->linked_ = 1;
+				owners[i] = s;
+				restored_item ri;
+				ri.it_ = it;
+				ri.hv_ = hv;
+				ri.atime_ = it->atime_;
+				items[s].push_back(ri);
+			});
+	}
+	//a value chunk page goes with its first item, the items of other shards on it are dropped
+	for (size_t i = 0; i != pages; ++i) {
+		unsigned int cls = classes[i];
+		if (cls == shard::BAD_PAGE || !slabs.value_page(cls))
+			continue;
+		slabs.for_each_chunk(a.page(i), cls, [&](void* p) {
+				if (!claimed[value_index(p)])
+					return;
+				item* it = static_cast<value_chunk*>(p)->owner_;
+				size_t s = shard_index(hasher()(it->get_key()));
+				if (owners[i] == shard::BAD_PAGE) {
+					owners[i] = s;
+				}
+				else if (owners[i] != s) {
+					it->linked_ = 0;
+					for (value_chunk* c = it->get_chain().head_; c; c = c->next_) {
+						claimed[value_index(c)] = false;
+					}
+				}
+			});
+	}
+
+	//the pages that nobody has go back, the shards take theirs and link the items in parallel,
+	//they have nothing in common but the pool
+	std::vector<std::vector<size_t>> shard_pages(shards_.size());
+	for (size_t i = 0; i != pages; ++i) {
+		if (!a.page_used(i))
+			continue;
+		if (owners[i] == shard::BAD_PAGE) {
+			a.free(a.page(i));
+		}
+		else {
+			shard_pages[owners[i]].push_back(i);
+		}
+	}
+	size_t threads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), shards_.size());
+	std::vector<size_t> restored(threads);
+	std::vector<std::exception_ptr> errors(threads);
+	auto link = [&](size_t t) {
+		try {
+			for (size_t s = t; s < shards_.size(); s += threads) {
+				shard& sh = *shards_[s];
+				sh.reserve_index(items[s].size());
+				for (size_t i: shard_pages[s]) {
+					if (slabs.value_page(classes[i])) {
+						sh.adopt_page(a.page(i), classes[i], [&](void* p) { return bool(claimed[value_index(p)]); });
+					}
+					else {
+						sh.adopt_page(a.page(i), classes[i], [](void* p) { return static_cast<item*>(p)->linked_ != 0; });
+					}
+				}
+				restored[t] += sh.restore(items[s]);
+			}
+		}
+		catch (...) {
+			errors[t] = std::current_exception();
+		}
+	};
+	std::vector<std::thread> ts;
+	for (size_t t = 1; t < threads; ++t) {
+		ts.emplace_back(link, t);
+	}
+	link(0);
+	for (auto& t: ts) {
+		t.join();
 	}
+	for (size_t t = 0; t != threads; ++t) {
+		if (errors[t])
+			std::rethrow_exception(errors[t]);
+		restored_items_ += restored[t];
+	}
+
+	restore_us_ = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+	std::clog << "cache restored from the file: " << restored_items_ << " items of " << linked
+		<< " in " << restore_us_/1000 << "ms" << std::endl;
 }
 
-bool cache::cas(item v, uint64_t cas)
+// reclaimer thread, it removes the expired items and keeps the shards under the high watermark
+// (if there is one) evicting small batches, the shard lock is released after every batch
+// so the sessions don't wait long. It sleeps until the first slot of the timer wheels
+// with items in it comes up, or until a SET takes a shard over the high watermark
+void cache::reclaim()
 {
-	if (m_) {
-		std::unique_lock<std::mutex> lock(*m_);
-		return do_cas(std::move(v), cas);
+	static const size_t BATCH = 32; //items
+	static const std::chrono::milliseconds RETIRED(10); //the retired items in use are looked at again then
+
+	size_t shard_mem = pool_.maxmemsize()/shards_.size();
+	size_t low = shard_mem/100*cfg_.low_watermark_;
+	size_t high = shard_mem/100*cfg_.high_watermark_;
+
+	while (true) {
+		{
+			//the items that expire while the shards are looked at set it again
+			std::unique_lock<std::mutex> lock(reclaimer_m_);
+			deadline_ = 0;
+			alarm_ = false;
+		}
+		bool busy = false;
+		bool retired = false;
+		uint32_t next = 0;
+		for (auto& s: shards_) {
+			shard::backlog b = s->expire(BATCH);
+			if (b.expired_)
+				busy = true;
+			if (b.retired_)
+				retired = true;
+			if (b.next_expiry_ && (!next || int32_t(b.next_expiry_ - next) < 0))
+				next = b.next_expiry_;
+			if (cfg_.high_watermark_ && s->reclaim(low, high, BATCH))
+				busy = true;
+		}
+
+		//the shard locks are never taken under this one, the shards wake the reclaimer up under theirs
+		std::unique_lock<std::mutex> lock(reclaimer_m_);
+		if (next && (!deadline_ || int32_t(next - deadline_) < 0))
+			deadline_ = next;
+		auto retry = std::chrono::steady_clock::now() + RETIRED;
+		while (!busy && !alarm_ && !stop_) {
+			//a new item may expire sooner, the wait starts over then
+			auto wake = std::chrono::steady_clock::time_point::max();
+			if (retired)
+				wake = retry;
+			if (deadline_) {
+				int32_t left = int32_t(deadline_ - cache::now());
+				if (left <= 0)
+					break;
+				wake = std::min(wake, std::chrono::steady_clock::now() + std::chrono::seconds(left));
+			}
+			if (wake == std::chrono::steady_clock::time_point::max())
+				reclaimer_cv_.wait(lock);
+			else if (reclaimer_cv_.wait_until(lock, wake) == std::cv_status::timeout)
+				break;
+		}
+		if (stop_)
+			return;
 	}
-	else {
-		return do_cas(std::move(v), cas);
+}
+
+void cache::start_reclaimer()
+{
+	std::call_once(reclaimer_started_, [this] {
+			reclaimer_.reset(new std::thread(std::bind(&cache::reclaim, this)));
+		});
+}
+
+void cache::expiring(uint32_t exptime)
+{
+	uint32_t deadline = deadline_.load(std::memory_order_relaxed);
+	if (deadline && int32_t(exptime - deadline) >= 0)
+		return; //the reclaimer wakes up before it
+	{
+		std::lock_guard<std::mutex> lock(reclaimer_m_);
+		deadline = deadline_;
+		if (deadline && int32_t(exptime - deadline) >= 0)
+			return;
+		deadline_ = exptime;
 	}
+	reclaimer_cv_.notify_one();
+	if (ready_)
+		start_reclaimer();
 }
 
-void cache::set(item v)
+void cache::over_watermark()
 {
-	if (m_) {
-		std::unique_lock<std::mutex> lock(*m_);
-		do_set(std::move(v));
+	{
+		std::lock_guard<std::mutex> lock(reclaimer_m_);
+		alarm_ = true;
+	}
+	reclaimer_cv_.notify_one();
+}
+
+bool cache::remove(const request& r, uint64_t cas)
+{
+	return get_shard(r.hv_).remove(r, cas, r.hv_);
+}
+
+bool cache::cas(const request& r, uint64_t cas)
+{
+	std::vector<unsigned char> buf;
+	return get_shard(r.hv_).set(r, make_value(r, buf), cas, r.hv_);
+}
+
+void cache::set(const request& r)
+{
+	std::vector<unsigned char> buf;
+	get_shard(r.hv_).set(r, make_value(r, buf), 0, r.hv_);
+}
+
+cache::item_writer cache::begin_set(const request& r, size_t value_len)
+{
+	return get_shard(r.hv_).reserve(r, value_len, r.hv_);
+}
+
+bool cache::store(item_writer& w, uint64_t cas)
+{
+	assert(w && !w.left());
+	item* it = w.it_;
+	w.it_ = nullptr; //the shard takes it over
+	return get_shard(w.hv_).store(it, cas, w.hv_);
+}
+
+bool cache::next_items(size_t shard, size_t& pos, size_t max, std::vector<item_ptr>& items)
+{
+	return shards_[shard]->next_items(pos, max, items);
+}
+
+void cache::put(const key& k, uint32_t flags, uint32_t exptime, uint64_t cas, const unsigned char* d, size_t len, bool compressed)
+{
+	unsigned char rd[sizeof(protocol_binary_request_header) + 8 + MAX_KEYLEN];
+	request r = make_request(rd, k, flags, exptime, cas, len);
+	std::vector<unsigned char> buf;
+	get_shard(r.hv_).set(r, stored_value(k, d, len, compressed, buf), 0, r.hv_);
+}
+
+cache::request cache::make_request(unsigned char (&rd)[sizeof(protocol_binary_request_header) + 8 + MAX_KEYLEN]
+		,const key& k, uint32_t flags, uint32_t exptime, uint64_t cas, size_t value_len)
+{
+	assert(k.len_ <= MAX_KEYLEN);
+	protocol_binary_request_header h;
+	::memset(&h, 0, sizeof(h));
+	h.request.magic = PROTOCOL_BINARY_REQ;
+	h.request.opcode = PROTOCOL_BINARY_CMD_SET;
+	h.request.extlen = 8;
+	h.request.keylen = k.len_;
+	h.request.bodylen = h.request.extlen + k.len_ + value_len;
+	h.request.cas = cas;
+	uint32_t extras[2] = {htonl(flags), htonl(exptime)};
+	::memcpy(rd, &h, sizeof(h));
+	::memcpy(rd + sizeof(h), extras, sizeof(extras));
+	::memcpy(rd + sizeof(h) + sizeof(extras), k.d_, k.len_);
+	return request(rd, sizeof(h) + sizeof(extras) + k.len_, h);
+}
+
+cache::value cache::stored_value(const key& k, const unsigned char* d, size_t len, bool compressed, std::vector<unsigned char>& buf)
+{
+	value v;
+	if (!compressed) {
+		v = make_value(d, len, k.len_, buf);
+	}
+	else if (chunked(k.len_, len)) { //the chunked values aren't compressed, it may be another item layout
+		uint32_t raw;
+		if (len < sizeof(raw))
+			throw std::runtime_error("broken compressed value");
+		::memcpy(&raw, d, sizeof(raw));
+		buf.resize(raw);
+		if (!lz4::decompress(d + sizeof(raw), len - sizeof(raw), buf.data(), raw))
+			throw std::runtime_error("broken compressed value");
+		v.d_ = buf.data();
+		v.len_ = raw;
+		v.compressed_ = false;
 	}
 	else {
-		do_set(std::move(v));
+		v.d_ = d;
+		v.len_ = len;
+		v.compressed_ = true;
 	}
+	return v;
 }
 
-std::shared_ptr<cache::item> cache::get(const key& k)
+void cache::item_writer::write(const unsigned char* d, size_t len)
+{
+	assert(len <= left_);
+	left_ -= len;
+	copy_value(pos_, d, len);
+}
+
+void cache::free_item(item* it, slab_allocator& a)
+{
+	//the chunks go first, a chunk that isn't freed yet always has its item (see evict_chunk)
+	if (it->chunked_) {
+		value_chunk* c = it->get_chain().head_;
+		while (c) {
+			value_chunk* next = c->next_;
+			a.free(c);
+			c = next;
+		}
+	}
+	a.free(it);
+}
+
+cache::value cache::make_value(const unsigned char* d, size_t len, size_t keylen, std::vector<unsigned char>& buf)
+{
+	value v;
+	v.d_ = d;
+	v.len_ = len;
+	v.compressed_ = false;
+	if (!cfg_.compress_min_ || v.len_ < cfg_.compress_min_ || chunked(keylen, v.len_))
+		return v;
+
+	//it has to save 1/8 at least, the raw length goes first
+	uint32_t raw = v.len_;
+	size_t cap = v.len_ - v.len_/8;
+	if (cap <= sizeof(raw))
+		return v;
+	auto start = std::chrono::steady_clock::now();
+	buf.resize(cap);
+	::memcpy(buf.data(), &raw, sizeof(raw));
+	size_t n = lz4::compress(v.d_, v.len_, buf.data() + sizeof(raw), cap - sizeof(raw));
+	compress_ns_ += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	if (!n) {
+		++compress_skipped_;
+		return v;
+	}
+
+	++compressed_;
+	compress_in_ += v.len_;
+	compress_out_ += sizeof(raw) + n;
+	v.d_ = buf.data();
+	v.len_ = sizeof(raw) + n;
+	v.compressed_ = true;
+	return v;
+}
+
+void cache::read_value(const item& it, std::vector<unsigned char>& v)
+{
+	if (!it.compressed_) {
+		v.reserve(v.size() + it.get_value_len());
+		value_reader pos(it);
+		for (auto p = pos.next(); p.second; p = pos.next()) {
+			v.insert(v.end(), p.first, p.first + p.second);
+			pos.move(p.second);
+		}
+		return;
+	}
+
+	const unsigned char* pd = it.get_value();
+
+	auto start = std::chrono::steady_clock::now();
+	size_t len = it.get_raw_len();
+	size_t pos = v.size();
+	v.resize(pos + len);
+	if (!lz4::decompress(pd + sizeof(uint32_t), it.get_value_len() - sizeof(uint32_t), v.data() + pos, len)) {
+		v.resize(pos);
+		throw std::runtime_error("broken compressed value in the cache");
+	}
+	decompress_ns_ += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+cache::item_view cache::get(const key& k, uint64_t hv)
+{
+	item_view it = get_shard(hv).get(k, hv);
+	if (it || !flash_)
+		return it;
+	return flash_get(k, hv);
+}
+
+//an item read back from flash has no version, it's kept the next time
+cache::item_view cache::get(const key& k, uint64_t hv, item_version& v)
+{
+	item_view it = get_shard(hv).get(k, hv, &v);
+	if (it || !flash_)
+		return it;
+	return flash_get(k, hv);
+}
+
+// the record is read out of the shard lock, the shard takes the item back
+// unless the key changed meanwhile
+cache::item_view cache::flash_get(const key& k, uint64_t hv)
+{
+	shard& s = get_shard(hv);
+	uint64_t pos = s.flash_find(hv);
+	if (!pos)
+		return item_view();
+
+	std::vector<unsigned char> rec;
+	flash_log::record fr;
+	if (!flash_->read(pos, rec)) {
+		s.flash_drop(hv, pos);
+		return item_view();
+	}
+	::memcpy(&fr, rec.data(), sizeof(fr));
+	const unsigned char* d = rec.data() + sizeof(fr);
+	if (!(key(d, fr.keylen_) == k) || (fr.exptime_ && int32_t(fr.exptime_ - now()) <= 0)
+			|| (ns_ && fr.generation_ != ns_->key_generation(k.d_, k.len_))) {
+		s.flash_drop(hv, pos);
+		return item_view();
+	}
+
+	unsigned char rd[sizeof(protocol_binary_request_header) + 8 + MAX_KEYLEN];
+	request r = make_request(rd, k, fr.flags_, fr.exptime_, fr.cas_, fr.value_len_);
+	std::vector<unsigned char> buf;
+	try {
+		return s.promote(r, stored_value(k, d + fr.keylen_, fr.value_len_, fr.compressed_ != 0, buf), fr.generation_, pos, hv);
+	}
+	catch (const std::exception&) { //it doesn't fit in the memory anymore
+		s.flash_drop(hv, pos);
+		return item_view();
+	}
+}
+
+bool cache::get_value(std::vector<unsigned char>& v, const key& k)
+{
+	item_view it = get(k);
+	if (!it)
+		return false;
+	read_value(*it, v);
+	return true;
+}
+
+// the items of the namespace stay, they are stale from now on (see shard::do_get)
+bool cache::invalidate(const key& ns)
+{
+	return ns_ && ns_->invalidate(ns.d_, ns.len_);
+}
+
+cache::item_view cache::touch(const key& k, uint32_t exptime, uint64_t hv)
+{
+	item_view it = get_shard(hv).touch(k, exptime, hv);
+	if (it || !flash_)
+		return it;
+	if (!flash_get(k, hv))
+		return item_view();
+	return get_shard(hv).touch(k, exptime, hv);
+}
+
+cache::stats cache::get_stats() const
+{
+	stats st = cache_stats();
+	for (auto& s: shards_) {
+		st += s->get_stats();
+	}
+	if (ns_) {
+		st.mem_index_ += ns_->memory();
+	}
+	return st;
+}
+
+cache::stats cache::cache_stats() const
+{
+	stats st;
+	st.compressed_ = compressed_;
+	st.compress_skipped_ = compress_skipped_;
+	st.compress_in_ = compress_in_;
+	st.compress_out_ = compress_out_;
+	st.compress_us_ = compress_ns_/1000;
+	st.decompress_us_ = decompress_ns_/1000;
+	st.restored_items_ = restored_items_;
+	st.restore_us_ = restore_us_;
+	st.flash_bytes_ = flash_ ? flash_->bytes_written() : 0;
+	if (ns_) {
+		st.namespaces_ = ns_->size();
+		st.namespaces_max_ = ns_->max();
+		st.ns_invalidations_ = ns_->invalidations();
+	}
+	std::lock_guard<std::mutex> lock(l1_m_);
+	for (const l1_stats* l: l1s_) {
+		st.l1_hits_ += l->hits_.load(std::memory_order_relaxed);
+		st.l1_misses_ += l->misses_.load(std::memory_order_relaxed);
+		st.l1_fills_ += l->fills_.load(std::memory_order_relaxed);
+		st.l1_stale_ += l->stale_.load(std::memory_order_relaxed);
+	}
+	return st;
+}
+
+void cache::add_l1(const l1_stats* s)
+{
+	std::lock_guard<std::mutex> lock(l1_m_);
+	l1s_.push_back(s);
+}
+
+void cache::remove_l1(const l1_stats* s)
+{
+	std::lock_guard<std::mutex> lock(l1_m_);
+	l1s_.erase(std::remove(l1s_.begin(), l1s_.end(), s), l1s_.end());
+}
+
+cache::stats cache::get_node_stats(unsigned int node) const
+{
+	stats st = cache_stats();
+	for (size_t i = 0; i != shards_.size(); ++i) {
+		if (shard_node(i) == int(node)) {
+			st += shards_[i]->get_stats();
+		}
+	}
+	return st;
+}
+
+cache::shard::shard(mem_pool& pool, const config& cfg, size_t items, size_t sketch_width, bool thread_safe, flash_log* flash, int node, const namespace_table* ns, cache* owner)
+	:eviction_(cfg.eviction_)
+	,pool_(pool)
+	,used_mem_(0)
+	,chunk_mem_(0)
+	,data_mem_(0)
+	,meta_mem_(0)
+	,index_mem_(0)
+	,hash_mem_(0)
+	,tick_(0)
+	,reclaiming_(false)
+	,high_mem_(pool.maxmemsize()/cfg.shards_/100*cfg.high_watermark_)
+	,owner_(owner)
+	,flash_(flash)
+	,node_(node)
+	,ns_(ns)
+	,a_(pool, on_node(cfg.slabs_, node))
+	,h_(items) //this is just a hint for the hash table to pre-allocate some buckets
+	,lru_(a_.classes())
+	,window_(a_.classes())
+	,timers_(cache::now())
+	,retired_mem_(0)
+{
+	if (thread_safe)
+		m_.reset(new std::mutex);
+	if (cfg.admission_)
+		sketch_.reset(new frequency_sketch(sketch_width));
+	if (flash_)
+		fi_.reset(new flash_index());
+	if (cfg.l1_entries_)
+		versions_.reset(new std::atomic<uint32_t>[VERSIONS]());
+
+	hash_mem_ = h_.memory();
+	index_mem_ = hash_mem_ + (sketch_ ? sketch_->memory() : 0) + (fi_ ? fi_->memory() : 0);
+	if (!pool_.reserve(index_mem_)) {
+		throw std::runtime_error("the cache memory is too small for the index");
+	}
+	place_index();
+}
+
+cache::shard::~shard()
+{
+	//the items of a cache file stay linked for the next process (the arena is closed)
+	const arena* a = pool_.get_arena();
+	if (a && a->persistent()) {
+		lru_.clear();
+		window_.clear();
+	}
+	//drop the cache references, the items that are still in use are freed by the slab
+	for (auto& l: lru_) {
+		while (!l.empty()) {
+			unlink_item(l.head_);
+		}
+	}
+	for (auto& l: window_) {
+		while (!l.empty()) {
+			unlink_item(l.head_);
+		}
+	}
+	//there are no readers anymore
+	while (!retired_.empty()) {
+		item* it = retired_.head_;
+		retired_.erase(it);
+		item_ptr::release(it, a_);
+	}
+	pool_.release(index_mem_);
+}
+
+bool cache::shard::remove(const request& r, uint64_t cas, uint64_t hv)
 {
 	if (m_) {
 		std::unique_lock<std::mutex> lock(*m_);
-		return do_get(k);
+		count_access();
+		return do_remove(r, cas, hv);
 	}
 	else {
-		return do_get(k);
+		count_access();
+		return do_remove(r, cas, hv);
 	}
 }
 
-bool cache::get_value(std::vector<unsigned char>& v, const key& k)
+bool cache::shard::set(const request& r, const value& v, uint64_t cas, uint64_t hv)
 {
 	if (m_) {
 		std::unique_lock<std::mutex> lock(*m_);
-		return do_get_value(v, k);
+		count_access();
+		return do_set(r, v, cas, hv);
 	}
 	else {
-		return do_get_value(v, k);
+		count_access();
+		return do_set(r, v, cas, hv);
 	}
 }
 
-bool cache::do_cas(item v, uint64_t cas)
+bool cache::shard::next_items(size_t& pos, size_t max, std::vector<item_ptr>& items)
+{
+	std::unique_lock<std::mutex> lock;
+	if (m_)
+		lock = std::unique_lock<std::mutex>(*m_);
+	uint32_t now = cache::now();
+	size_t end = std::min(pos + max, h_.capacity());
+	h_.walk(pos, end, [&](item* it) {
+			if (!(it->exptime_ && int32_t(it->exptime_ - now) <= 0) && !stale(*it, ns_)) {
+				items.emplace_back(it, &a_);
+			}
+		});
+	pos = end;
+	return pos < h_.capacity();
+}
+
+cache::item_writer cache::shard::reserve(const request& r, size_t value_len, uint64_t hv)
+{
+	std::unique_lock<std::mutex> lock;
+	if (m_)
+		lock = std::unique_lock<std::mutex>(*m_);
+	count_access();
+	return item_writer(make_item(r, value_len, false, cache::now()), &a_, hv);
+}
+
+bool cache::shard::store(item* it, uint64_t cas, uint64_t hv)
 {
-	//handle cas
-	std::shared_ptr<item> p = do_get(v.get_key());
-	if (p && p->h_.request.cas != cas) {
+	std::unique_lock<std::mutex> lock;
+	if (m_)
+		lock = std::unique_lock<std::mutex>(*m_);
+	count_access();
+	if (sketch_)
+		sketch_->record(hv);
+	do_expire(cache::now(), EXPIRE_BATCH);
+	return do_store(it, cas, hv);
+}
+
+// the thread is pinned under the lock, so the item can't be retired before it (or freed after the lock is released)
+cache::item_view cache::shard::get(const key& k, uint64_t hv, item_version* v)
+{
+	std::unique_lock<std::mutex> lock;
+	if (m_)
+		lock = std::unique_lock<std::mutex>(*m_);
+	count_access();
+	item* it = do_get(k, hv, cache::now());
+	if (!it)
+		return item_view();
+	if (v && versions_)
+		get_version(it, hv, *v);
+	epoch::pin();
+	return item_view(it, &a_);
+}
+
+// The slots of all the keys are prefetched, then the items in them, so the lookups
+// don't wait for the memory one by one
+void cache::shard::get(lookup* const* keys, size_t n)
+{
+	std::unique_lock<std::mutex> lock;
+	if (m_)
+		lock = std::unique_lock<std::mutex>(*m_);
+	for (size_t i = 0; i != n; ++i) {
+		h_.prefetch(keys[i]->hv_);
+	}
+	for (size_t i = 0; i != n; ++i) {
+		h_.prefetch_item(keys[i]->hv_);
+	}
+	uint32_t now = cache::now();
+	for (size_t i = 0; i != n; ++i) {
+		lookup& l = *keys[i];
+		count_access();
+		item* it = do_get(l.k_, l.hv_, now);
+		if (!it)
+			continue;
+		if (versions_)
+			get_version(it, l.hv_, l.v_);
+		epoch::pin();
+		l.it_ = item_view(it, &a_);
+	}
+}
+
+void cache::shard::get_version(item* it, uint64_t hv, item_version& v)
+{
+	v.it_ = it;
+	v.version_ = &versions_[hv & (VERSIONS - 1)];
+	v.seen_ = v.version_->load(std::memory_order_relaxed);
+	v.exptime_ = it->exptime_;
+	v.a_ = &a_;
+}
+
+cache::item_view cache::shard::touch(const key& k, uint32_t exptime, uint64_t hv)
+{
+	std::unique_lock<std::mutex> lock;
+	if (m_)
+		lock = std::unique_lock<std::mutex>(*m_);
+	count_access();
+
+	uint32_t now = cache::now();
+	item* it = do_get(k, hv, now);
+	if (!it)
+		return item_view();
+	if (it->exptime_)
+		timers_.remove(it);
+	it->exptime_ = expiry(exptime, now);
+	if (it->exptime_) {
+		timers_.add(it);
+		if (owner_)
+			owner_->expiring(it->exptime_);
+	}
+	bump_version(hv);
+	epoch::pin();
+	return item_view(it, &a_);
+}
+
+cache::stats cache::shard::get_stats() const
+{
+	std::unique_lock<std::mutex> lock;
+	if (m_)
+		lock = std::unique_lock<std::mutex>(*m_);
+	stats st(st_);
+	st.curr_items_ = h_.size();
+	st.bytes_ = used_mem_;
+	st.mem_data_ = data_mem_;
+	st.mem_metadata_ = meta_mem_;
+	st.mem_index_ = index_mem_;
+	st.mem_pages_ = a_.memory();
+	st.flash_items_ = fi_ ? fi_->size() : 0;
+	return st;
+}
+
+cache::shard::backlog cache::shard::expire(size_t max)
+{
+	std::unique_lock<std::mutex> lock(*m_);
+	backlog b;
+	b.expired_ = do_expire(cache::now(), max) == max;
+	b.next_expiry_ = timers_.next();
+	//the few retired items that don't make a batch don't wait for the next SET
+	do_collect();
+	b.retired_ = !retired_.empty();
+	return b;
+}
+
+size_t cache::shard::do_expire(uint32_t now, size_t max)
+{
+	return timers_.advance(now, max, [this](item* it) {
+			++st_.expired_;
+			unlink_item(it);
+		});
+}
+
+// The retired items are in the retire epoch order, the ones retired before the oldest
+// epoch a reader is pinned at are freed (unless a session still holds a reference).
+// Every collect starts a new epoch, so the readers that pin after it don't hold the items back
+void cache::shard::do_collect()
+{
+	if (retired_.empty())
+		return;
+	uint32_t oldest = uint32_t(epoch::advance());
+	while (!retired_.empty() && int32_t(oldest - retired_.head_->atime_) > 0) {
+		item* it = retired_.head_;
+		retired_.erase(it);
+		retired_mem_ -= chunk_memory(it);
+		item_ptr::release(it, a_);
+	}
+}
+
+bool cache::shard::reclaim(size_t low, size_t high, size_t batch)
+{
+	std::unique_lock<std::mutex> lock(*m_);
+	if (!reclaiming_) {
+		if (chunk_mem_ <= high)
+			return false;
+		reclaiming_ = true;
+		reclaim_start_ = std::chrono::steady_clock::now();
+	}
+
+	for (size_t i = 0; i != batch && chunk_mem_ > low; ++i) {
+		unsigned int cls = oldest_class();
+		if (cls == a_.classes())
+			break;
+		evict_item(next_victim(cls));
+		++st_.reclaimed_;
+	}
+	do_collect();
+
+	if (chunk_mem_ > low && oldest_class() != a_.classes())
+		return true;
+	reclaiming_ = false;
+	uint64_t lag = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - reclaim_start_).count();
+	st_.reclaimer_lag_us_ = std::max(st_.reclaimer_lag_us_, lag);
+	return false;
+}
+
+bool cache::shard::do_set(const request& r, const value& v, uint64_t cas, uint64_t hv)
+{
+	if (sketch_)
+		sketch_->record(hv);
+	uint32_t now = cache::now();
+	do_expire(now, EXPIRE_BATCH); //the expired items go first, before anything is evicted
+
+	item* it = make_item(r, v.len_, v.compressed_, now);
+	value_reader pos(*it);
+	copy_value(pos, v.d_, v.len_);
+	return do_store(it, cas, hv);
+}
+
+// the item is made first, so the cas check and the replace are one hash probe,
+// the item is freed if it's not stored
+bool cache::shard::do_store(item* it, uint64_t cas, uint64_t hv)
+{
+	std::pair<item*, bool> res;
+	try {
+		if (h_.full()) {
+			grow_index();
+		}
+		if (fi_ && fi_->crowded()) {
+			grow_flash_index(true);
+		}
+		//an expired or stale item is as good as missing, its cas doesn't count
+		uint32_t now = cache::now();
+		res = h_.upsert(it, hv, [this, cas, now](item* old) { return !cas || old->cas_ == cas || expired(*old, now) || stale(*old, ns_); });
+	}
+	catch (const std::exception&) {
+		free_item(it, a_);
+		throw;
+	}
+	count_index();
+	if (!res.second) {
+		free_item(it, a_);
 		return false;
 	}
-	do_set(std::move(v));
+	if (res.first) {
+		retire_item(res.first, hv);
+	}
+	if (fi_) { //the one on flash is older
+		fi_->erase(hv);
+	}
+	link_item(it);
 	return true;
 }
 
-void cache::do_set(item v)
+cache::item* cache::shard::do_get(const key& k, uint64_t hv, uint32_t now)
 {
-	key k = v.get_key();
-	
-	auto it = h_.find(k);
-	if (it != h_.end()) {
-		delete_item(k);
+	if (sketch_)
+		sketch_->record(hv);
+
+	item* it = h_.find(k, hv);
+	if (!it) {
+		++st_.get_misses_;
+		return nullptr;
+	}
+	if (it->exptime_ && int32_t(it->exptime_ - now) <= 0) { //the timer wheel hasn't got to it yet
+		++st_.expired_;
+		++st_.get_misses_;
+		unlink_item(it, hv);
+		return nullptr;
+	}
+	if (stale(*it, ns_)) { //its namespace was invalidated, it's gone like an expired one
+		++st_.ns_stale_;
+		++st_.get_misses_;
+		unlink_item(it, hv);
+		return nullptr;
+	}
+	++st_.get_hits_;
+
+	if (eviction_ == eviction::clock) {
+		//the list is left alone, the eviction hand sorts it out
+		if (!it->ref_)
+			it->ref_ = 1;
+	}
+	else {
+		//refresh in the LRU list
+		it->atime_ = ++tick_;
+		list_of(it).touch(it);
 	}
 
-	size_t itemmem = (sizeof(v.h_) + v.h_.request.bodylen);
+	return it;
+}
 
-	if (itemmem + used_mem_ > maxmemsize_) {
-		//try to free at least 1% of the max
-		free_mem(std::max(itemmem*2, maxmemsize_/100));
+bool cache::shard::do_remove(const request& r, uint64_t cas, uint64_t hv)
+{
+	uint32_t now = cache::now();
+	auto res = h_.erase(r.get_key(), hv, [this, cas, now](item* old) { return !cas || old->cas_ == cas || expired(*old, now) || stale(*old, ns_); });
+	count_index();
+	if (!res.first) {
+		if (fi_)
+			fi_->erase(hv);
+		return true;
 	}
+	if (!res.second)
+		return false;
+	retire_item(res.first, hv);
+	return true;
+}
 
-	auto lruit = lru_.insert(lru_.end(), k); //add to the LRU
-	v.set_lru(lruit);
+// allocates the item, keeps the metadata it needs and copies the key after the item header,
+// the value is written after. A value that doesn't fit in the biggest item class goes to the full
+// value chunks, the tail stays in the item, unless it's too big for the item classes as well
+cache::item* cache::shard::make_item(const request& r, size_t value_len, bool compressed, uint32_t now)
+{
+	size_t keylen = r.h_.request.keylen;
+	size_t nslen = ns_ ? ns_->prefix(r.get_key().d_, keylen) : 0;
+	size_t room = item::key_room(keylen, nslen != 0);
+	size_t itemmem = item::total_size(room, value_len);
+	unsigned int cls = a_.class_of(itemmem);
+	bool chunked = cls >= value_class();
+	size_t chunk_len = a_.chunk_size(value_class()) - slab_allocator::CHUNK_HEADER - sizeof(value_chunk);
+	chain ch;
+	ch.head_ = nullptr;
+	ch.chunks_ = 0;
+	ch.tail_len_ = 0;
+	if (chunked) {
+		ch.chunks_ = value_len/chunk_len;
+		ch.tail_len_ = value_len - ch.chunks_*chunk_len;
+		itemmem = item::chunked_size(room, ch.tail_len_);
+		cls = a_.class_of(itemmem);
+		if (cls >= value_class()) { //the last chunk isn't full
+			++ch.chunks_;
+			ch.tail_len_ = 0;
+			itemmem = item::chunked_size(room, 0);
+			cls = a_.class_of(itemmem);
+		}
+	}
+	item* it = static_cast<item*>(alloc_chunk(cls, itemmem));
 
+	new (&it->refs_) std::atomic<uint32_t>(0);
+	it->cas_ = r.h_.request.cas;
+	it->flags_ = r.get_flags();
+	it->value_len_ = value_len;
+	it->compressed_ = compressed;
+	it->chunked_ = chunked;
+	it->ns_ = nslen != 0;
+	it->keylen_ = keylen;
+	it->cls_ = chunked ? value_class() : cls; //the chunked items are evicted for the value chunks
+	it->linked_ = 0;
+	it->ref_ = 0;
+	it->window_ = 0;
+	it->tnext_ = nullptr;
+	it->tpprev_ = nullptr;
+	it->exptime_ = expiry(r.get_exptime(), now);
+	::memcpy(reinterpret_cast<unsigned char*>(it + 1), r.get_key().d_, keylen);
+	if (it->ns_)
+		it->set_generation(ns_->generation(r.get_key().d_, nslen));
+	if (!chunked)
+		return it;
+
+	//the chunk allocations may evict, the item is set up by now and it's not linked
+	it->set_chain(ch);
+	size_t left = value_len - ch.tail_len_;
+	value_chunk* last = nullptr;
 	try {
-		std::shared_ptr<item> pi(new item(std::move(v)));
-		h_.emplace(std::make_pair(k, pi));
+		for (uint32_t i = 0; i != ch.chunks_; ++i) {
+			size_t len = std::min(left, chunk_len);
+			value_chunk* c = static_cast<value_chunk*>(alloc_chunk(value_class(), sizeof(value_chunk) + len));
+			c->next_ = nullptr;
+			c->owner_ = it;
+			c->len_ = len;
+			if (last) {
+				last->next_ = c;
+			}
+			else {
+				ch.head_ = c;
+				it->set_chain(ch);
+			}
+			last = c;
+			left -= len;
+		}
 	}
-	catch (const std::exception&)
-	{
-		lru_.erase(lruit);
+	catch (const std::exception&) {
+		free_item(it, a_);
 		throw;
 	}
-	used_mem_ += itemmem;
+	return it;
+}
+
+//the item is in the hash already
+void cache::shard::link_item(item* it)
+{
+	it->refs_.store(1, std::memory_order_relaxed); //the cache reference
+	it->atime_ = ++tick_;
+	it->linked_ = 1;
+	used_mem_ += it->get_size();
+	chunk_mem_ += chunk_memory(it);
+	data_mem_ += it->get_data_len();
+	meta_mem_ += meta_memory(it);
+	if (it->exptime_) {
+		timers_.add(it);
+		if (owner_)
+			owner_->expiring(it->exptime_);
+	}
+	//the reclaimer evicts from now on, the lag counts from here
+	if (high_mem_ && owner_ && !reclaiming_ && chunk_mem_ > high_mem_) {
+		reclaiming_ = true;
+		reclaim_start_ = std::chrono::steady_clock::now();
+		owner_->over_watermark();
+	}
+
+	if (!sketch_) {
+		lru_[it->cls_].push_back(it);
+		return;
+	}
+	//new items start in the admission window, it's kept at about 1% of the class.
+	//When the memory is full the evictions take the window items out (see next_victim),
+	//until then they just move to the main list
+	lru& w = window_[it->cls_];
+	it->window_ = 1;
+	w.push_back(it);
+	if (w.size() > std::max<size_t>(1, (w.size() + lru_[it->cls_].size())/100)) {
+		item* old = w.head_;
+		w.erase(old);
+		old->window_ = 0;
+		lru_[it->cls_].push_back(old);
+	}
 }
 
-bool cache::do_get_value(std::vector<unsigned char>& v, const key& k)
+//the item is out of the hash already
+void cache::shard::retire_item(item* it, uint64_t hv)
 {
-	std::shared_ptr<item> p = do_get(k);
-	if (!p)
+	assert(it->linked_);
+	bump_version(hv);
+	list_of(it).erase(it);
+	if (it->exptime_)
+		timers_.remove(it);
+	it->linked_ = 0;
+	used_mem_ -= it->get_size();
+	chunk_mem_ -= chunk_memory(it);
+	data_mem_ -= it->get_data_len();
+	meta_mem_ -= meta_memory(it);
+
+	//the readers that found it before may still use it, it's freed by do_collect
+	it->atime_ = uint32_t(epoch::current());
+	retired_.push_back(it);
+	retired_mem_ += chunk_memory(it);
+	if (retired_.size() >= RETIRE_BATCH || retired_mem_ >= RETIRE_MEM) {
+		do_collect();
+	}
+}
+
+void cache::shard::unlink_item(item* it, uint64_t hv)
+{
+	h_.erase(it, hv);
+	count_index();
+	retire_item(it, hv);
+}
+
+void cache::shard::unlink_item(item* it)
+{
+	unlink_item(it, hasher()(it->get_key()));
+}
+
+// gets a chunk for an item or a value chunk, if the memory budget is exhausted
+// the items of the same size class are evicted according to LRU (or CLOCK),
+// unless some other class holds much older items (or the class is empty),
+// then the memory is taken from that class
+void* cache::shard::alloc_chunk(unsigned int cls, size_t size)
+{
+	static const unsigned int MAX_ATTEMPTS = 64; //the evicted items may be still in use by readers and sessions
+
+	bool evicted = false;
+	for (unsigned int i = 0; i != MAX_ATTEMPTS; ++i) {
+		void* p = a_.alloc(cls, size);
+		if (p)
+			return p;
+		//the value chunks of the large items that are gone are free, but not in the pool
+		if (cls != value_class() && a_.take_free_page(value_class(), cls))
+			continue;
+
+		if (evicted && !retired_.empty()) {
+			//the evicted items are still read, the readers don't take long
+			epoch::synchronize();
+			do_collect();
+			evicted = false;
+			continue;
+		}
+		evicted = true;
+
+		unsigned int victim = oldest_class();
+		if (oldest_item(cls) && (victim == a_.classes() || class_age(cls) >= class_age(victim)/2)) {
+			victim = cls;
+		}
+
+		if (victim == a_.classes()) {
+			//no items at all, the pages may be held by the items that are still in use
+			victim = a_.biggest_class(cls);
+			if (victim == a_.classes())
+				break; //nothing to take
+		}
+		if (victim == cls) {
+			//a few at once, the retired items are freed by batches, a chunked item frees a few chunks itself
+			size_t batch = cls == value_class() ? 1 : EVICT_BATCH;
+			for (size_t j = 0; j != batch && oldest_item(cls); ++j) {
+				evict_item(next_victim(cls));
+			}
+		}
+		else {
+			//the page moves only if all its chunks are free, so it waits for the readers right away
+			a_.reclaim_page(victim, cls, [this, victim](void* p) { evict_chunk(p, victim); }, [this]() {
+					if (!retired_.empty()) {
+						epoch::synchronize();
+						do_collect();
+					}
+				});
+			continue;
+		}
+		do_collect();
+	}
+	throw std::bad_alloc();
+}
+
+bool cache::shard::restore_item(const item* it, unsigned int cls, uint32_t now) const
+{
+	if (it->keylen_ > MAX_KEYLEN || (it->exptime_ && int32_t(it->exptime_ - now) <= 0))
+		return false;
+	if (!it->chunked_) {
+		return it->cls_ == cls && a_.class_of(it->get_size()) == cls
+			&& (!it->compressed_ || it->value_len_ >= sizeof(uint32_t));
+	}
+	//the chain has to be in the chunk before it's read
+	return !it->compressed_ && it->cls_ == value_class()
+		&& item::chunked_size(item::key_room(it->keylen_, it->ns_), 0) + slab_allocator::CHUNK_HEADER <= a_.chunk_size(cls)
+		&& a_.class_of(it->get_alloc_size()) == cls;
+}
+
+// every value chunk has to be on a value chunk page, allocated, of this item and nobody else's,
+// and the chain has to add up to the value
+bool cache::shard::restore_chain(item* it, const arena& a, const std::vector<unsigned int>& classes, std::vector<bool>& claimed) const
+{
+	size_t size = a_.chunk_size(value_class()); //half a page
+	size_t room = size - slab_allocator::CHUNK_HEADER - sizeof(value_chunk);
+	uintptr_t begin = uintptr_t(a.page(0)) + slab_allocator::CHUNK_HEADER;
+	uintptr_t end = uintptr_t(a.page(a.pages()));
+	chain ch = it->get_chain();
+	std::vector<value_chunk*> chunks;
+	size_t len = ch.tail_len_;
+	uintptr_t next = uintptr_t(ch.head_);
+	bool ok = true;
+	for (uint32_t i = 0; ok && i != ch.chunks_; ++i) {
+		uintptr_t p = next + a.shift();
+		ok = next && p >= begin && p < end && !((p - begin) % size);
+		if (!ok)
+			break;
+		size_t idx = (p - begin)/size;
+		value_chunk* c = reinterpret_cast<value_chunk*>(p);
+		ok = classes[idx/2] == value_class() && !claimed[idx] && slab_allocator::used(c)
+			&& uintptr_t(c->owner_) + a.shift() == uintptr_t(it) && c->len_ && c->len_ <= room;
+		if (!ok)
+			break;
+		claimed[idx] = true;
+		chunks.push_back(c);
+		len += c->len_;
+		next = uintptr_t(c->next_);
+	}
+	if (!ok || next || len != it->value_len_) {
+		for (value_chunk* c: chunks) {
+			claimed[(uintptr_t(c) - begin)/size] = false;
+		}
 		return false;
-	unsigned int value_len = p->get_data_len() - p->h_.request.keylen;
-	const unsigned char* pd = p->get_data()+p->h_.request.keylen;
-	v.insert(v.end(), pd, pd + value_len);
+	}
+
+	//the links as they are in this process
+	for (size_t i = 0; i != chunks.size(); ++i) {
+		chunks[i]->owner_ = it;
+		chunks[i]->next_ = i + 1 != chunks.size() ? chunks[i + 1] : nullptr;
+	}
+	ch.head_ = chunks.empty() ? nullptr : chunks[0];
+	it->set_chain(ch);
 	return true;
 }
 
-std::shared_ptr<cache::item> cache::do_get(const key& k)
+bool cache::shard::reserve_index(size_t items)
 {
-	auto it = h_.find(k);
-	if (it == h_.end())
-		return std::shared_ptr<item>();
+	while (!h_.fits(items)) {
+		size_t more = h_.grow_memory();
+		if (!pool_.reserve(more))
+			return false;
+		try {
+			h_.grow();
+		}
+		catch (const std::bad_alloc&) {
+			pool_.release(more);
+			throw;
+		}
+		index_mem_ += more;
+		hash_mem_ += more;
+		count_index();
+		place_index();
+	}
+	return true;
+}
+
+size_t cache::shard::restore(std::vector<restored_item>& items)
+{
+	std::sort(items.begin(), items.end(), [](const restored_item& a, const restored_item& b) {
+			return a.atime_ < b.atime_;
+		});
+	static const size_t AHEAD = 8; //items in the LRU order are all over the pages
+
+	size_t n = 0;
+	for (size_t j = 0; j != items.size(); ++j) {
+		if (j + AHEAD < items.size()) {
+			__builtin_prefetch(items[j + AHEAD].it_, 1);
+		}
+		restored_item& i = items[j];
+		item* it = i.it_;
+		if (!it->linked_) //dropped after the check, the page took it back
+			continue;
+		it->prev_ = it->next_ = it->tnext_ = nullptr;
+		it->tpprev_ = nullptr;
+		it->ref_ = 0;
+		it->window_ = 0;
+		//the same key twice, or no room for it in the index
+		if ((h_.full() && !reserve_index(h_.size() + 1)) || !h_.upsert(it, i.hv_, [](item*) { return false; }).second) {
+			it->linked_ = 0;
+			free_item(it, a_);
+			continue;
+		}
+		link_item(it);
+		++n;
+	}
+	return n;
+}
 
-	assert(!lru_.empty());
+// The index doubles before an insert would overload it, the new slots take the memory
+// budget like the pages do. If the pool is short of it, the shard gives pages back:
+// the free value chunk pages first, then the pages of the biggest class with their items
+void cache::shard::reserve_memory(size_t more)
+{
+	static const unsigned int MAX_ATTEMPTS = 64; //pages that stay, their items are still in use
 
-	//refresh in the LRU list
-	if (it->second->lru_ref_ != --lru_.end()) {
-		lru_.splice(lru_.end(), lru_, it->second->lru_ref_);
+	unsigned int failed = 0;
+	while (!pool_.reserve(more)) {
+		if (a_.take_free_page(value_class(), a_.large_class()))
+			continue;
+		unsigned int victim = a_.biggest_class(a_.large_class());
+		if (victim == a_.classes() || failed == MAX_ATTEMPTS)
+			throw std::bad_alloc();
+		if (!a_.reclaim_page(victim, a_.large_class(), [this, victim](void* p) { evict_chunk(p, victim); }, [this]() {
+					if (!retired_.empty()) {
+						epoch::synchronize();
+						do_collect();
+					}
+				})) {
+			++failed;
+		}
 	}
-	
-	return it->second;
 }
 
-bool cache::do_remove(const item& v, uint64_t cas)
+void cache::shard::grow_index()
 {
+	size_t more = h_.grow_memory();
+	reserve_memory(more);
 	try {
-		if (cas) {
-			//handle cas
-			std::shared_ptr<item> p = do_get(v.get_key());
-			if (p && p->h_.request.cas != cas) {
-				return false;
-			}
+		h_.grow();
+	}
+	catch (const std::bad_alloc&) {
+		pool_.release(more);
+		throw;
+	}
+	index_mem_ += more;
+	hash_mem_ += more;
+	count_index();
+	place_index();
+}
+
+void cache::shard::count_index()
+{
+	size_t mem = h_.memory();
+	if (mem < hash_mem_) {
+		pool_.release(hash_mem_ - mem);
+		index_mem_ -= hash_mem_ - mem;
+		hash_mem_ = mem;
+	}
+}
+
+// every lookup goes through the index, it's on the node of the pages. Only its whole pages move,
+// a table smaller than a page stays where the heap put it
+void cache::shard::place_index()
+{
+	if (node_ >= 0) {
+		numa::host().bind_memory(h_.table_slots(), h_.table_memory(), node_);
+	}
+}
+
+// the item to evict from the class: the LRU head, with CLOCK the hand (head) moves
+// the referenced items to the tail clearing the bit.
+// With the admission filter the window head competes with it (W-TinyLFU),
+// the one that is used less often goes, the winner stays in the main list
+cache::item* cache::shard::next_victim(unsigned int cls)
+{
+	lru& w = window_[cls];
+	lru& l = lru_[cls];
+	if (l.empty()) {
+		assert(!w.empty());
+		return w.head_;
+	}
+
+	if (eviction_ == eviction::clock) {
+		while (l.head_->ref_) { //one round at most, the bits are only set under the lock
+			item* it = l.head_;
+			it->ref_ = 0;
+			it->atime_ = ++tick_;
+			l.touch(it);
 		}
-		delete_item(v.get_key());
 	}
-	catch (const std::exception&) {
+	if (w.empty())
+		return l.head_;
+
+	item* candidate = w.head_;
+	if (sketch_->estimate(hasher()(candidate->get_key())) > sketch_->estimate(hasher()(l.head_->get_key()))) {
+		++st_.admitted_;
+		w.erase(candidate);
+		candidate->window_ = 0;
+		l.push_back(candidate);
+		return l.head_;
 	}
-	return true;
+	++st_.rejected_;
+	return candidate;
 }
 
-void cache::delete_item(key k) //pass by value
+void cache::shard::evict_item(item* it)
 {
-	auto it = h_.find(k);
-	if (it == h_.end()) {
-		throw std::runtime_error("cache integrity error");
+	++st_.evictions_;
+	uint64_t hv = hasher()(it->get_key());
+	if (flash_) {
+		to_flash(it, hv);
 	}
+	unlink_item(it, hv);
+}
 
-	//remove from LRU
-	lru_.erase(it->second->lru_ref_);
+// The index grows ahead on SET (see do_store), a big item may evict many at once though,
+// then it grows here if the pool has the memory: the eviction may be a part of a page reclaim
+// already, it can't take pages itself. Otherwise the item is dropped
+void cache::shard::to_flash(const item* it, uint64_t hv)
+{
+	if ((it->exptime_ && int32_t(it->exptime_ - cache::now()) <= 0) || stale(*it, ns_))
+		return;
+	if (fi_->full()) {
+		grow_flash_index(false);
+	}
+	uint64_t pos = 0;
+	if (!fi_->full()) {
+		flash_log::record r;
+		r.cas_ = it->cas_;
+		r.flags_ = it->flags_;
+		r.exptime_ = it->exptime_;
+		r.value_len_ = it->get_value_len();
+		r.generation_ = it->ns_ ? it->get_generation() : 0;
+		r.keylen_ = it->keylen_;
+		r.compressed_ = it->compressed_;
+		r.unused_ = 0;
+		pos = flash_->append(sizeof(r) + r.keylen_ + r.value_len_, [it, &r](unsigned char* p) {
+				::memcpy(p, &r, sizeof(r));
+				::memcpy(p + sizeof(r), it->get_data(), it->keylen_);
+				p += sizeof(r) + it->keylen_;
+				value_reader pos(*it);
+				for (auto v = pos.next(); v.second; v = pos.next()) {
+					::memcpy(p, v.first, v.second);
+					p += v.second;
+					pos.move(v.second);
+				}
+			});
+	}
+	if (!pos) {
+		++st_.flash_dropped_;
+		return;
+	}
+	fi_->insert(hv, pos);
+	++st_.flash_writes_;
+}
 
-	h_.erase(it);
+// the entries of the overwritten log segments go first, the table doubles only if it's still half full.
+// Without reclaim it doesn't evict anything for the memory, it stays as it is if the pool is short
+void cache::shard::grow_flash_index(bool reclaim)
+{
+	uint64_t tail = flash_->tail();
+	size_t slots = fi_->capacity();
+	if (fi_->live(tail)*2 <= slots) {
+		fi_->rebuild(slots, tail);
+		return;
+	}
+	size_t more = fi_->memory();
+	if (!reclaim) {
+		if (!pool_.reserve(more))
+			return;
+	}
+	else {
+		try {
+			reserve_memory(more);
+		}
+		catch (const std::bad_alloc&) { //the evicted items are dropped meanwhile
+			return;
+		}
+		if (fi_->capacity() != slots) { //the evictions for the memory have grown it already
+			pool_.release(more);
+			return;
+		}
+	}
+	try {
+		fi_->rebuild(slots*2, tail);
+	}
+	catch (const std::bad_alloc&) {
+		pool_.release(more);
+		if (reclaim)
+			throw;
+		return;
+	}
+	index_mem_ += more;
+}
+
+uint64_t cache::shard::flash_find(uint64_t hv)
+{
+	std::unique_lock<std::mutex> lock;
+	if (m_)
+		lock = std::unique_lock<std::mutex>(*m_);
+	uint64_t pos = fi_->find(hv);
+	if (pos && !flash_->live(pos)) {
+		fi_->erase(hv, pos);
+		++st_.flash_misses_;
+		return 0;
+	}
+	return pos;
+}
+
+void cache::shard::flash_drop(uint64_t hv, uint64_t pos)
+{
+	std::unique_lock<std::mutex> lock;
+	if (m_)
+		lock = std::unique_lock<std::mutex>(*m_);
+	fi_->erase(hv, pos);
+	++st_.flash_misses_;
+}
 
-	used_mem_ -= k.memsize_;
+// the GET that came here was counted as a miss, it's a hit after all
+cache::item_view cache::shard::promote(const request& r, const value& v, uint32_t generation, uint64_t pos, uint64_t hv)
+{
+	std::unique_lock<std::mutex> lock;
+	if (m_)
+		lock = std::unique_lock<std::mutex>(*m_);
+	uint32_t now = cache::now();
+	item* it = nullptr;
+	if (fi_->find(hv) != pos) { //a SET or DELETE got there first
+		it = h_.find(r.get_key(), hv);
+		if (!it)
+			return item_view();
+		if (expired(*it, now)) { //like do_get, the miss is counted already
+			++st_.expired_;
+			unlink_item(it, hv);
+			return item_view();
+		}
+		if (stale(*it, ns_)) {
+			++st_.ns_stale_;
+			unlink_item(it, hv);
+			return item_view();
+		}
+	}
+	else {
+		it = make_item(r, v.len_, v.compressed_, now);
+		if (it->ns_) {
+			//the generation of the record, the namespace may have been invalidated since it was read
+			it->set_generation(generation);
+			if (stale(*it, ns_)) {
+				free_item(it, a_);
+				return item_view();
+			}
+		}
+		value_reader vp(*it);
+		copy_value(vp, v.d_, v.len_);
+		if (!do_store(it, 0, hv)) //it's not stored with cas 0, but just in case
+			return item_view();
+		++st_.flash_hits_;
+	}
+	--st_.get_misses_;
+	++st_.get_hits_;
+	epoch::pin();
+	return item_view(it, &a_);
 }
 
-void cache::free_mem(size_t size) //size to free
+// the least recently used item of the class, nullptr if the class is empty
+cache::item* cache::shard::oldest_item(unsigned int cls) const
 {
-	assert(size);
+	item* it = lru_[cls].head_;
+	item* w = window_[cls].head_;
+	if (!it || (w && uint32_t(tick_ - w->atime_) > uint32_t(tick_ - it->atime_)))
+		return w;
+	return it;
+}
 
-	size_t freed = 0;
-	//remove according to LRU
-	for (auto it = lru_.begin(); it != lru_.end() && freed < size; ) {
-		auto n = it->memsize_;
-		auto tmp = it;
-		++it;
-		delete_item(*tmp);
-		freed += n;
+// the class that has the least recently used item, classes() if the shard is empty,
+// the classes with a single page are left alone unless there is nothing else
+unsigned int cache::shard::oldest_class() const
+{
+	unsigned int cls = a_.classes();
+	uint32_t oldest = 0;
+	bool single = true;
+	for (unsigned int i = 0; i != lru_.size(); ++i) {
+		if (!oldest_item(i))
+			continue;
+		uint32_t age = class_age(i);
+		bool s = a_.pages(i) < 2;
+		if (cls == a_.classes() || (single && !s) || (s == single && age > oldest)) {
+			oldest = age;
+			cls = i;
+			single = s;
+		}
 	}
+	return cls;
 }
 
+// called for the chunks on a page of the class that is about to be reclaimed,
+// a value chunk evicts its item
+void cache::shard::evict_chunk(void* p, unsigned int cls)
+{
+	item* it = cls == value_class() ? static_cast<value_chunk*>(p)->owner_ : static_cast<item*>(p);
+	if (it->linked_) { //otherwise it's still in use by a session, being written, or already freed
+		evict_item(it);
+	}
+}
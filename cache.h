@@ -2,15 +2,28 @@
 #define MC_CACHE_H
 
 #include <assert.h>
-#include <unordered_map>
+#include <stdlib.h>
 #include <vector>
-#include <list>
 #include <string.h>
 #include <functional>
+#include <algorithm>
 #include <mutex>
 #include <memory>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <arpa/inet.h>
+#include <time.h>
 #include "protocol_binary.h"
 #include "config.h"
+#include "slab.h"
+#include "sketch.h"
+#include "epoch.h"
+#include "lz4.h"
+#include "flash.h"
+#include "numa.h"
+#include "namespaces.h"
 
 namespace mc
 {
@@ -20,13 +33,7 @@ namespace mc
 		{
 			const unsigned char* d_; //key data
 			size_t len_; //key len
-			size_t memsize_; //size of key+value in memory (bytes)
 
-			explicit key(const unsigned char* d, size_t len, size_t memsize)
-				:d_(d)
-				,len_(len)
-				,memsize_(memsize)
-			{}
 			explicit key(const unsigned char* d, size_t len)
 				:d_(d)
 				,len_(len)
@@ -44,108 +51,1503 @@ namespace mc
 			}
 		};
 
-		typedef std::list<key> lru; //LRU linked list
-
-		struct item
+		// 64 bit key hash (wyhash), the high half picks the shard and the low one the hash slot
+		struct hasher
 		{
-			typedef std::vector<unsigned char> data;
+			uint64_t operator()(const key& k) const;
+		};
 
-			data d_; 
-			protocol_binary_request_header h_;
-			lru::iterator lru_ref_; //location in LRU list (list iterators are valid till deleted)
+		// raw request (header + extras + key + value) as it's received by the session,
+		// the cache copies what it needs. The key is hashed once here, every step of the
+		// request uses hv_
+		struct request
+		{
+			const unsigned char* d_;
+			size_t len_;
+			protocol_binary_request_header h_; //host byte order
+			uint64_t hv_; //of the key
 
-			explicit item(data d, const protocol_binary_request_header& h)
-				:d_(std::move(d))
+			explicit request(const unsigned char* d, size_t len, const protocol_binary_request_header& h)
+				:d_(d)
+				,len_(len)
 				,h_(h)
 			{
-				assert(d_.size() >= h_.request.extlen + sizeof(h_));
+				assert(len_ >= h_.request.extlen + h_.request.keylen + sizeof(h_));
+				hv_ = hasher()(get_key());
 			}
-			item(item&& v)
-				:d_(std::move(v.d_))
-				,h_(v.h_)
-				,lru_ref_(v.lru_ref_)
-			{}
 
 			key get_key() const
 			{
-				return key(
-						d_.data() + sizeof(h_) + h_.request.extlen
-						,h_.request.keylen
-						,d_.size()
-						);
+				return key(d_ + sizeof(h_) + h_.request.extlen, h_.request.keylen);
 			}
-			const unsigned char* get_data() const
+			size_t get_value_len() const
 			{
-				return d_.data() + h_.request.extlen + sizeof(h_);
+				return len_ - sizeof(h_) - h_.request.extlen - h_.request.keylen;
 			}
-			const unsigned char* get_value() const
+			uint32_t get_flags() const //the SET extras flags
 			{
-				return get_data() + h_.request.keylen;
+				return get_extra(0);
 			}
-			const size_t get_data_len() const
+			uint32_t get_exptime() const //the SET extras expiration as it's sent (not converted)
 			{
-				return d_.size() - h_.request.extlen - sizeof(h_);
+				return get_extra(4);
 			}
-			const size_t get_value_len() const
+
+		private:
+			uint32_t get_extra(size_t offset) const //0 if it's not there
 			{
-				return get_data_len() - h_.request.keylen;
+				if (h_.request.extlen < offset + 4)
+					return 0;
+				uint32_t v;
+				::memcpy(&v, d_ + sizeof(h_) + offset, sizeof(v));
+				return ntohl(v);
 			}
+		};
+
+		struct value_chunk;
+
+		// the value chunks of a chunked item, it follows the key (unaligned)
+		struct chain
+		{
+			value_chunk* head_;
+			uint32_t chunks_;
+			uint32_t tail_len_; //the end of the value that doesn't make a chunk, it stays in the item
+		};
+
+		// The item is one slab chunk: the LRU and timer links, the metadata (64 bytes on 64 bit systems)
+		// and the key and value follow each other. Only the fields the responses need are kept,
+		// the response header is made from them. The cache holds one reference while the item
+		// is linked and retired (see epoch.h), the readers don't count references, only the sessions that
+		// write a large value out over several events do.
+		// A value that doesn't fit in the biggest item class is chunked: the key is followed by the chain
+		// of the value chunks, then the tail of the value (see value_reader).
+		// The key of a namespace is followed by the generation of the namespace (see namespace_table).
+		struct item
+		{
+			item* prev_; //LRU links
+			item* next_;
+			item* tnext_; //timer wheel links, if the item expires
+			item** tpprev_;
+			uint64_t cas_; //as it came with the SET
+			std::atomic<uint32_t> refs_;
+			uint32_t atime_; //last access tick of the shard, to compare LRUs of different classes, the retire epoch once it's removed
+			uint32_t exptime_; //unix time, 0 if it never expires
+			uint32_t flags_; //SET extras flags
+			uint32_t value_len_; //stored
+			uint8_t keylen_;
+			uint8_t cls_; //slab class, the value chunk class if it's chunked
+			uint8_t compressed_ : 1; //the value is the raw length (4 bytes) and the LZ4 block
+			uint8_t chunked_ : 1;
+			uint8_t ns_ : 1; //the namespace generation (4 bytes) follows the key
+			uint8_t : 0; //the bits below change under the shard lock while the readers use the item
+			uint8_t linked_ : 1; //in the hash and LRU
+			uint8_t ref_ : 1; //CLOCK reference bit, set by the hits
+			uint8_t window_ : 1; //in the admission window list
+
+			static_assert(MAX_KEYLEN < (1 << 8), "the key length doesn't fit");
 
-			void set_lru(lru::iterator it)
+			//the key and the namespace generation
+			static size_t key_room(size_t keylen, bool ns)
 			{
-				lru_ref_ = it;
+				return keylen + (ns ? sizeof(uint32_t) : 0);
+			}
+			static size_t total_size(size_t key_room, size_t value_len)
+			{
+				return sizeof(item) + key_room + value_len;
+			}
+			static size_t chunked_size(size_t key_room, size_t tail_len)
+			{
+				return sizeof(item) + key_room + sizeof(chain) + tail_len;
+			}
+
+			key get_key() const
+			{
+				return key(get_data(), keylen_);
+			}
+			const unsigned char* get_data() const //key and value
+			{
+				return reinterpret_cast<const unsigned char*>(this + 1);
+			}
+			const unsigned char* get_value() const //the tail if it's chunked
+			{
+				return get_data() + key_room(keylen_, ns_) + (chunked_ ? sizeof(chain) : 0);
+			}
+			size_t get_inline_len() const //of get_value
+			{
+				return chunked_ ? get_chain().tail_len_ : value_len_;
+			}
+			size_t get_data_len() const //of the key and value
+			{
+				return keylen_ + value_len_;
+			}
+			size_t get_value_len() const //stored, see get_raw_len
+			{
+				return value_len_;
+			}
+			size_t get_raw_len() const //as it was set
+			{
+				if (!compressed_)
+					return value_len_;
+				assert(!chunked_);
+				uint32_t len;
+				::memcpy(&len, get_value(), sizeof(len));
+				return len;
+			}
+			size_t get_size() const
+			{
+				return total_size(key_room(keylen_, ns_), value_len_);
+			}
+			size_t get_alloc_size() const //of the item chunk
+			{
+				return chunked_ ? chunked_size(key_room(keylen_, ns_), get_chain().tail_len_) : get_size();
+			}
+			chain get_chain() const
+			{
+				assert(chunked_);
+				chain ch;
+				::memcpy(&ch, get_data() + key_room(keylen_, ns_), sizeof(ch));
+				return ch;
+			}
+			void set_chain(const chain& ch)
+			{
+				assert(chunked_);
+				::memcpy(reinterpret_cast<unsigned char*>(this + 1) + key_room(keylen_, ns_), &ch, sizeof(ch));
+			}
+			uint32_t get_generation() const //of the namespace when the item was made
+			{
+				assert(ns_);
+				uint32_t g;
+				::memcpy(&g, get_data() + keylen_, sizeof(g));
+				return g;
+			}
+			void set_generation(uint32_t g)
+			{
+				assert(ns_);
+				::memcpy(reinterpret_cast<unsigned char*>(this + 1) + keylen_, &g, sizeof(g));
 			}
 
 		private:
-			//never copy data around, move only
+			item() = delete;
 			item(const item&) = delete;
 			item& operator=(const item&) = delete;
 		};
 
+		static_assert(sizeof(void*) != 8 || sizeof(item) == 64, "the item header isn't 64 bytes");
 
-		struct hasher
+		// A piece of a chunked value, a slab chunk of the biggest class (half a page).
+		// The chunks are full except the last one if the tail didn't fit in the item
+		struct value_chunk
+		{
+			value_chunk* next_; //the slab pending list takes the first field once it's freed
+			item* owner_;
+			uint32_t len_;
+
+			const unsigned char* data() const
+			{
+				return reinterpret_cast<const unsigned char*>(this + 1);
+			}
+		};
+
+		// Reads the value of an item piece by piece, the value chunks and the tail
+		// if it's chunked. The item must stay alive meanwhile
+		struct value_reader
+		{
+			value_reader()
+				:it_(nullptr)
+				,c_(nullptr)
+				,pos_(0)
+			{}
+			explicit value_reader(const item& it)
+				:it_(&it)
+				,c_(it.chunked_ ? it.get_chain().head_ : nullptr)
+				,pos_(0)
+			{}
+
+			//the rest of the current piece, the length is 0 at the end of the value
+			std::pair<const unsigned char*, size_t> next() const
+			{
+				if (c_)
+					return std::make_pair(c_->data() + pos_, c_->len_ - pos_);
+				return std::make_pair(it_->get_value() + pos_, it_->get_inline_len() - pos_);
+			}
+			void move(size_t n)
+			{
+				pos_ += n;
+				while (c_ && pos_ >= c_->len_) {
+					pos_ -= c_->len_;
+					c_ = c_->next_;
+				}
+			}
+
+		private:
+			const item* it_;
+			const value_chunk* c_; //nullptr once it's in the item
+			size_t pos_; //in the piece
+		};
+
+		// counted reference to an item, the item memory goes back to the slab
+		// when it's removed from the cache and the last reference is gone
+		struct item_ptr
+		{
+			item_ptr()
+				:p_(nullptr)
+				,a_(nullptr)
+			{}
+			explicit item_ptr(item* p, slab_allocator* a) //adds a reference
+				:p_(p)
+				,a_(a)
+			{
+				p_->refs_.fetch_add(1, std::memory_order_relaxed);
+			}
+			item_ptr(item_ptr&& v)
+				:p_(v.p_)
+				,a_(v.a_)
+			{
+				v.p_ = nullptr;
+			}
+			item_ptr& operator=(item_ptr&& v)
+			{
+				if (this != &v) {
+					reset();
+					p_ = v.p_;
+					a_ = v.a_;
+					v.p_ = nullptr;
+				}
+				return *this;
+			}
+			~item_ptr()
+			{
+				reset();
+			}
+
+			void reset()
+			{
+				if (p_) {
+					release(p_, *a_);
+					p_ = nullptr;
+				}
+			}
+
+			static void release(item* p, slab_allocator& a)
+			{
+				if (p->refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+					free_item(p, a); //any thread
+				}
+			}
+
+			item* get() const
+			{
+				return p_;
+			}
+			item* operator->() const
+			{
+				return p_;
+			}
+			item& operator*() const
+			{
+				return *p_;
+			}
+			explicit operator bool() const
+			{
+				return p_ != nullptr;
+			}
+
+		private:
+			item* p_;
+			slab_allocator* a_;
+
+			item_ptr(const item_ptr&) = delete;
+			item_ptr& operator=(const item_ptr&) = delete;
+		};
+
+		// An item found by a reader, the thread stays pinned (see epoch.h) while the view is alive,
+		// so the item isn't freed even if it's removed from the cache meanwhile.
+		// The thread must not call the cache while it has a view, the writers may wait for it to go,
+		// hold() makes a counted reference that outlives the view.
+		struct item_view
 		{
-			size_t operator()(const key& k) const;
+			item_view()
+				:p_(nullptr)
+				,a_(nullptr)
+			{}
+			explicit item_view(item* p, slab_allocator* a) //takes over the pin of the thread
+				:p_(p)
+				,a_(a)
+			{
+				assert(epoch::pinned());
+			}
+			item_view(item_view&& v)
+				:p_(v.p_)
+				,a_(v.a_)
+			{
+				v.p_ = nullptr;
+			}
+			item_view& operator=(item_view&& v)
+			{
+				if (this != &v) {
+					reset();
+					p_ = v.p_;
+					a_ = v.a_;
+					v.p_ = nullptr;
+				}
+				return *this;
+			}
+			~item_view()
+			{
+				reset();
+			}
+
+			void reset()
+			{
+				if (p_) {
+					epoch::unpin();
+					p_ = nullptr;
+				}
+			}
+
+			item_ptr hold() const
+			{
+				assert(p_);
+				return item_ptr(p_, a_);
+			}
+
+			const item* operator->() const
+			{
+				return p_;
+			}
+			const item& operator*() const
+			{
+				return *p_;
+			}
+			explicit operator bool() const
+			{
+				return p_ != nullptr;
+			}
+
+		private:
+			item* p_;
+			slab_allocator* a_;
+
+			item_view(const item_view&) = delete;
+			item_view& operator=(const item_view&) = delete;
 		};
 
-		typedef std::unordered_map<key, std::shared_ptr<item>, hasher> hash;
+		// A SET value that is written straight into the item memory as it's received,
+		// so a large value is never kept in one piece (see begin_set). Nobody else sees
+		// the item until cache::store takes it, the writer frees it if it's not stored.
+		struct item_writer
+		{
+			item_writer()
+				:it_(nullptr)
+				,a_(nullptr)
+				,hv_(0)
+				,left_(0)
+			{}
+			explicit item_writer(item* it, slab_allocator* a, uint64_t hv)
+				:it_(it)
+				,a_(a)
+				,hv_(hv)
+				,pos_(*it)
+				,left_(it->get_value_len())
+			{}
+			item_writer(item_writer&& w)
+				:it_(w.it_)
+				,a_(w.a_)
+				,hv_(w.hv_)
+				,pos_(w.pos_)
+				,left_(w.left_)
+			{
+				w.it_ = nullptr;
+			}
+			item_writer& operator=(item_writer&& w)
+			{
+				if (this != &w) {
+					reset();
+					it_ = w.it_;
+					a_ = w.a_;
+					hv_ = w.hv_;
+					pos_ = w.pos_;
+					left_ = w.left_;
+					w.it_ = nullptr;
+				}
+				return *this;
+			}
+			~item_writer()
+			{
+				reset();
+			}
+
+			void reset()
+			{
+				if (it_) {
+					free_item(it_, *a_);
+					it_ = nullptr;
+				}
+			}
+
+			//the value bytes that are still to come
+			size_t left() const
+			{
+				return left_;
+			}
+			void write(const unsigned char* d, size_t len); //up to left() bytes
+
+			explicit operator bool() const
+			{
+				return it_ != nullptr;
+			}
+
+		private:
+			friend struct cache;
+
+			item* it_;
+			slab_allocator* a_;
+			uint64_t hv_;
+			value_reader pos_;
+			size_t left_;
+
+			item_writer(const item_writer&) = delete;
+			item_writer& operator=(const item_writer&) = delete;
+		};
+
+		// Open addressing hash table with robin hood probing (an entry never sits further
+		// from its home slot than the entry it displaced), so a miss stops early.
+		// The slots keep the key hash, the table grows without rehashing the keys and most
+		// of the non matching slots are skipped without touching the item memory.
+		// Every slot has a tag byte besides (7 bits of the hash, 0 if it's empty), the tags are
+		// a separate array that is 16 times smaller than the slots and stays in the cpu caches.
+		// A lookup compares the tags of a group of slots at once (SSE2) up to the first empty
+		// slot, the run of the key ends there, so a miss rarely reads a slot.
+		// upsert and erase do the whole job in one probe. The owner grows the table
+		// before an insert into a full one, so the memory is counted in the cache budget.
+		// The table grows incrementally: grow makes the new table and keeps the old one, every
+		// upsert and erase moves a few runs of slots over (MOVE_STEP or more, a run is moved
+		// as a whole, so the probes of the old table stay right), the lookups go to both
+		// tables meanwhile. The old table is gone once it's all moved, well before the next grow
+		struct hash
+		{
+			explicit hash(size_t size_hint);
 
-		cache(size_t maxmemsize, bool thread_safe);
+			item* find(const key& k, uint64_t hv) const;
+
+			// Inserts the item, or replaces the item with the same key if replace(old) returns true.
+			// Returns the old item (nullptr if there was none) and whether the new one is stored.
+			template <typename Replace>
+			std::pair<item*, bool> upsert(item* it, uint64_t hv, Replace replace);
+
+			// Removes the item with the key if remove(old) returns true.
+			// Returns the found item (nullptr if there was none) and whether it's removed.
+			template <typename Remove>
+			std::pair<item*, bool> erase(const key& k, uint64_t hv, Remove remove);
+
+			void erase(item* it, uint64_t hv);
+
+			size_t size() const
+			{
+				return count_;
+			}
+			size_t memory() const //of the slots and the tags, the old table too while it's moved
+			{
+				return t_.memory() + old_.memory();
+			}
+			bool fits(size_t items) const
+			{
+				return items*8 <= t_.size()*7; //max load 7/8
+			}
+			//the next insert needs a bigger table, grow doubles it
+			bool full() const
+			{
+				return !fits(count_ + 1);
+			}
+			//the memory the next grow takes, the old table is freed later
+			size_t grow_memory() const
+			{
+				return table::memory(t_.size()*2);
+			}
+			//finishes moving the old table first, if it's still there
+			void grow();
+			//the home slot of the key, then the item that may be the one, for a batch of lookups
+			void prefetch(uint64_t hv) const
+			{
+				__builtin_prefetch(&t_.tags_[hv & mask_]);
+				__builtin_prefetch(&t_[hv & mask_]);
+			}
+			void prefetch_item(uint64_t hv) const;
+			//the old table isn't moved over yet
+			bool moving() const
+			{
+				return !old_.empty();
+			}
+
+			//the slots in the table order, for a walk over all the items: visit(item*) is called for the items
+			//in the slots [from, to) of the table and of the old one while it's there. The items that
+			//move meanwhile may be seen twice or not at all, like the ones that are displaced by an insert
+			size_t capacity() const
+			{
+				return t_.size();
+			}
+			template <typename Visit>
+			void walk(size_t from, size_t to, Visit visit) const
+			{
+				for (size_t pos = from; pos != to; ++pos) {
+					if (t_[pos].p_)
+						visit(t_[pos].p_);
+					if (pos < old_.size() && old_[pos].p_)
+						visit(old_[pos].p_);
+				}
+			}
+			const void* table_slots() const //of the new table, table_memory() bytes
+			{
+				return t_.slots_.data();
+			}
+			size_t table_memory() const
+			{
+				return t_.size()*sizeof(slot);
+			}
+
+		private:
+			struct slot
+			{
+				item* p_; //nullptr if empty
+				uint64_t hv_;
+			};
+			// The tables come zeroed from calloc and the slots aren't constructed, a big table is
+			// fresh pages from the kernel, so a grow doesn't write the whole new table at once
+			template <typename T>
+			struct zeroed_allocator
+			{
+				typedef T value_type;
+
+				zeroed_allocator() {}
+				template <typename U>
+				zeroed_allocator(const zeroed_allocator<U>&) {}
+
+				T* allocate(size_t n)
+				{
+					void* p = ::calloc(n, sizeof(T));
+					if (!p)
+						throw std::bad_alloc();
+					return static_cast<T*>(p);
+				}
+				void deallocate(T* p, size_t)
+				{
+					::free(p);
+				}
+				template <typename U>
+				void construct(U*) {} //an empty slot is all zeros
+				template <typename U, typename... Args>
+				void construct(U* p, Args&&... args)
+				{
+					::new(static_cast<void*>(p)) U(std::forward<Args>(args)...);
+				}
+				bool operator==(const zeroed_allocator&) const
+				{
+					return true;
+				}
+				bool operator!=(const zeroed_allocator&) const
+				{
+					return false;
+				}
+			};
+			static const size_t GROUP = 16; //tags compared at once
+
+			// The slots and their tags, the tags of the first GROUP slots are repeated after
+			// the last one, so a group can be read from any slot. The slots are only written
+			// through set and clear, they keep the tags right
+			struct table
+			{
+				std::vector<slot, zeroed_allocator<slot>> slots_;
+				std::vector<uint8_t, zeroed_allocator<uint8_t>> tags_;
+
+				size_t size() const
+				{
+					return slots_.size();
+				}
+				bool empty() const
+				{
+					return slots_.empty();
+				}
+				static size_t memory(size_t size)
+				{
+					return size ? size*sizeof(slot) + size + GROUP : 0;
+				}
+				size_t memory() const
+				{
+					return memory(size());
+				}
+				const slot& operator[](size_t pos) const
+				{
+					return slots_[pos];
+				}
+				void resize(size_t size)
+				{
+					slots_.resize(size);
+					tags_.resize(size + GROUP);
+				}
+				void set(size_t pos, const slot& s)
+				{
+					slots_[pos] = s;
+					tag(pos, tag_of(s.hv_));
+				}
+				void clear(size_t pos)
+				{
+					slots_[pos].p_ = nullptr;
+					tag(pos, 0);
+				}
+				void swap(table& t)
+				{
+					slots_.swap(t.slots_);
+					tags_.swap(t.tags_);
+				}
+				void release()
+				{
+					table().swap(*this);
+				}
+
+			private:
+				void tag(size_t pos, uint8_t c)
+				{
+					tags_[pos] = c;
+					if (pos < GROUP)
+						tags_[size() + pos] = c;
+				}
+			};
+
+			static const size_t MOVE_STEP = 16; //old slots moved by an upsert or erase
+
+			table t_;
+			size_t mask_;
+			size_t count_; //of both tables
+			table old_; //empty unless the table is growing
+			size_t moved_; //old slots moved over
+			size_t next_; //the next old slot to move, the moves start after an empty slot
+
+			//the bits that neither the slot nor the shard (see cache::shard_index) is picked by
+			static uint8_t tag_of(uint64_t hv)
+			{
+				return 0x80 | ((hv >> 32) & 0x7f);
+			}
+			static size_t distance(const table& t, size_t pos) //from the home slot
+			{
+				return (pos - t[pos].hv_) & (t.size() - 1);
+			}
+			//the item with the key, nullptr if it's not in the table
+			static item* lookup(const table& t, const key& k, uint64_t hv);
+			//returns the position of the key or the place where it would be inserted
+			static size_t probe(const table& t, const key& k, uint64_t hv, bool& found);
+			//finds the key in the table or in the old one, t is the one it's in
+			size_t locate(const key& k, uint64_t hv, table*& t);
+			static void place(table& t, size_t pos, slot s); //robin hood insert starting at pos
+			void remove_at(table& t, size_t pos); //backward shift
+			void move(size_t max); //slots of the old table, up to the end of a run
+
+			hash(const hash&) = delete;
+			hash& operator=(const hash&) = delete;
+		};
+
+		// intrusive LRU list through item::prev_/next_, the head is the least recently used
+		struct lru
+		{
+			item* head_;
+			item* tail_;
+			size_t size_;
+
+			lru()
+				:head_(nullptr)
+				,tail_(nullptr)
+				,size_(0)
+			{}
+
+			bool empty() const
+			{
+				return !head_;
+			}
+			size_t size() const
+			{
+				return size_;
+			}
+			void push_back(item* it);
+			void erase(item* it);
+			void touch(item* it) //move to the tail
+			{
+				if (it != tail_) {
+					erase(it);
+					push_back(it);
+				}
+			}
+		};
+
+		// Hierarchical timer wheel of the expiring items, the slots are intrusive lists
+		// through item::tnext_/tpprev_. Level 0 has a slot per second, every next level
+		// has 64 times longer slots, the items move down when their slot comes up.
+		// The times past the last level wait in its farthest slot.
+		struct timer_wheel
+		{
+			explicit timer_wheel(uint32_t now);
+
+			void add(item* it); //it->exptime_ is set
+			void remove(item* it);
+
+			// Moves the wheel up to now calling expire(item*) for the expired items,
+			// it has to remove them from the wheel. Stops after max items, the rest goes next time.
+			template <typename Expire>
+			size_t advance(uint32_t now, size_t max, Expire expire);
+
+			//the time advance has something to do, the first slot with items in it: their expiration
+			//or the time they move down a level. 0 if the wheel is empty
+			uint32_t next() const;
+
+		private:
+			static const unsigned int LEVELS = 4;
+			static const unsigned int SLOT_BITS = 6;
+			static const unsigned int SLOTS = 1 << SLOT_BITS;
+
+			item* slots_[LEVELS][SLOTS];
+			uint32_t now_; //all the slots before it are done
+
+			void cascade(unsigned int level); //moves the current slot of the level down
+
+			timer_wheel(const timer_wheel&) = delete;
+			timer_wheel& operator=(const timer_wheel&) = delete;
+		};
+
+		// how the items to evict are picked when the memory is full
+		enum class eviction
+		{
+			lru, //strict LRU, a hit moves the item to the tail of its class list
+			clock //a hit only sets the reference bit, the eviction hand moves the referenced items to the tail
+		};
+		static const char* eviction_name(eviction e);
+
+		struct config
+		{
+			size_t shards_; //independently locked partitions, keys are spread by hash
+			eviction eviction_;
+			bool admission_; //TinyLFU, a new key has to be used more often than the item it evicts
+			//the background reclaimer evicts down to the low watermark when the memory
+			//of the items goes over the high one (percents of maxmemsize), 0 is no reclaimer
+			unsigned int low_watermark_;
+			unsigned int high_watermark_;
+			size_t compress_min_; //the values of this size or bigger are compressed if it saves memory, 0 is off
+			size_t max_value_len_; //the sessions don't take bigger values
+			slab_allocator::config slabs_;
+			arena::config arena_; //the slab pages are on the heap unless it's enabled
+			flash_log::config flash_; //the evicted items go to flash if it's enabled
+			//the shards are split between that many NUMA nodes (see numa.h), their pages and index
+			//are bound to the node, 0 is no NUMA placement
+			unsigned int numa_nodes_;
+			//the server threads keep the hot keys in a read cache of their own (see l1.h): its entries,
+			//0 is off, and the GETs of a key in a thread (out of the recent ones) that make it hot
+			size_t l1_entries_;
+			unsigned int l1_threshold_;
+			//the index is made for that many items at the start (all the shards), it grows as they come.
+			//INDEX_GUESS takes them from the memory size, as if the values were 1% of the max
+			size_t index_items_;
+			//the keys are in namespaces up to this byte (see namespace_table), 0 is off
+			unsigned char ns_delimiter_;
+
+			static const size_t INDEX_GUESS = ~size_t(0);
+
+			config()
+				:shards_(1)
+				,eviction_(eviction::lru)
+				,admission_(false)
+				,low_watermark_(0)
+				,high_watermark_(0)
+				,compress_min_(0)
+				,max_value_len_(MAX_VALUELEN)
+				,numa_nodes_(0)
+				,l1_entries_(0)
+				,l1_threshold_(16)
+				,index_items_(INDEX_GUESS)
+				,ns_delimiter_(0)
+			{}
+		};
+
+		// counters summed over the shards
+		struct stats
+		{
+			uint64_t curr_items_;
+			uint64_t bytes_; //items size
+			//the memory budget (-m) is taken by the slab pages and the index,
+			//the pages hold the data and metadata of the items, the rest of them is fragmentation
+			uint64_t mem_data_; //keys and values
+			uint64_t mem_metadata_; //item and slab chunk headers, value chunk chains
+			uint64_t mem_index_; //hash slots and the admission sketch
+			uint64_t mem_pages_;
+			uint64_t get_hits_;
+			uint64_t get_misses_;
+			uint64_t evictions_;
+			uint64_t expired_; //removed by the timer wheel or found expired
+			uint64_t reclaimed_; //evictions done by the reclaimer, the rest happened on SET
+			uint64_t reclaimer_lag_us_; //longest time a shard stayed over the high watermark
+			uint64_t admitted_; //window items that won against the eviction victim
+			uint64_t rejected_; //window items evicted since the victim is used more often
+			//compression, it's done outside the shards
+			uint64_t compressed_; //values stored compressed
+			uint64_t compress_skipped_; //values that didn't compress well enough
+			uint64_t compress_in_; //raw bytes of the compressed values
+			uint64_t compress_out_; //their compressed bytes
+			uint64_t compress_us_;
+			uint64_t decompress_us_;
+			//warm restart, the items found in the cache file at the start
+			uint64_t restored_items_;
+			uint64_t restore_us_;
+			//flash, the items that are only there count as flash_items_, not curr_items_
+			uint64_t flash_items_;
+			uint64_t flash_hits_; //GET misses that were read back from flash
+			uint64_t flash_misses_; //the keys were there, their records were overwritten or expired
+			uint64_t flash_writes_; //evicted items written to flash
+			uint64_t flash_dropped_; //evicted items that didn't make it (too big, the index or the writer is full)
+			uint64_t flash_bytes_;
+			//NUMA, the shard operations of the threads on the node of the shard and of the other ones
+			uint64_t local_ops_;
+			uint64_t remote_ops_;
+			//the read caches of the server threads, they are summed by the cache
+			uint64_t l1_hits_;
+			uint64_t l1_misses_; //the GETs that went on to the shards
+			uint64_t l1_fills_; //the keys that became hot
+			uint64_t l1_stale_; //entries found replaced, removed or expired
+			//namespaces, the stale items are counted as the lookups find them
+			uint64_t namespaces_; //invalidated at least once
+			uint64_t namespaces_max_; //the table is full there, the entries stay till the cache file is gone
+			uint64_t ns_invalidations_;
+			uint64_t ns_stale_; //items found after their namespace was invalidated, they are misses
+
+			stats()
+				:curr_items_(0)
+				,bytes_(0)
+				,mem_data_(0)
+				,mem_metadata_(0)
+				,mem_index_(0)
+				,mem_pages_(0)
+				,get_hits_(0)
+				,get_misses_(0)
+				,evictions_(0)
+				,expired_(0)
+				,reclaimed_(0)
+				,reclaimer_lag_us_(0)
+				,admitted_(0)
+				,rejected_(0)
+				,compressed_(0)
+				,compress_skipped_(0)
+				,compress_in_(0)
+				,compress_out_(0)
+				,compress_us_(0)
+				,decompress_us_(0)
+				,restored_items_(0)
+				,restore_us_(0)
+				,flash_items_(0)
+				,flash_hits_(0)
+				,flash_misses_(0)
+				,flash_writes_(0)
+				,flash_dropped_(0)
+				,flash_bytes_(0)
+				,local_ops_(0)
+				,remote_ops_(0)
+				,l1_hits_(0)
+				,l1_misses_(0)
+				,l1_fills_(0)
+				,l1_stale_(0)
+				,namespaces_(0)
+				,namespaces_max_(0)
+				,ns_invalidations_(0)
+				,ns_stale_(0)
+			{}
+
+			stats& operator+=(const stats& s)
+			{
+				curr_items_ += s.curr_items_;
+				bytes_ += s.bytes_;
+				mem_data_ += s.mem_data_;
+				mem_metadata_ += s.mem_metadata_;
+				mem_index_ += s.mem_index_;
+				mem_pages_ += s.mem_pages_;
+				get_hits_ += s.get_hits_;
+				get_misses_ += s.get_misses_;
+				evictions_ += s.evictions_;
+				expired_ += s.expired_;
+				reclaimed_ += s.reclaimed_;
+				reclaimer_lag_us_ = std::max(reclaimer_lag_us_, s.reclaimer_lag_us_);
+				admitted_ += s.admitted_;
+				rejected_ += s.rejected_;
+				compressed_ += s.compressed_;
+				compress_skipped_ += s.compress_skipped_;
+				compress_in_ += s.compress_in_;
+				compress_out_ += s.compress_out_;
+				compress_us_ += s.compress_us_;
+				decompress_us_ += s.decompress_us_;
+				restored_items_ = std::max(restored_items_, s.restored_items_); //of the whole cache
+				restore_us_ = std::max(restore_us_, s.restore_us_);
+				flash_items_ += s.flash_items_;
+				flash_hits_ += s.flash_hits_;
+				flash_misses_ += s.flash_misses_;
+				flash_writes_ += s.flash_writes_;
+				flash_dropped_ += s.flash_dropped_;
+				flash_bytes_ = std::max(flash_bytes_, s.flash_bytes_); //one log for the cache
+				local_ops_ += s.local_ops_;
+				remote_ops_ += s.remote_ops_;
+				l1_hits_ += s.l1_hits_;
+				l1_misses_ += s.l1_misses_;
+				l1_fills_ += s.l1_fills_;
+				l1_stale_ += s.l1_stale_;
+				namespaces_ = std::max(namespaces_, s.namespaces_); //one table for the cache
+				namespaces_max_ = std::max(namespaces_max_, s.namespaces_max_);
+				ns_invalidations_ = std::max(ns_invalidations_, s.ns_invalidations_);
+				ns_stale_ += s.ns_stale_;
+				return *this;
+			}
+		};
+
+		//the thread safe cache has a background thread for the expired items and the watermarks,
+		//it starts with the cache if there are watermarks or with the first expiring item.
+		//The watermarks need thread_safe
+		cache(size_t maxmemsize, bool thread_safe, const config& cfg = config());
 		~cache();
+		//the shards that get MIN_SHARD_PAGES each at the smallest page size, 1 at least
+		static size_t max_shards(const config& cfg, size_t maxmemsize);
+
+		//may throw, std::bad_alloc if the item doesn't fit in memory
+		void set(const request& r);
+		bool cas(const request& r, uint64_t cas);
+		bool remove(const request& r, uint64_t cas);
+
+		//the value is kept in chunks (it's never compressed), the sessions write such values with begin_set
+		bool chunked(size_t keylen, size_t value_len) const //as if the key was in a namespace
+		{
+			return item::total_size(item::key_room(keylen, ns_ != nullptr), value_len) > max_item_;
+		}
+		//makes the item of a SET, the request has the header, extras and key, the value is written
+		//by the writer as it comes. May throw like set
+		item_writer begin_set(const request& r, size_t value_len);
+		//stores the complete value like set, or like cas if cas isn't 0, the item is taken either way
+		bool store(item_writer& w, uint64_t cas);
+
+		//snapshots (see snapshot.h)
+		//adds references to the live items of the shard index slots from pos on, max slots at a time
+		//under the shard lock, pos moves past them. Returns false once the shard is done
+		bool next_items(size_t shard, size_t& pos, size_t max, std::vector<item_ptr>& items);
+		//stores an item of a snapshot like set, the exptime is unix time and the value is as it was stored
+		//(compressed or not). May throw like set
+		void put(const key& k, uint32_t flags, uint32_t exptime, uint64_t cas, const unsigned char* d, size_t len, bool compressed);
 
-		//may throw
-		void set(item v);
-		bool cas(item v, uint64_t cas);
-		bool remove(const item& v, uint64_t cas);
+		// What a server thread read cache (see l1.h) keeps to serve an item without the shard.
+		// The shards have a version per group of keys, it's bumped under the lock whenever an item
+		// of those keys is replaced, removed or touched, so an unchanged version means the item is still
+		// there as it was. The item memory is safe while the thread is pinned (see epoch.h)
+		struct item_version
+		{
+			item* it_;
+			const std::atomic<uint32_t>* version_; //nullptr if the item can't be kept
+			uint32_t seen_;
+			uint32_t exptime_;
+			slab_allocator* a_;
+
+			item_version()
+				:it_(nullptr)
+				,version_(nullptr)
+				,seen_(0)
+				,exptime_(0)
+				,a_(nullptr)
+			{}
+		};
+		//the counters of a read cache, only its thread writes them, STAT sums them (see add_l1)
+		struct l1_stats
+		{
+			std::atomic<uint64_t> hits_;
+			std::atomic<uint64_t> misses_;
+			std::atomic<uint64_t> fills_;
+			std::atomic<uint64_t> stale_;
 
-		std::shared_ptr<item> get(const key& k);
+			l1_stats()
+				:hits_(0)
+				,misses_(0)
+				,fills_(0)
+				,stale_(0)
+			{}
+		};
+
+		// a key of a batch lookup (see get(lookups&, Found)), the key memory is the caller's
+		struct lookup
+		{
+			key k_;
+			uint64_t hv_;
+			item_view it_; //the item found, empty if it's not there
+			item_version v_; //if the read caches are on
+
+			lookup(const key& k, uint64_t hv)
+				:k_(k)
+				,hv_(hv)
+			{}
+		};
+		typedef std::vector<lookup*> lookups;
+
+		//the item stays valid while the view is alive, see item_view
+		item_view get(const key& k)
+		{
+			return get(k, hasher()(k));
+		}
+		//hv is the key hash, see request::hv_. A miss looks for the key on flash (if it's enabled),
+		//the item found there is read back into the memory
+		item_view get(const key& k, uint64_t hv);
+		//like get, the item and its version go to v if the read caches are on
+		item_view get(const key& k, uint64_t hv, item_version& v);
+		// Looks up many keys at once: the keys of a shard are looked up under one lock, their slots
+		// and items are prefetched first. found(lookup&) is called for every key, in the order of the
+		// shards, while its item is pinned (it_ is empty if it's not there), the pin is gone after the
+		// call. Found must not wait for anything (see epoch.h). The keys are reordered
+		template <typename Found>
+		void get(lookups& keys, Found found);
 		bool get_value(std::vector<unsigned char>& v, const key& k);
-	
+		//sets the new expiration (as it's sent by the client) and returns the item, pinned like get
+		item_view touch(const key& k, uint32_t exptime)
+		{
+			return touch(k, exptime, hasher()(k));
+		}
+		item_view touch(const key& k, uint32_t exptime, uint64_t hv);
+		//appends the value as it was set (decompressed)
+		void read_value(const item& it, std::vector<unsigned char>& v);
+
+		//drops all the keys of the namespace (the key without the delimiter) at once, see namespace_table.
+		//Returns false if there are no namespaces or the table is full
+		bool invalidate(const key& ns);
+		//the namespace of the item was invalidated after it was made, for the readers that don't look it up
+		bool stale(const item& it) const
+		{
+			return stale(it, ns_.get());
+		}
+
+		stats get_stats() const;
+		//the items, memory and operations of the shards on the NUMA node (see config::numa_nodes_),
+		//the counters of the whole cache (compression, restore, flash log, read caches, namespaces) are there too
+		stats get_node_stats(unsigned int node) const;
+		//the counters of a read cache are in get_stats while it's there
+		void add_l1(const l1_stats* s);
+		void remove_l1(const l1_stats* s);
+
+		//the protocol expiration: 0 is never, up to 30 days it's relative to now, more is unix time
+		static uint32_t expiry(uint32_t exptime, uint32_t now);
+		static uint32_t now()
+		{
+			return ::time(nullptr);
+		}
+
+		size_t shard_count() const
+		{
+			return shards_.size();
+		}
+		const config& get_config() const
+		{
+			return cfg_;
+		}
+		//the NUMA node of the shard, -1 without NUMA
+		int shard_node(size_t shard) const
+		{
+			return cfg_.numa_nodes_ ? int(shard*cfg_.numa_nodes_/cfg_.shards_) : -1;
+		}
+		size_t maxmemsize() const
+		{
+			return pool_.maxmemsize();
+		}
+		//the memory of the items, "heap" or the arena backing
+		const char* memory_backing() const
+		{
+			const arena* a = pool_.get_arena();
+			return a ? arena::backing_name(a->get_backing()) : "heap";
+		}
+
 	private:
-		std::unique_ptr<std::mutex> m_;
+		//frees the item and its value chunks, any thread
+		static void free_item(item* it, slab_allocator& a);
+		static bool stale(const item& it, const namespace_table* ns)
+		{
+			return it.ns_ && ns && it.get_generation() != ns->key_generation(it.get_data(), it.keylen_);
+		}
+		//the timer wheel may not have got to it yet
+		static bool expired(const item& it, uint32_t now)
+		{
+			return it.exptime_ && int32_t(it.exptime_ - now) <= 0;
+		}
+		//the counters that are kept by the cache, not the shards
+		stats cache_stats() const;
+		//the slab page size for the memory per shard
+		static size_t slab_page_size(const config& cfg, size_t maxmemsize);
+		//the arena config with the layout of the items and pages, a cache file of another layout isn't reused
+		static arena::config arena_config(const config& cfg, size_t maxmemsize);
+
+		// an item found in a restored arena
+		struct restored_item
+		{
+			item* it_;
+			uint64_t hv_;
+			uint32_t atime_; //the LRU order, it's sorted without touching the items
+		};
+
+		// the value to store, the request value or its compressed copy
+		struct value
+		{
+			const unsigned char* d_;
+			size_t len_;
+			bool compressed_;
+		};
+
+		// a cache partition, it has its own lock, hash, LRU and slab allocator
+		// so threads working on different shards never contend,
+		// the memory budget (pool) is shared
+		struct shard
+		{
+			explicit shard(mem_pool& pool, const config& cfg, size_t items, size_t sketch_width, bool thread_safe, flash_log* flash, int node, const namespace_table* ns, cache* owner);
+			~shard();
+
+			//like cas if cas isn't 0
+			bool set(const request& r, const value& v, uint64_t cas, uint64_t hv);
+			bool remove(const request& r, uint64_t cas, uint64_t hv);
+			//the item for a value that is written later, store links it
+			item_writer reserve(const request& r, size_t value_len, uint64_t hv);
+			bool store(item* it, uint64_t cas, uint64_t hv);
+
+			item_view get(const key& k, uint64_t hv, item_version* v = nullptr);
+			//the keys of the shard, see cache::get(lookups&, Found)
+			void get(lookup* const* keys, size_t n);
+			item_view touch(const key& k, uint32_t exptime, uint64_t hv);
+
+			stats get_stats() const;
+
+			// what a shard leaves for the next pass of the reclaimer
+			struct backlog
+			{
+				bool expired_; //more expired items than the batch
+				uint32_t next_expiry_; //the time the next items expire, 0 if none do
+				bool retired_; //retired items that some readers may still use
+			};
+			//removes up to max expired items and frees the retired items that no reader can use anymore
+			backlog expire(size_t max);
+
+			//evicts up to batch items if the chunk memory is over high (or still over low),
+			//returns true if there is more to do
+			bool reclaim(size_t low, size_t high, size_t batch);
+
+			//see cache::next_items
+			bool next_items(size_t& pos, size_t max, std::vector<item_ptr>& items);
+
+			//flash (see cache::flash_get)
+			//the log position of the key that isn't in the memory, 0 if it's not on flash
+			uint64_t flash_find(uint64_t hv);
+			//the record at pos is gone
+			void flash_drop(uint64_t hv, uint64_t pos);
+			//the item read from pos goes back to the memory if the key is still there, it's pinned like get
+			item_view promote(const request& r, const value& v, uint32_t generation, uint64_t pos, uint64_t hv);
+
+			//the biggest item that isn't chunked
+			size_t max_item_size() const
+			{
+				return a_.chunk_size(value_class() - 1) - slab_allocator::CHUNK_HEADER;
+			}
+
+			//warm restart (see cache::restore), before the shard is used.
+			//The slab classes are the same in every shard, any shard checks the pages of all of them
+			static const unsigned int BAD_PAGE = ~0u;
+			//the slab class of an arena page, BAD_PAGE if the chunk headers don't make sense
+			unsigned int restore_class(unsigned char* page) const
+			{
+				unsigned int cls = a_.page_class(page);
+				return cls == a_.classes() ? BAD_PAGE : cls;
+			}
+			bool value_page(unsigned int cls) const
+			{
+				return cls == value_class();
+			}
+			template <typename F>
+			void for_each_chunk(unsigned char* page, unsigned int cls, F f) const
+			{
+				a_.for_each_used(page, cls, f);
+			}
+			//the linked item in a chunk of the class is whole and it's not expired, the value chunks aside
+			bool restore_item(const item* it, unsigned int cls, uint32_t now) const;
+			//the value chunks of a chunked item are its own (the classes of the arena pages are given),
+			//they are claimed and their links are moved by the arena shift
+			bool restore_chain(item* it, const arena& a, const std::vector<unsigned int>& classes, std::vector<bool>& claimed) const;
+			template <typename Keep>
+			void adopt_page(unsigned char* page, unsigned int cls, Keep keep)
+			{
+				a_.adopt_page(page, cls, keep);
+			}
+			//grows the index for the items without taking pages from the shard, false if the pool is short
+			bool reserve_index(size_t items);
+			//links the items on the adopted pages, the least recently used first,
+			//the ones that don't make it are freed. Returns the number of the linked ones
+			size_t restore(std::vector<restored_item>& items);
+
+		private:
+			typedef std::vector<lru> lrus;
+
+			std::unique_ptr<std::mutex> m_;
+
+			const eviction eviction_;
+			mem_pool& pool_;
+			size_t used_mem_;
+			size_t chunk_mem_; //slab memory taken by the linked items
+			size_t data_mem_; //keys and values of the linked items
+			size_t meta_mem_; //their headers
+			size_t index_mem_; //hash and sketch, taken from the pool like the pages
+			size_t hash_mem_; //of index_mem_, the old table of a growing hash is there until it's moved
+			uint32_t tick_; //access counter
+			bool reclaiming_; //went over the high watermark and not down to the low one yet
+			std::chrono::steady_clock::time_point reclaim_start_;
+			const size_t high_mem_; //the high watermark of chunk_mem_, 0 if there is no reclaimer
+			cache* const owner_; //its reclaimer is woken up, nullptr if the cache isn't thread safe
+			stats st_; //hits, misses and evictions, the rest is counted on demand
+			flash_log* flash_; //nullptr if there is no flash
+			std::unique_ptr<flash_index> fi_; //the keys on flash
+			const int node_; //NUMA node of the memory, -1 if it's anywhere
+			std::unique_ptr<std::atomic<uint32_t>[]> versions_; //see item_version, if the read caches are on
+			const namespace_table* ns_; //nullptr if the keys aren't in namespaces
+
+			slab_allocator a_; //must outlive the items
+			hash h_;
+			lrus lru_; //one per slab class, the eviction works per class
+			lrus window_; //new items per slab class, with the admission filter only
+			timer_wheel timers_; //expiring items
+			std::unique_ptr<frequency_sketch> sketch_; //admission filter, if enabled
+			lru retired_; //removed items the readers may still use, in the retire epoch order
+			size_t retired_mem_; //slab memory of the retired items
+
+			static const size_t EXPIRE_BATCH = 8; //expired items removed by a SET at most
+			static const size_t EVICT_BATCH = 4; //items evicted at once when the class needs a chunk
+			static const size_t RETIRE_BATCH = 64; //retired items collected at once
+			static const size_t RETIRE_MEM = 64*1024; //or their memory
+			static const size_t VERSIONS = 1024; //key groups, the ones that change often make false misses
+
+			bool do_set(const request& r, const value& v, uint64_t cas, uint64_t hv);
+			bool do_store(item* it, uint64_t cas, uint64_t hv);
+			bool do_remove(const request& r, uint64_t cas, uint64_t hv);
 
-		size_t maxmemsize_;
-		size_t used_mem_;
+			item* do_get(const key& k, uint64_t hv, uint32_t now);
+			size_t do_expire(uint32_t now, size_t max);
+			void do_collect();
+
+			item* make_item(const request& r, size_t value_len, bool compressed, uint32_t now);
+			void link_item(item* it);
+			lru& list_of(item* it)
+			{
+				return it->window_ ? window_[it->cls_] : lru_[it->cls_];
+			}
+			void retire_item(item* it, uint64_t hv);
+			void get_version(item* it, uint64_t hv, item_version& v); //under the lock
+			void bump_version(uint64_t hv) //under the lock
+			{
+				if (versions_)
+					versions_[hv & (VERSIONS - 1)].fetch_add(1);
+			}
+			void unlink_item(item* it, uint64_t hv);
+			void unlink_item(item* it);
+			void* alloc_chunk(unsigned int cls, size_t size);
+			//takes the memory from the pool for the index, the pages go back if it's short (their items are evicted)
+			void reserve_memory(size_t size);
+			void grow_index();
+			//gives the memory of the old hash table back once it's moved
+			void count_index();
+			void place_index(); //on the node
+			void grow_flash_index(bool reclaim);
+			void to_flash(const item* it, uint64_t hv);
+			item* next_victim(unsigned int cls);
+			void evict_item(item* it);
+			item* oldest_item(unsigned int cls) const;
+			//the value chunks take the biggest class, the items the smaller ones
+			unsigned int value_class() const
+			{
+				return a_.large_class() - 1;
+			}
+			size_t chunk_memory(const item* it) const
+			{
+				if (!it->chunked_)
+					return a_.chunk_size(it->cls_);
+				return a_.chunk_size(a_.class_of(it->get_alloc_size())) + it->get_chain().chunks_*a_.chunk_size(value_class());
+			}
+			size_t meta_memory(const item* it) const
+			{
+				size_t n = sizeof(item) + slab_allocator::CHUNK_HEADER + item::key_room(0, it->ns_);
+				if (it->chunked_)
+					n += sizeof(chain) + it->get_chain().chunks_*(slab_allocator::CHUNK_HEADER + sizeof(value_chunk));
+				return n;
+			}
+			uint32_t class_age(unsigned int cls) const //ticks since the oldest item access
+			{
+				return tick_ - oldest_item(cls)->atime_;
+			}
+			unsigned int oldest_class() const;
+			void evict_chunk(void* p, unsigned int cls);
+			void count_access() //under the lock
+			{
+				if (node_ >= 0)
+					++(numa::current_node() == node_ ? st_.local_ops_ : st_.remote_ops_);
+			}
 
-		hash h_;
-		lru lru_;
+			shard(const shard&) = delete;
+			shard& operator=(shard&) = delete;
+		};
 
-		void do_set(item v);
-		bool do_cas(item v, uint64_t cas);
-		bool do_remove(const item& v, uint64_t cas);
+		typedef std::vector<std::unique_ptr<shard>> shards;
+		config cfg_;
+		mem_pool pool_;
+		std::unique_ptr<flash_log> flash_; //the shards write to it
+		std::unique_ptr<namespace_table> ns_; //nullptr if the keys aren't in namespaces
+		shards shards_;
 
-		bool do_get_value(std::vector<unsigned char>& v, const key& k);
-		std::shared_ptr<item> do_get_item(const key& k);
-		std::shared_ptr<item> do_get(const key& k);
+		//background reclaimer, thread safe cache only
+		std::unique_ptr<std::thread> reclaimer_;
+		std::once_flag reclaimer_started_;
+		std::mutex reclaimer_m_;
+		std::condition_variable reclaimer_cv_;
+		bool stop_;
+		bool alarm_; //a shard went over the high watermark
+		std::atomic<uint32_t> deadline_; //the reclaimer wakes up for the expired items then, 0 if nothing expires
+		bool ready_; //the shards don't start the reclaimer while the cache is restored
 
-		void delete_item(key k);
-		void free_mem(size_t size);
 
+		size_t max_item_; //the biggest item that isn't chunked
+
+		//compression counters, the codec runs outside the shard locks
+		std::atomic<uint64_t> compressed_;
+		std::atomic<uint64_t> compress_skipped_;
+		std::atomic<uint64_t> compress_in_;
+		std::atomic<uint64_t> compress_out_;
+		std::atomic<uint64_t> compress_ns_;
+		std::atomic<uint64_t> decompress_ns_;
+
+		uint64_t restored_items_;
+		uint64_t restore_us_;
+
+		mutable std::mutex l1_m_;
+		std::vector<const l1_stats*> l1s_;
+
+		void reclaim();
+		void start_reclaimer();
+		//the shards wake the reclaimer up, under their lock
+		void expiring(uint32_t exptime);
+		void over_watermark();
+		//takes the items over from the pages of a restored arena
+		void restore();
+		//the value, compressed into buf if it's big enough and it's worth it
+		value make_value(const unsigned char* d, size_t len, size_t keylen, std::vector<unsigned char>& buf);
+		value make_value(const request& r, std::vector<unsigned char>& buf)
+		{
+			return make_value(r.get_key().d_ + r.h_.request.keylen, r.get_value_len(), r.h_.request.keylen, buf);
+		}
+		//the value of an item that was stored before (see put), buf may take the value
+		value stored_value(const key& k, const unsigned char* d, size_t len, bool compressed, std::vector<unsigned char>& buf);
+		//a SET request of the header, extras and key in rd, the value goes aside
+		static request make_request(unsigned char (&rd)[sizeof(protocol_binary_request_header) + 8 + MAX_KEYLEN]
+				,const key& k, uint32_t flags, uint32_t exptime, uint64_t cas, size_t value_len);
+		//reads the item of the key that isn't in the memory from flash, see get
+		item_view flash_get(const key& k, uint64_t hv);
+
+		// the high half picks the shard, the hash tables use the low one
+		size_t shard_index(uint64_t hv) const
+		{
+			return ((hv >> 32) * shards_.size()) >> 32;
+		}
+		shard& get_shard(uint64_t hv)
+		{
+			return *shards_[shard_index(hv)];
+		}
 
 		cache(const cache&) = delete;
 		cache& operator=(cache&) = delete;
 	};
 
+	template <typename Replace>
+	std::pair<cache::item*, bool> cache::hash::upsert(item* it, uint64_t hv, Replace replace)
+	{
+		assert(!full()); //the owner grows it, it counts the memory
+		move(MOVE_STEP);
+		table* t = nullptr;
+		size_t pos = locate(it->get_key(), hv, t);
+		slot s;
+		s.p_ = it;
+		s.hv_ = hv;
+		if (t) { //a key that isn't moved yet is replaced in the old table
+			item* old = (*t)[pos].p_;
+			if (!replace(old))
+				return std::make_pair(old, false);
+			t->set(pos, s);
+			return std::make_pair(old, true);
+		}
+		place(t_, pos, s);
+		++count_;
+		return std::make_pair(nullptr, true);
+	}
+
+	template <typename Expire>
+	size_t cache::timer_wheel::advance(uint32_t now, size_t max, Expire expire)
+	{
+		size_t n = 0;
+		while (true) {
+			item*& slot = slots_[0][now_ & (SLOTS - 1)];
+			while (slot) {
+				if (n == max)
+					return n;
+				item* it = slot;
+				expire(it);
+				assert(slot != it);
+				++n;
+			}
+			if (int32_t(now - now_) <= 0)
+				return n;
+
+			++now_;
+			//the higher levels first, their items may go to the lower level slots that are due now
+			unsigned int level = 0;
+			while (level + 1 != LEVELS && !(now_ & ((1u << (SLOT_BITS*(level + 1))) - 1))) {
+				++level;
+			}
+			for (; level; --level) {
+				cascade(level);
+			}
+		}
+	}
+
+	template <typename Found>
+	void cache::get(lookups& keys, Found found)
+	{
+		std::sort(keys.begin(), keys.end(), [this](const lookup* a, const lookup* b) {
+				return shard_index(a->hv_) < shard_index(b->hv_);
+			});
+		for (size_t i = 0; i != keys.size(); ) {
+			size_t s = shard_index(keys[i]->hv_);
+			size_t end = i + 1;
+			while (end != keys.size() && shard_index(keys[end]->hv_) == s) {
+				++end;
+			}
+			shards_[s]->get(keys.data() + i, end - i);
+			//the hits first, their pins go before the flash reads (they lock the shard)
+			auto misses = std::partition(keys.begin() + i, keys.begin() + end, [](const lookup* l) {
+					return bool(l->it_);
+				});
+			for (auto l = keys.begin() + i; l != keys.begin() + end; ++l) {
+				if (l >= misses && flash_)
+					(*l)->it_ = flash_get((*l)->k_, (*l)->hv_);
+				found(**l);
+				(*l)->it_.reset();
+			}
+			i = end;
+		}
+	}
+
+	template <typename Remove>
+	std::pair<cache::item*, bool> cache::hash::erase(const key& k, uint64_t hv, Remove remove)
+	{
+		move(MOVE_STEP);
+		table* t = nullptr;
+		size_t pos = locate(k, hv, t);
+		if (!t)
+			return std::make_pair(nullptr, false);
+		item* old = (*t)[pos].p_;
+		if (!remove(old))
+			return std::make_pair(old, false);
+		remove_at(*t, pos);
+		return std::make_pair(old, true);
+	}
 }
 
 #endif
@@ -9,9 +9,19 @@ namespace mc
 	static const char VER[]="1.0";
 
 	static const size_t MAX_KEYLEN = 250;
-	static const size_t MAX_VALUELEN = 1024*1024;
+	static const size_t MAX_VALUELEN = 1024*1024; //default, the values are stored in chunks up to cache::config::max_value_len_
 	static const size_t MAX_WRITE_SIZE = 4*1204;
 	static const size_t MAX_EPOLL_EVENTS = 128;
+	static const size_t SLAB_PAGE_SIZE = 1024*1024; //cache memory is allocated by pages
+	static const size_t MIN_SLAB_PAGE_SIZE = 64*1024; //the pages get smaller down to this if the memory is short
+	static const size_t SMALL_CHUNK = 136; //default, the slab chunks grow by 8 bytes up to it: items of up to 64 bytes of key and value
+	static const size_t MAX_SMALL_CHUNK = 1024;
+	static const size_t MIN_SHARD_PAGES = 64; //pages per shard the page size is picked for
+	static const size_t MAX_REQUEST_BUFFER = 64*1024; //sessions keep request buffers up to this size
+	static const size_t READ_CHUNK_SIZE = 16*1024; //socket reads, the chunks handed to the server threads are up to this size
+	static const size_t MAX_GET_BATCH = 256; //pipelined GETs looked up at once
+	static const size_t MAX_NAMESPACES = 48*1024; //namespaces that may be invalidated, 16 bytes each (the table is 3/4 full at most)
+	static const size_t HUGE_PAGE_SIZE = 2*1024*1024; //the cache arena is aligned to it
 
 	struct sysevent
 	{
@@ -19,6 +29,7 @@ namespace mc
 		{
 			system
 			,session
+			,close //the server is done with the session, the main loop closes its socket and deletes it
 		};
 
 		event_type t_;
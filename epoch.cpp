@@ -0,0 +1,120 @@
+// epoch based reclamation of the cache items
+//
+#include "epoch.h"
+#include <atomic>
+#include <thread>
+#include <assert.h>
+
+using namespace mc;
+
+namespace
+{
+	// pinned epoch of a thread, the slots are never freed,
+	// the slot of a thread that is gone is taken by the next new one
+	struct slot
+	{
+		std::atomic<uint64_t> epoch_; //0 if not pinned
+		std::atomic<bool> used_;
+		slot* next_;
+		unsigned int depth_; //nested guards, the owner thread only
+		char pad_[64]; //keeps the slots that are allocated one after another on separate cache lines
+	};
+
+	std::atomic<uint64_t> g_epoch(1);
+	std::atomic<slot*> g_slots(nullptr);
+
+	slot* acquire_slot()
+	{
+		for (slot* s = g_slots.load(std::memory_order_acquire); s; s = s->next_) {
+			bool used = false;
+			if (!s->used_.load(std::memory_order_relaxed) && s->used_.compare_exchange_strong(used, true, std::memory_order_acquire))
+				return s;
+		}
+
+		slot* s = new slot;
+		s->epoch_.store(0, std::memory_order_relaxed);
+		s->used_.store(true, std::memory_order_relaxed);
+		s->depth_ = 0;
+		slot* head = g_slots.load(std::memory_order_relaxed);
+		do {
+			s->next_ = head;
+		} while (!g_slots.compare_exchange_weak(head, s, std::memory_order_release, std::memory_order_relaxed));
+		return s;
+	}
+
+	struct thread_slot
+	{
+		slot* s_;
+
+		thread_slot()
+			:s_(acquire_slot())
+		{}
+		~thread_slot()
+		{
+			s_->used_.store(false, std::memory_order_release);
+		}
+	};
+
+	slot& my_slot()
+	{
+		thread_local thread_slot ts;
+		return *ts.s_;
+	}
+
+	//the oldest epoch a reader is pinned at, e if they are all at e or newer,
+	//the fence pairs with the one of pin(): a reader that pinned before it is seen by the scan,
+	//one that pins after it sees the items unlinked before
+	uint64_t oldest_pinned(uint64_t e)
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		for (slot* s = g_slots.load(std::memory_order_acquire); s; s = s->next_) {
+			uint64_t p = s->epoch_.load(std::memory_order_acquire);
+			if (p && p < e) {
+				e = p;
+			}
+		}
+		return e;
+	}
+}
+
+void epoch::pin()
+{
+	slot& s = my_slot();
+	if (!s.depth_++) {
+		s.epoch_.store(g_epoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst); //the pin is visible before the items are read
+	}
+}
+
+void epoch::unpin()
+{
+	slot& s = my_slot();
+	assert(s.depth_);
+	if (!--s.depth_) {
+		s.epoch_.store(0, std::memory_order_release); //the items read before are not used anymore
+	}
+}
+
+uint64_t epoch::current()
+{
+	return g_epoch.load(std::memory_order_relaxed);
+}
+
+uint64_t epoch::advance()
+{
+	return oldest_pinned(g_epoch.fetch_add(1, std::memory_order_seq_cst) + 1);
+}
+
+void epoch::synchronize()
+{
+	assert(!pinned());
+	uint64_t e = g_epoch.fetch_add(1, std::memory_order_seq_cst) + 1;
+	while (oldest_pinned(e) != e) {
+		std::this_thread::yield(); //the readers don't stay pinned for long
+	}
+}
+
+bool epoch::pinned()
+{
+	return my_slot().depth_ != 0;
+}
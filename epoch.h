@@ -0,0 +1,39 @@
+// epoch based reclamation of the cache items
+//
+#ifndef MC_EPOCH_H
+#define MC_EPOCH_H
+
+#include <stdint.h>
+
+namespace mc
+{
+	// The readers pin the global epoch while they use the items they found, instead of
+	// counting references on every item, so the popular items aren't written by all the readers.
+	// An item removed from the cache is retired with the epoch of the removal and it's freed
+	// once no reader is pinned at that epoch or an older one.
+	//
+	// Every thread has its own slot (a cache line of its own), pin and unpin only write to it.
+	// The writers scan the slots when they collect the retired items, which they do in batches.
+	// A pinned thread must not wait for anything (a lock included), the writers may wait for it.
+	struct epoch
+	{
+		//pins the calling thread at the current epoch, the pins nest
+		static void pin();
+		static void unpin();
+		//the calling thread is pinned
+		static bool pinned();
+
+		//the epoch to retire with
+		static uint64_t current();
+
+		//starts a new epoch and returns the oldest one a reader may be pinned at,
+		//the items retired before it can be freed
+		static uint64_t advance();
+
+		//starts a new epoch and waits for the readers that are pinned at the older ones,
+		//the calling thread must not be pinned
+		static void synchronize();
+	};
+}
+
+#endif
@@ -0,0 +1,299 @@
+// second tier of the cache on flash
+//
+#include "flash.h"
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+using namespace mc;
+
+namespace
+{
+	//the first read takes the small records whole
+	const size_t READ_AHEAD = 4096;
+
+	std::runtime_error file_error(const char* what, const std::string& path)
+	{
+		std::stringstream se;
+		se << what << " " << path << ": " << errno;
+		return std::runtime_error(se.str());
+	}
+
+	bool pread_all(int fd, unsigned char* d, size_t len, uint64_t off)
+	{
+		while (len) {
+			ssize_t n = ::pread(fd, d, len, off);
+			if (n <= 0) {
+				if (n < 0 && errno == EINTR)
+					continue;
+				return false;
+			}
+			d += n;
+			len -= n;
+			off += n;
+		}
+		return true;
+	}
+
+	bool pwrite_all(int fd, const unsigned char* d, size_t len, uint64_t off)
+	{
+		while (len) {
+			ssize_t n = ::pwrite(fd, d, len, off);
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				return false;
+			}
+			d += n;
+			len -= n;
+			off += n;
+		}
+		return true;
+	}
+}
+
+const size_t flash_log::SEGMENT_SIZE;
+const size_t flash_log::BUFFERS;
+
+flash_log::flash_log(const config& cfg)
+	:path_(cfg.path_)
+	,fd_(-1)
+	,size_(cfg.size_ & ~uint64_t(SEGMENT_SIZE - 1))
+	,cur_(nullptr)
+	,written_(SEGMENT_SIZE) //0 is no position
+	,tail_(SEGMENT_SIZE)
+	,bytes_written_(0)
+	,failed_(false)
+	,stop_(false)
+{
+	if (size_ < 2*SEGMENT_SIZE) {
+		throw std::runtime_error("the flash file must be 8MB at least");
+	}
+	fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd_ == -1) {
+		throw file_error("can't open the flash file", path_);
+	}
+	if (::ftruncate(fd_, size_)) {
+		::close(fd_);
+		throw file_error("can't size the flash file", path_);
+	}
+
+	for (size_t i = 0; i != BUFFERS; ++i) {
+		segments_.emplace_back(new segment());
+		free_.push_back(segments_.back().get());
+	}
+	cur_ = free_.back();
+	free_.pop_back();
+	cur_->pos_ = SEGMENT_SIZE;
+	writer_ = std::thread([this]() { write_segments(); });
+}
+
+flash_log::~flash_log()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_);
+		stop_ = true;
+	}
+	cv_.notify_one();
+	writer_.join();
+	::close(fd_);
+}
+
+bool flash_log::next_segment()
+{
+	if (free_.empty())
+		return false;
+	uint64_t pos = cur_->pos_ + SEGMENT_SIZE;
+	full_.push_back(cur_);
+	cv_.notify_one();
+	cur_ = free_.back();
+	free_.pop_back();
+	cur_->pos_ = pos;
+	cur_->used_ = 0;
+	return true;
+}
+
+void flash_log::write_segments()
+{
+	std::unique_lock<std::mutex> lock(m_);
+	while (true) {
+		cv_.wait(lock, [this]() { return stop_ || !full_.empty(); });
+		if (stop_)
+			return;
+		segment* s = full_.front();
+		//the segment of the file that is overwritten goes first, the readers see it before the write starts
+		if (s->pos_ + SEGMENT_SIZE > size_) {
+			tail_.store(std::max(tail_.load(), s->pos_ + SEGMENT_SIZE - size_));
+		}
+		lock.unlock();
+
+		bool ok = pwrite_all(fd_, s->d_.get(), s->used_, offset(s->pos_));
+		if (ok) {
+			bytes_written_.fetch_add(s->used_, std::memory_order_relaxed);
+#ifdef POSIX_FADV_DONTNEED
+			//the flash is there to save the memory, the page cache doesn't keep the log
+			::posix_fadvise(fd_, offset(s->pos_), s->used_, POSIX_FADV_DONTNEED);
+#endif
+		}
+
+		lock.lock();
+		full_.pop_front();
+		free_.push_back(s);
+		written_ = s->pos_ + SEGMENT_SIZE;
+		if (!ok && !failed_) {
+			//nothing in the file can be trusted anymore
+			std::clog << "flash write error " << errno << ", the flash tier is off" << std::endl;
+			failed_ = true;
+			tail_.store(~uint64_t(0));
+		}
+	}
+}
+
+bool flash_log::read(uint64_t pos, std::vector<unsigned char>& buf) const
+{
+	record r;
+	{
+		std::lock_guard<std::mutex> lock(m_);
+		if (pos < tail_.load())
+			return false;
+		if (pos >= written_) { //in memory
+			const segment* s = cur_;
+			for (const segment* f: full_) {
+				if (pos >= f->pos_ && pos < f->pos_ + SEGMENT_SIZE) {
+					s = f;
+				}
+			}
+			if (pos < s->pos_ || pos + sizeof(r) > s->pos_ + s->used_)
+				return false;
+			const unsigned char* d = s->d_.get() + (pos - s->pos_);
+			::memcpy(&r, d, sizeof(r));
+			size_t len = sizeof(r) + r.keylen_ + size_t(r.value_len_);
+			if (pos + len > s->pos_ + s->used_)
+				return false;
+			buf.assign(d, d + len);
+			return true;
+		}
+	}
+
+	//a record never crosses a segment
+	size_t left = SEGMENT_SIZE - pos % SEGMENT_SIZE;
+	buf.resize(std::min(READ_AHEAD, left));
+	if (buf.size() < sizeof(r) || !pread_all(fd_, buf.data(), buf.size(), offset(pos)))
+		return false;
+	::memcpy(&r, buf.data(), sizeof(r));
+	size_t len = sizeof(r) + r.keylen_ + size_t(r.value_len_);
+	if (len > left)
+		return false;
+	size_t have = buf.size();
+	buf.resize(len);
+	if (len > have && !pread_all(fd_, buf.data() + have, len - have, offset(pos) + have))
+		return false;
+	//the writer may have started on the segment meanwhile
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	return pos >= tail_.load();
+}
+
+flash_index::flash_index()
+	:t_(16)
+	,mask_(15)
+	,count_(0)
+{}
+
+uint64_t flash_index::find(uint64_t hv) const
+{
+	size_t pos = hv & mask_;
+	for (size_t d = 0; t_[pos].pos_ && distance(pos) >= d; ++d, pos = (pos + 1) & mask_) {
+		if (t_[pos].hv_ == hv)
+			return t_[pos].pos_;
+	}
+	return 0;
+}
+
+void flash_index::insert(uint64_t hv, uint64_t pos)
+{
+	assert(pos && !full());
+	size_t i = hv & mask_;
+	for (size_t d = 0; t_[i].pos_ && distance(i) >= d; ++d, i = (i + 1) & mask_) {
+		if (t_[i].hv_ == hv) {
+			t_[i].pos_ = pos;
+			return;
+		}
+	}
+	slot s;
+	s.hv_ = hv;
+	s.pos_ = pos;
+	place(hv & mask_, s);
+	++count_;
+}
+
+void flash_index::erase(uint64_t hv, uint64_t pos)
+{
+	size_t i = hv & mask_;
+	for (size_t d = 0; t_[i].pos_ && distance(i) >= d; ++d, i = (i + 1) & mask_) {
+		if (t_[i].hv_ == hv) {
+			if (!pos || t_[i].pos_ == pos) {
+				remove_at(i);
+			}
+			return;
+		}
+	}
+}
+
+size_t flash_index::live(uint64_t tail) const
+{
+	size_t n = 0;
+	for (const slot& s: t_) {
+		if (s.pos_ >= tail)
+			++n;
+	}
+	return n;
+}
+
+void flash_index::rebuild(size_t size, uint64_t tail)
+{
+	assert(size && !(size & (size - 1)));
+	slots t(size);
+	t.swap(t_);
+	mask_ = size - 1;
+	count_ = 0;
+	for (const slot& s: t) {
+		if (s.pos_ && s.pos_ >= tail) {
+			place(s.hv_ & mask_, s);
+			++count_;
+		}
+	}
+}
+
+void flash_index::place(size_t pos, slot s)
+{
+	size_t d = (pos - s.hv_) & mask_;
+	for (; ; ++d, pos = (pos + 1) & mask_) {
+		slot& cur = t_[pos];
+		if (!cur.pos_) {
+			cur = s;
+			return;
+		}
+		size_t cd = distance(pos);
+		if (cd < d) {
+			std::swap(s, cur);
+			d = cd;
+		}
+	}
+}
+
+void flash_index::remove_at(size_t pos)
+{
+	size_t next = (pos + 1) & mask_;
+	while (t_[next].pos_ && distance(next)) {
+		t_[pos] = t_[next];
+		pos = next;
+		next = (next + 1) & mask_;
+	}
+	t_[pos].pos_ = 0;
+	--count_;
+}
@@ -0,0 +1,205 @@
+// second tier of the cache on flash
+//
+#ifndef MC_FLASH_H
+#define MC_FLASH_H
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+
+namespace mc
+{
+	// The items evicted from the memory go to a log in a file (on an SSD), the cache keeps
+	// their keys (see flash_index) and reads them back on a GET miss. The log is written by big
+	// segments, a background thread writes a segment once it's full, so the file only sees
+	// sequential writes. The log wraps around the file, the oldest segment is overwritten
+	// and its items are gone. A few segments are kept in memory: the one that is filled
+	// and the full ones that aren't written yet, their items are read from there.
+	//
+	// The positions in the log only grow, the place in the file is the position modulo the file size.
+	// A reader checks the position after it read the file, the writer moves the tail past
+	// a segment before it overwrites it (like a seqlock). The file starts empty every time.
+	struct flash_log
+	{
+		struct config
+		{
+			std::string path_; //empty if there is no flash
+			size_t size_; //of the file
+
+			config()
+				:size_(0)
+			{}
+
+			bool enabled() const
+			{
+				return !path_.empty();
+			}
+		};
+
+		// an item in the log, the key and the value (as it's stored in the cache) follow
+		struct record
+		{
+			uint64_t cas_;
+			uint32_t flags_;
+			uint32_t exptime_; //unix time, 0 if it never expires
+			uint32_t value_len_;
+			uint32_t generation_; //of the namespace (see namespace_table), 0 if it's in none
+			uint8_t keylen_;
+			uint8_t compressed_;
+			uint16_t unused_;
+		};
+
+		static const size_t SEGMENT_SIZE = 4*1024*1024; //the biggest record too
+		static const size_t BUFFERS = 4; //segments in memory
+
+		//throws if the file can't be made
+		explicit flash_log(const config& cfg);
+		~flash_log();
+
+		// Appends a record of len bytes, fill(unsigned char* p) writes it there. Returns its position,
+		// 0 if it's not taken: it's too big or the writer is behind. Any thread
+		template <typename Fill>
+		uint64_t append(size_t len, Fill fill)
+		{
+			if (len > SEGMENT_SIZE)
+				return 0;
+			std::lock_guard<std::mutex> lock(m_);
+			if (failed_ || (cur_->used_ + len > SEGMENT_SIZE && !next_segment()))
+				return 0;
+			uint64_t pos = cur_->pos_ + cur_->used_;
+			fill(cur_->d_.get() + cur_->used_);
+			cur_->used_ += len;
+			return pos;
+		}
+
+		//the record at the position (header, key and value) into buf, false if it's gone. Any thread
+		bool read(uint64_t pos, std::vector<unsigned char>& buf) const;
+
+		//the record at the position may be still there, the ones before the tail are overwritten
+		bool live(uint64_t pos) const
+		{
+			return pos >= tail_.load();
+		}
+		uint64_t tail() const
+		{
+			return tail_.load();
+		}
+		uint64_t bytes_written() const
+		{
+			return bytes_written_.load(std::memory_order_relaxed);
+		}
+
+	private:
+		struct segment
+		{
+			std::unique_ptr<unsigned char[]> d_;
+			uint64_t pos_; //of the first byte
+			size_t used_;
+
+			segment()
+				:d_(new unsigned char[SEGMENT_SIZE])
+				,pos_(0)
+				,used_(0)
+			{}
+		};
+
+		const std::string path_;
+		int fd_;
+		const uint64_t size_; //whole segments
+
+		mutable std::mutex m_;
+		std::condition_variable cv_;
+		std::vector<std::unique_ptr<segment>> segments_;
+		segment* cur_; //filled now
+		std::deque<segment*> full_; //to be written, the first one is being written
+		std::vector<segment*> free_;
+		uint64_t written_; //the positions before it are in the file
+		std::atomic<uint64_t> tail_; //the positions before it are gone
+		std::atomic<uint64_t> bytes_written_;
+		bool failed_; //a write failed, the log is off
+		bool stop_;
+		std::thread writer_;
+
+		bool next_segment(); //under the lock
+		void write_segments();
+		uint64_t offset(uint64_t pos) const
+		{
+			return pos % size_;
+		}
+
+		flash_log(const flash_log&) = delete;
+		flash_log& operator=(const flash_log&) = delete;
+	};
+
+	// The keys of the items in the flash log: the key hash and the log position, the key itself
+	// is in the log and it's checked when it's read. Open addressing with robin hood probing
+	// like the cache hash. The entries whose segment is overwritten stay until they are found
+	// or the table is rebuilt. Not thread safe, the cache shard owns it
+	struct flash_index
+	{
+		flash_index();
+
+		uint64_t find(uint64_t hv) const; //0 if it's not there
+		void insert(uint64_t hv, uint64_t pos); //replaces the one with the same hash
+		void erase(uint64_t hv, uint64_t pos = 0); //only if it's at pos, unless pos is 0
+
+		size_t size() const
+		{
+			return count_;
+		}
+		size_t capacity() const //slots
+		{
+			return t_.size();
+		}
+		size_t memory() const
+		{
+			return t_.size()*sizeof(slot);
+		}
+		bool full() const
+		{
+			return (count_ + 1)*8 > t_.size()*7; //max load 7/8
+		}
+		//an eviction may take a few entries at once, the table grows before it's full
+		bool crowded() const
+		{
+			return count_*4 > t_.size()*3;
+		}
+		//the entries that are live (see flash_log::tail)
+		size_t live(uint64_t tail) const;
+		//remakes the table with the size, without the entries before the tail
+		void rebuild(size_t size, uint64_t tail);
+
+	private:
+		struct slot
+		{
+			uint64_t hv_;
+			uint64_t pos_; //0 if empty
+		};
+		typedef std::vector<slot> slots;
+
+		slots t_;
+		size_t mask_;
+		size_t count_;
+
+		size_t distance(size_t pos) const
+		{
+			return (pos - t_[pos].hv_) & mask_;
+		}
+		void place(size_t pos, slot s);
+		void remove_at(size_t pos);
+
+		flash_index(const flash_index&) = delete;
+		flash_index& operator=(const flash_index&) = delete;
+	};
+}
+
+#endif
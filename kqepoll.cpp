@@ -13,23 +13,32 @@ using namespace kq;
 
 int kq::epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
 {
-	struct kevent ke;
+	struct kevent ke[2];
+	int n = 1;
 	if (op == EPOLL_CTL_ADD) {
 		if (!(event->events & EPOLLOUT)) {
-			EV_SET(&ke, fd, EVFILT_READ, EV_ADD, 0, 5, event->data.ptr); //assume listening socket
+			EV_SET(&ke[0], fd, EVFILT_READ, EV_ADD, 0, 5, event->data.ptr); //assume listening socket
 		}
 		else {
-			EV_SET(&ke, fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, event->data.ptr);
+			EV_SET(&ke[0], fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, event->data.ptr);
+		}
+		if ((event->events & EPOLLOUT) && (event->events & EPOLLET)) { //a session socket, it tells when it's writable again
+			EV_SET(&ke[1], fd, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, event->data.ptr);
+			n = 2;
 		}
 	}
 	else if (op == EPOLL_CTL_DEL) {
-		EV_SET(&ke, fd, EVFILT_READ, EV_DELETE, 0, 0, event->data.ptr);
+		EV_SET(&ke[0], fd, EVFILT_READ, EV_DELETE, 0, 0, event->data.ptr);
+		if ((event->events & EPOLLOUT) && (event->events & EPOLLET)) {
+			EV_SET(&ke[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, event->data.ptr);
+			n = 2;
+		}
 	}
 	else {
 		assert(false);
 		return -1;
 	}
-	return kevent(epfd, &ke, 1, NULL, 0, NULL);
+	return kevent(epfd, ke, n, NULL, 0, NULL);
 }
 
 int kq::epoll_create1(int flags)
@@ -48,6 +57,7 @@ int kq::epoll_wait(int epfd, struct epoll_event *events, int maxevents, int time
 	}
 	for (int i = 0; i < n; ++i) {
 		events[i].data.ptr = ke[i].udata;
+		events[i].events = ke[i].filter == EVFILT_WRITE ? EPOLLOUT : EPOLLIN;
 		if (ke[i].flags & EV_ERROR)
 			events[i].events = EPOLLERR;
 	}
@@ -0,0 +1,158 @@
+// read cache of a server thread for the hot keys
+//
+#include "l1.h"
+
+using namespace mc;
+
+namespace
+{
+	//only the owner thread writes the counters, there is no need for a locked add
+	void bump(std::atomic<uint64_t>& c)
+	{
+		c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+
+	size_t pow2(size_t n)
+	{
+		size_t p = 1;
+		while (p < n) {
+			p <<= 1;
+		}
+		return p;
+	}
+}
+
+const size_t l1_cache::WAYS;
+const uint32_t l1_cache::REFRESH_HITS;
+const size_t l1_cache::COUNTERS_PER_ENTRY;
+const size_t l1_cache::AGING;
+
+l1_cache::l1_cache(cache& c)
+	:c_(c)
+	,threshold_(std::max(1u, c.get_config().l1_threshold_))
+	,entries_(pow2(std::max(WAYS, c.get_config().l1_entries_)))
+	,mask_(entries_.size() - 1)
+	,counters_(entries_.size()*COUNTERS_PER_ENTRY)
+	,counters_mask_(counters_.size() - 1)
+	,gets_(0)
+{
+	for (auto& e: entries_) {
+		e.hv_ = 0;
+		e.hits_left_ = 0;
+	}
+	for (auto& n: counters_) {
+		n.hv_ = 0;
+		n.count_ = 0;
+	}
+	c_.add_l1(&st_);
+}
+
+l1_cache::~l1_cache()
+{
+	c_.remove_l1(&st_);
+}
+
+cache::item_view l1_cache::get(const cache::key& k, uint64_t hv)
+{
+	cache::item_view it = hit(k, hv);
+	if (it)
+		return it;
+	cache::item_version v;
+	it = c_.get(k, hv, v);
+	fill(hv, it, v);
+	return it;
+}
+
+// The version is checked once the thread is pinned: the item can't be freed after that,
+// and if it was retired before, the version has changed already
+cache::item_view l1_cache::hit(const cache::key& k, uint64_t hv)
+{
+	count(hv);
+	entry* e = find(hv);
+	if (e && e->hits_left_) {
+		epoch::pin();
+		const cache::item_version& v = e->v_;
+		if (v.version_->load() == v.seen_ && !(v.exptime_ && int32_t(v.exptime_ - cache::now()) <= 0)
+				&& v.it_->get_key() == k && !c_.stale(*v.it_)) {
+			--e->hits_left_;
+			bump(st_.hits_);
+			return cache::item_view(v.it_, v.a_);
+		}
+		epoch::unpin();
+		bump(st_.stale_);
+	}
+	bump(st_.misses_);
+	return cache::item_view();
+}
+
+void l1_cache::fill(uint64_t hv, const cache::item_view& it, const cache::item_version& v)
+{
+	entry* e = find(hv);
+	if (e) {
+		e->v_ = cache::item_version();
+	}
+	uint32_t n = count_of(hv);
+	if (it && v.version_ && (e || n >= threshold_)) {
+		keep(e, hv, n, v);
+	}
+}
+
+l1_cache::entry* l1_cache::find(uint64_t hv)
+{
+	for (size_t i = 0; i != WAYS; ++i) {
+		entry& e = entries_[(hv + i) & mask_];
+		if (e.v_.it_ && e.hv_ == hv)
+			return &e;
+	}
+	return nullptr;
+}
+
+// A counter is taken over by another key only once its count is down to nothing,
+// until then the other key wears it down, so the hot keys keep theirs
+uint32_t l1_cache::count(uint64_t hv)
+{
+	if (++gets_ == counters_.size()*AGING) {
+		for (auto& c: counters_) {
+			c.count_ >>= 1;
+		}
+		gets_ = 0;
+	}
+	counter& c = counters_[(hv >> 32) & counters_mask_];
+	if (c.hv_ == hv)
+		return ++c.count_;
+	if (c.count_) {
+		--c.count_;
+		return 0;
+	}
+	c.hv_ = hv;
+	c.count_ = 1;
+	return 1;
+}
+
+uint32_t l1_cache::count_of(uint64_t hv) const
+{
+	const counter& c = counters_[(hv >> 32) & counters_mask_];
+	return c.hv_ == hv ? c.count_ : 0;
+}
+
+void l1_cache::keep(entry* e, uint64_t hv, uint32_t count, const cache::item_version& v)
+{
+	if (!e) {
+		for (size_t i = 0; i != WAYS; ++i) {
+			entry& c = entries_[(hv + i) & mask_];
+			if (!c.v_.it_) {
+				e = &c;
+				break;
+			}
+			if (count_of(c.hv_) < count && (!e || count_of(c.hv_) < count_of(e->hv_))) {
+				e = &c;
+			}
+		}
+		if (!e)
+			return;
+		bump(st_.fills_);
+	}
+	e->hv_ = hv;
+	e->v_ = v;
+	e->hits_left_ = REFRESH_HITS;
+}
@@ -0,0 +1,93 @@
+// read cache of a server thread for the hot keys
+//
+#ifndef MC_L1_H
+#define MC_L1_H
+
+#include <stdint.h>
+#include <vector>
+#include "cache.h"
+
+namespace mc
+{
+	// A few keys may take most of the GETs, every one of them locks the same shard. A server thread
+	// counts the GETs of the keys (a small table, the counts are halved every so often), a key
+	// that gets the threshold is hot and the thread keeps its item here. A hit takes no lock and
+	// writes nothing shared: it pins the thread and checks the version of the item (see
+	// cache::item_version), a SET, DELETE, TOUCH or eviction of the key makes it stale at once,
+	// an invalidate of its namespace doesn't touch the versions, the hit checks the generation.
+	// An entry goes back to the shard after a number of hits, so the item stays fresh in the LRU.
+	//
+	// One per thread, it must be gone before the cache
+	struct l1_cache
+	{
+		explicit l1_cache(cache& c);
+		~l1_cache();
+
+		//like cache::get
+		cache::item_view get(const cache::key& k, uint64_t hv);
+		//like cache::get of a batch, the hits are found first
+		template <typename Found>
+		void get(cache::lookups& keys, Found found)
+		{
+			size_t misses = 0;
+			for (cache::lookup* l: keys) {
+				l->it_ = hit(l->k_, l->hv_);
+				if (l->it_) {
+					found(*l);
+					l->it_.reset();
+				}
+				else {
+					keys[misses++] = l;
+				}
+			}
+			keys.resize(misses);
+			c_.get(keys, [this, &found](cache::lookup& l) {
+					fill(l.hv_, l.it_, l.v_);
+					found(l);
+				});
+		}
+
+	private:
+		struct entry
+		{
+			uint64_t hv_;
+			cache::item_version v_; //the item is nullptr if the entry is free
+			uint32_t hits_left_; //before it's looked up in the shard again
+		};
+		struct counter
+		{
+			uint64_t hv_;
+			uint32_t count_;
+		};
+
+		static const size_t WAYS = 4; //entries a key may take
+		static const uint32_t REFRESH_HITS = 1024;
+		static const size_t COUNTERS_PER_ENTRY = 16;
+		static const size_t AGING = 16; //the counts are halved after that many GETs per counter
+
+		cache& c_;
+		const uint32_t threshold_;
+		std::vector<entry> entries_;
+		size_t mask_;
+		std::vector<counter> counters_;
+		size_t counters_mask_;
+		size_t gets_; //since the counts were halved
+		cache::l1_stats st_;
+
+		//counts the GET of the key, the item if its entry is still good
+		cache::item_view hit(const cache::key& k, uint64_t hv);
+		//the item of a miss as the cache found it, it's kept if the key is hot
+		void fill(uint64_t hv, const cache::item_view& it, const cache::item_version& v);
+		entry* find(uint64_t hv);
+		//counts a GET of the key, returns its count
+		uint32_t count(uint64_t hv);
+		uint32_t count_of(uint64_t hv) const;
+		//takes the item into e, or into a free entry or the one of the coldest key if it's colder
+		void keep(entry* e, uint64_t hv, uint32_t count, const cache::item_version& v);
+
+		l1_cache(const l1_cache&) = delete;
+		l1_cache& operator=(const l1_cache&) = delete;
+	};
+}
+
+#endif
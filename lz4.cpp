@@ -0,0 +1,180 @@
+// LZ4 block format codec for the cache values
+//
+#include "lz4.h"
+#include <stdint.h>
+#include <string.h>
+
+using namespace mc;
+
+namespace
+{
+	const unsigned int HASH_BITS = 12;
+	const size_t MIN_MATCH = 4;
+	const size_t MF_LIMIT = 12; //a match can't start in the last 12 bytes
+	const size_t LAST_LITERALS = 5; //the last 5 bytes are always literals
+	const size_t MAX_OFFSET = 65535;
+	const unsigned int SKIP_TRIGGER = 6; //the search step grows every 64 misses in a row
+
+	uint32_t read32(const unsigned char* p)
+	{
+		uint32_t v;
+		::memcpy(&v, p, sizeof(v));
+		return v;
+	}
+
+	unsigned int hash(uint32_t v)
+	{
+		return (v*2654435761u) >> (32 - HASH_BITS);
+	}
+
+	//the length continues in 255 bytes after the 4 bit token field
+	unsigned char* put_length(unsigned char* op, size_t len)
+	{
+		for (; len >= 255; len -= 255) {
+			*op++ = 255;
+		}
+		*op++ = (unsigned char)len;
+		return op;
+	}
+
+	bool get_length(const unsigned char*& ip, const unsigned char* iend, size_t& len)
+	{
+		unsigned char b;
+		do {
+			if (ip == iend)
+				return false;
+			b = *ip++;
+			len += b;
+		} while (b == 255);
+		return true;
+	}
+
+	//one sequence: the literals, then the match (if mlen isn't 0), returns nullptr if it doesn't fit
+	unsigned char* put_sequence(unsigned char* op, unsigned char* oend, const unsigned char* lit, size_t litlen, size_t offset, size_t mlen)
+	{
+		size_t need = 1 + litlen/255 + 1 + litlen + (mlen ? 2 + mlen/255 + 1 : 0);
+		if (need > size_t(oend - op))
+			return nullptr;
+
+		unsigned char* token = op++;
+		if (litlen >= 15) {
+			*token = 15 << 4;
+			op = put_length(op, litlen - 15);
+		}
+		else {
+			*token = (unsigned char)(litlen << 4);
+		}
+		if (litlen) {
+			::memcpy(op, lit, litlen);
+			op += litlen;
+		}
+		if (!mlen)
+			return op;
+
+		*op++ = (unsigned char)offset;
+		*op++ = (unsigned char)(offset >> 8);
+		mlen -= MIN_MATCH;
+		if (mlen >= 15) {
+			*token |= 15;
+			op = put_length(op, mlen - 15);
+		}
+		else {
+			*token |= (unsigned char)mlen;
+		}
+		return op;
+	}
+}
+
+size_t lz4::compress(const unsigned char* src, size_t len, unsigned char* dst, size_t cap)
+{
+	uint32_t table[1 << HASH_BITS]; //last position of every hashed 4 bytes
+	unsigned char* op = dst;
+	unsigned char* oend = dst + cap;
+	size_t anchor = 0; //start of the pending literals
+
+	if (len > MF_LIMIT) {
+		::memset(table, 0, sizeof(table));
+		size_t limit = len - MF_LIMIT;
+		size_t mlimit = len - LAST_LITERALS;
+		size_t misses = 1 << SKIP_TRIGGER;
+		size_t ip = 0;
+		while (ip < limit) {
+			uint32_t seq = read32(src + ip);
+			unsigned int h = hash(seq);
+			size_t ref = table[h];
+			table[h] = ip;
+			//the table starts with zeros, the bytes are compared anyway
+			if (ref >= ip || ip - ref > MAX_OFFSET || read32(src + ref) != seq) {
+				ip += misses++ >> SKIP_TRIGGER;
+				continue;
+			}
+			misses = 1 << SKIP_TRIGGER;
+
+			//extend the match back over the literals and forward
+			while (ip > anchor && ref && src[ip - 1] == src[ref - 1]) {
+				--ip;
+				--ref;
+			}
+			size_t mlen = MIN_MATCH;
+			while (ip + mlen < mlimit && src[ref + mlen] == src[ip + mlen]) {
+				++mlen;
+			}
+
+			op = put_sequence(op, oend, src + anchor, ip - anchor, ip - ref, mlen);
+			if (!op)
+				return 0;
+			ip += mlen;
+			anchor = ip;
+		}
+	}
+
+	op = put_sequence(op, oend, src + anchor, len - anchor, 0, 0);
+	return op ? op - dst : 0;
+}
+
+bool lz4::decompress(const unsigned char* src, size_t srclen, unsigned char* dst, size_t len)
+{
+	const unsigned char* ip = src;
+	const unsigned char* iend = src + srclen;
+	unsigned char* op = dst;
+	unsigned char* oend = dst + len;
+
+	while (ip != iend) {
+		unsigned int token = *ip++;
+		size_t litlen = token >> 4;
+		if (litlen == 15 && !get_length(ip, iend, litlen))
+			return false;
+		if (litlen > size_t(iend - ip) || litlen > size_t(oend - op))
+			return false;
+		if (litlen) {
+			::memcpy(op, ip, litlen);
+			op += litlen;
+			ip += litlen;
+		}
+		if (ip == iend) //the last sequence has no match
+			break;
+
+		if (iend - ip < 2)
+			return false;
+		size_t offset = ip[0] | (size_t(ip[1]) << 8);
+		ip += 2;
+		size_t mlen = token & 15;
+		if (mlen == 15 && !get_length(ip, iend, mlen))
+			return false;
+		mlen += MIN_MATCH;
+		if (!offset || offset > size_t(op - dst) || mlen > size_t(oend - op))
+			return false;
+
+		const unsigned char* m = op - offset;
+		if (offset >= mlen) {
+			::memcpy(op, m, mlen);
+			op += mlen;
+		}
+		else {
+			for (size_t i = 0; i != mlen; ++i) { //overlapping, it repeats the last offset bytes
+				*op++ = *m++;
+			}
+		}
+	}
+	return op == oend;
+}
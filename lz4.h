@@ -0,0 +1,23 @@
+// LZ4 block format codec for the cache values
+//
+#ifndef MC_LZ4_H
+#define MC_LZ4_H
+
+#include <stddef.h>
+
+namespace mc
+{
+	// A small implementation of the LZ4 block format (greedy matching with a 4K entry hash table),
+	// it's about as fast and the output is readable by any LZ4 block decoder.
+	// There is no frame or size header, the caller keeps the decompressed size.
+	struct lz4
+	{
+		//returns the compressed size, 0 if it doesn't fit in cap bytes
+		static size_t compress(const unsigned char* src, size_t len, unsigned char* dst, size_t cap);
+
+		//decompresses exactly len bytes, returns false if the data is broken
+		static bool decompress(const unsigned char* src, size_t srclen, unsigned char* dst, size_t len);
+	};
+}
+
+#endif
@@ -7,12 +7,18 @@
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <thread>
+#include <algorithm>
 
 #include "config.h"
 #include "socket.h"
 #include "server.h"
 #include "round_robin.h"
 #include "cache.h"
+#include "snapshot.h"
+#include "numa.h"
 #include "pipe.h"
 
 
@@ -27,13 +33,51 @@ static bool is_event_error(const epoll_event& e)
 
 typedef std::shared_ptr<mc::server> server_ptr;
 typedef std::vector<server_ptr> servers;
-static void accept_incoming_connections(int ctl_pipe, tcp::socket& s, tcp::epoll& ep, mc::round_robin<servers>& server_pool);
+
+// picks the server for a new connection round robin. With NUMA the servers on the node of the cpu
+// that takes the packets of the connection go first (see tcp::incoming_cpu), its socket buffers are there
+struct server_pool
+{
+	explicit server_pool(servers srvs, unsigned int nodes)
+		:all_(srvs)
+	{
+		for (unsigned int n = 0; n != nodes; ++n) {
+			servers ns;
+			for (auto& p: srvs) {
+				if (p->node_ == int(n))
+					ns.push_back(p);
+			}
+			nodes_.emplace_back(ns.empty() ? nullptr : new mc::round_robin<servers>(std::move(ns)));
+		}
+	}
+
+	mc::server* pick(int fd)
+	{
+		if (!nodes_.empty()) {
+			int cpu = tcp::incoming_cpu(fd);
+			int node = cpu < 0 ? -1 : mc::numa::host().node_of_cpu(cpu);
+			if (node >= 0 && size_t(node) < nodes_.size() && nodes_[node])
+				return nodes_[node]->pick().get();
+		}
+		return all_.pick().get();
+	}
+
+private:
+	mc::round_robin<servers> all_;
+	std::vector<std::unique_ptr<mc::round_robin<servers>>> nodes_; //empty without NUMA
+
+	server_pool(const server_pool&) = delete;
+	server_pool& operator=(const server_pool&) = delete;
+};
+
+static void accept_incoming_connections(int ctl_pipe, tcp::socket& s, tcp::epoll& ep, server_pool& pool);
 
 //global cache
 std::unique_ptr<mc::cache> g_cache;
 
-// this will listen for connections and push the incoming data chunks to mc::server for processing
-static void server_loop(tcp::socket& s, unsigned int maxevents, unsigned int threads, unsigned int max_connections)
+// this will listen for connections and push the incoming data chunks to mc::server for processing,
+// with NUMA the servers take turns on the nodes (the cache shards are split between the nodes too)
+static void server_loop(tcp::socket& s, unsigned int maxevents, unsigned int threads, unsigned int max_connections, unsigned int numa_nodes)
 {
 	assert(maxevents);
 
@@ -43,17 +87,23 @@ static void server_loop(tcp::socket& s, unsigned int maxevents, unsigned int thr
 		size_t mcs = max_connections/threads + 1; //max connections per server
 		for (unsigned int i = 1; i != threads; ++i) {
 			// mc::server will do the actual job on its own thread
-			server_ptr p(new mc::server(mcs, true));
+			server_ptr p(new mc::server(mcs, true, numa_nodes ? int((i - 1) % numa_nodes) : -1));
+			if (g_cache->get_config().l1_entries_) {
+				p->l1_.reset(new mc::l1_cache(*g_cache));
+			}
 			p->start();
 			srvs.push_back(p);
 		}
 	}
 	else {
-		server_ptr p(new mc::server(max_connections, false));
+		server_ptr p(new mc::server(max_connections, false, numa_nodes ? 0 : -1));
+		if (g_cache->get_config().l1_entries_) {
+			p->l1_.reset(new mc::l1_cache(*g_cache));
+		}
 		p->start();
 		srvs.push_back(p);
 	}
-	mc::round_robin<servers> server_pool(std::move(srvs));
+	server_pool pool(std::move(srvs), numa_nodes);
 
 	tcp::epoll ep(maxevents); //we'll use epoll
 	// start listening
@@ -80,7 +130,9 @@ static void server_loop(tcp::socket& s, unsigned int maxevents, unsigned int thr
 		// wait for events
 		int n = ep.wait();
 
-		// handle events
+		// handle events, the sessions the servers are done with are deleted after them
+		// (that closes their sockets), so a session of an event and its descriptor are still there
+		std::vector<mc::session*> closing;
 		for (int i = 0; i < n; ++i) {
 			epoll_event& e = ep.events_[i];
 
@@ -100,7 +152,7 @@ static void server_loop(tcp::socket& s, unsigned int maxevents, unsigned int thr
 			}
 
 			if (&s == static_cast<tcp::socket*>(e.data.ptr)) { //event on the listening socket means a new connection
-				accept_incoming_connections(sysctl.write_end(), s, ep, server_pool);
+				accept_incoming_connections(sysctl.write_end(), s, ep, pool);
 			}
 
 			else if (&sysctl == static_cast<mc::pipe*>(e.data.ptr)) { //session control event
@@ -130,6 +182,9 @@ static void server_loop(tcp::socket& s, unsigned int maxevents, unsigned int thr
 						assert(ses);
 						static_cast<mc::server*>(ses->user_)->push(mc::server::data_chunk(mc::server::data_chunk::ctl_session_ctl, ses));
 					}
+					else if (se.t_ == mc::sysevent::close) {
+						closing.push_back(static_cast<mc::session*>(se.user_));
+					}
 				}
 			}
 
@@ -141,17 +196,27 @@ static void server_loop(tcp::socket& s, unsigned int maxevents, unsigned int thr
 					continue;
 				}
 
-				// read data and enqueue it for processing by the server
-				// it should be pretty fast, we don't actually do any data copies here
+				mc::server* server = static_cast<mc::server*>(ses->user_);
+				//the socket takes more of a response that waits for it (see session::continue_write)
+				if ((e.events & EPOLLOUT) && ses->writable()) {
+					server->push(mc::server::data_chunk(mc::server::data_chunk::ctl_session_ctl, ses));
+				}
+				if (!(e.events & EPOLLIN))
+					continue;
+
+				// read data and enqueue it for processing by the server,
+				// the chunks are big enough for a run of pipelined requests (a multi-get)
+				// and they are copied out of the read buffer at their size
+				static mc::server::data_chunk::buffer rbuf(mc::READ_CHUNK_SIZE);
+				//the session stays until this loop deletes it (see sysevent::close),
+				//the server may be done with it meanwhile, then it doesn't take the chunks
+				int fd = ses->fd_;
 				bool closed  = true; //assume closed unless we get valid data count
 				while(true) {
-					mc::server::data_chunk::buffer buf;
-					buf.resize(512); //512b max chunks
-
-					ssize_t count = ::read(ses->fd_, &buf[0], buf.size());
+					ssize_t count = ::read(fd, &rbuf[0], rbuf.size());
 					if (count == -1) {
 						if (errno != EAGAIN) {
-							std::cerr << "read error: " << ses->fd_ << std::endl;
+							std::cerr << "read error: " << fd << std::endl;
 							count = 0;
 						}
 						else {
@@ -159,7 +224,7 @@ static void server_loop(tcp::socket& s, unsigned int maxevents, unsigned int thr
 						}
 					}
 					else if (count) { //valid count
-						assert(count <= buf.size());
+						assert(count <= rbuf.size());
 						closed = false;
 					}
 
@@ -167,33 +232,35 @@ static void server_loop(tcp::socket& s, unsigned int maxevents, unsigned int thr
 						break;
 
 					if (!closed) {
-						//resize according to the actual count, it won't reallocate anything...
-						buf.erase(buf.begin()+count, buf.end());
+						mc::server::data_chunk::buffer buf(rbuf.begin(), rbuf.begin() + count);
 
 						//hand the chunk over to the server
-						static_cast<mc::server*>(ses->user_)->push(mc::server::data_chunk(mc::server::data_chunk::ctl_read, ses, std::move(buf)));
+						server->push(mc::server::data_chunk(mc::server::data_chunk::ctl_read, ses, std::move(buf)));
 					}
 					else {
 						assert(!count);
 						// tell the server that the session is to be closed
-						static_cast<mc::server*>(ses->user_)->push(mc::server::data_chunk(mc::server::data_chunk::ctl_close, ses));
+						server->push(mc::server::data_chunk(mc::server::data_chunk::ctl_close, ses));
 						break;
 					}
 				}
 			}
 		}
+		for (mc::session* ses: closing) {
+			delete ses;
+		}
 	}
 }
 
-static void accept_incoming_connections(int ctl_pipe, tcp::socket& s, tcp::epoll& ep, mc::round_robin<servers>& server_pool)
+static void accept_incoming_connections(int ctl_pipe, tcp::socket& s, tcp::epoll& ep, server_pool& pool)
 {
 	try {
 		tcp::connection_info info;
 		while (tcp::accept_connection(info, s, ep)) { //accept all connections
 			//pick a server and create session...
 			//sessions are deleted by the server always
-			mc::server* server = server_pool.pick().get();
-			mc::session* ses = new mc::session(info.fd_, ctl_pipe, server, *g_cache); 
+			mc::server* server = pool.pick(info.fd_);
+			mc::session* ses = new mc::session(info.fd_, ctl_pipe, server, *g_cache, server->l1_.get());
 			try {
 				ep.add_descriptor(info.fd_, ses);
 				server->push(mc::server::data_chunk(mc::server::data_chunk::ctl_new_session, ses)); //notify server about a new session
@@ -209,6 +276,27 @@ static void accept_incoming_connections(int ctl_pipe, tcp::socket& s, tcp::epoll
 	}
 }
 
+// dumps the cache to the snapshot file on every SIGUSR1, the signal is blocked in all the other threads
+static void snapshot_loop(std::string path)
+{
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	while (true) {
+		int sig = 0;
+		if (sigwait(&set, &sig))
+			continue;
+		try {
+			mc::snapshot::stats st = mc::snapshot::dump(*g_cache, path);
+			std::clog << "snapshot written to " << path << ": " << st.items_ << " items, " << st.bytes_/(1024*1024) << "MB in "
+				<< st.us_/1000 << "ms" << std::endl;
+		}
+		catch (const std::exception& e) {
+			std::clog << "snapshot failed: " << e.what() << std::endl;
+		}
+	}
+}
+
 static void usage_help()
 {
 	std::cerr << "Ver: " << mc::VER << " Usage: " << appname << "[options]" << std::endl
@@ -218,11 +306,48 @@ static void usage_help()
 		<< "  -t Number of threads, default is 1" << std::endl
 		<< "  -m Max cache memory (MB), default is 500" << std::endl
 		<< "  -c Max number of simultaneous connections, default is 1024" << std::endl
+		<< "  -s Number of cache shards (independently locked partitions), default is 4 x threads, fewer if the memory is short" << std::endl
+		<< "  -f Slab chunk size growth factor, default is 1.25" << std::endl
+		<< "  -n Smallest slab chunk size (bytes), default is 80" << std::endl
+		<< "  -g Slab chunk sizes grow by 8 bytes up to this size (bytes) for the small items, then by -f, 0 is off, default is 136" << std::endl
+		<< "  -e Eviction policy: lru (strict LRU) or clock (hits only set a reference bit), default is lru" << std::endl
+		<< "  -a Admission filter (TinyLFU), new keys don't evict more popular items" << std::endl
+		<< "  -w Background reclaimer watermarks low,high (% of the cache memory), for example 85,90, default is no reclaimer" << std::endl
+		<< "  -z Compress the values of this size (bytes) or bigger with LZ4, default is no compression" << std::endl
+		<< "  -I Max value size (MB), the large values are stored in chunks, default is 1" << std::endl
+		<< "  -L Cache memory in one arena of huge pages (reserved ones or transparent), default is heap pages" << std::endl
+		<< "  -k Fault in and lock the cache memory at the start (in the arena)" << std::endl
+		<< "  -r Keep the cache memory in this file (on /dev/shm for shared memory), a restart with the same options takes the items back" << std::endl
+		<< "  -F Flash file and its size (MB) for the evicted items, for example /ssd/mc.flash,65536, default is no flash" << std::endl
+		<< "  -S Snapshot file, it's loaded at the start (unless -r restored the cache) and SIGUSR1 writes the cache to it" << std::endl
+		<< "  -N NUMA mode, the server threads and the cache shards are split between the nodes" << std::endl
+		<< "  -i Items the index is made for at the start, it grows incrementally as they come, 0 starts it small, default is a guess from -m" << std::endl
+		<< "  -H Read cache of every server thread for the hot keys: entries[,GETs that make a key hot], for example 64,16, default is none" << std::endl
+		<< "  -D Namespace delimiter, a key is in the namespace before it and INVALIDATE (0x50) drops a namespace at once, default is none" << std::endl
 		<< "Example:" << std::endl
 		<< " " << appname << " -p 5000 -t 2 -m 100" << std::endl
 		<< std::endl;
 }
 
+static double parse_factor(const char* p)
+{
+	char* end = nullptr;
+	double f = ::strtod(p, &end);
+	if (!*p || *end) {
+		throw std::runtime_error("bad number in a numeric option");
+	}
+	return f;
+}
+
+static mc::cache::eviction parse_eviction(const char* p)
+{
+	if (!strcmp(p, "lru"))
+		return mc::cache::eviction::lru;
+	if (!strcmp(p, "clock"))
+		return mc::cache::eviction::clock;
+	throw std::runtime_error("unknown eviction policy");
+}
+
 static unsigned int parse_number(const char* p)
 {
 	if (!*p) {
@@ -240,6 +365,45 @@ static unsigned int parse_number(const char* p)
 	return n;
 }
 
+static void parse_watermarks(const char* p, mc::cache::config& cfg)
+{
+	std::string s(p);
+	size_t comma = s.find(',');
+	if (comma == std::string::npos) {
+		throw std::runtime_error("watermarks must be low,high");
+	}
+	cfg.low_watermark_ = parse_number(s.substr(0, comma).c_str());
+	cfg.high_watermark_ = parse_number(s.substr(comma + 1).c_str());
+	if (cfg.low_watermark_ >= cfg.high_watermark_ || cfg.high_watermark_ > 100) {
+		throw std::runtime_error("bad watermarks");
+	}
+}
+
+static void parse_flash(const char* p, mc::cache::config& cfg)
+{
+	std::string s(p);
+	size_t comma = s.rfind(',');
+	if (comma == std::string::npos || !comma) {
+		throw std::runtime_error("flash must be file,MB");
+	}
+	cfg.flash_.path_ = s.substr(0, comma);
+	cfg.flash_.size_ = size_t(parse_number(s.substr(comma + 1).c_str()))*1024*1024;
+}
+
+//entries[,threshold]
+static void parse_l1(const char* p, mc::cache::config& cfg)
+{
+	std::string s(p);
+	size_t comma = s.find(',');
+	cfg.l1_entries_ = parse_number(s.substr(0, comma).c_str());
+	if (comma != std::string::npos) {
+		cfg.l1_threshold_ = parse_number(s.substr(comma + 1).c_str());
+	}
+	if (!cfg.l1_entries_ || !cfg.l1_threshold_) {
+		throw std::runtime_error("hot keys must be entries,threshold");
+	}
+}
+
 int main(int argc, char* argv[])
 {
     ::sigignore(SIGPIPE); //ignore this signal
@@ -251,8 +415,12 @@ int main(int argc, char* argv[])
 	unsigned int threads = 1; //number threads
 	unsigned int cachemem = 500; //~max memory for the cache in MB
 	unsigned int max_connections = 1024;
+	mc::cache::config cfg;
+	cfg.shards_ = 0; //0 means pick from the number of threads
 	std::string ip = ""; //default 127.0.0.1
 	bool daemon_mode = false;
+	bool numa_mode = false;
+	std::string snapshot_path;
 
 	// parse command line
 	try {
@@ -273,6 +441,18 @@ int main(int argc, char* argv[])
 				case 'd':
 					daemon_mode = true;
 					break;
+				case 'a':
+					cfg.admission_ = true;
+					break;
+				case 'L':
+					cfg.arena_.huge_pages_ = true;
+					break;
+				case 'k':
+					cfg.arena_.prefault_ = true;
+					break;
+				case 'N':
+					numa_mode = true;
+					break;
 				case 'p': //parse port number
 					if (i + 1 == argc) {
 						throw std::runtime_error("bad command line");
@@ -294,6 +474,64 @@ int main(int argc, char* argv[])
 						throw std::runtime_error("max connections must be positive number");
 					}
 					break;
+				case 's': //parse number of cache shards
+					if (i + 1 == argc) {
+						throw std::runtime_error("bad command line");
+					}
+					cfg.shards_ = parse_number(argv[++i]);
+					if (!cfg.shards_) {
+						throw std::runtime_error("number of shards must be positive number");
+					}
+					break;
+				case 'f': //parse slab growth factor
+					if (i + 1 == argc) {
+						throw std::runtime_error("bad command line");
+					}
+					cfg.slabs_.factor_ = parse_factor(argv[++i]);
+					if (cfg.slabs_.factor_ <= 1.0) {
+						throw std::runtime_error("slab growth factor must be greater than 1");
+					}
+					break;
+				case 'n': //parse smallest slab chunk
+					if (i + 1 == argc) {
+						throw std::runtime_error("bad command line");
+					}
+					cfg.slabs_.min_chunk_ = parse_number(argv[++i]);
+					break;
+				case 'g': //parse the small slab chunks
+					if (i + 1 == argc) {
+						throw std::runtime_error("bad command line");
+					}
+					cfg.slabs_.small_chunk_ = parse_number(argv[++i]);
+					break;
+				case 'e': //parse eviction policy
+					if (i + 1 == argc) {
+						throw std::runtime_error("bad command line");
+					}
+					cfg.eviction_ = parse_eviction(argv[++i]);
+					break;
+				case 'w': //parse reclaimer watermarks
+					if (i + 1 == argc) {
+						throw std::runtime_error("bad command line");
+					}
+					parse_watermarks(argv[++i], cfg);
+					break;
+				case 'z': //parse compression threshold
+					if (i + 1 == argc) {
+						throw std::runtime_error("bad command line");
+					}
+					cfg.compress_min_ = parse_number(argv[++i]);
+					break;
+				case 'I': //parse max value size
+					if (i + 1 == argc) {
+						throw std::runtime_error("bad command line");
+					}
+					cfg.max_value_len_ = parse_number(argv[++i]);
+					if (!cfg.max_value_len_ || cfg.max_value_len_ > 1024) {
+						throw std::runtime_error("max value size must be 1 to 1024 MB");
+					}
+					cfg.max_value_len_ *= 1024*1024;
+					break;
 				case 'm': //parse cache size
 					if (i + 1 == argc) {
 						throw std::runtime_error("bad command line");
@@ -303,6 +541,46 @@ int main(int argc, char* argv[])
 						throw std::runtime_error("Bad cache memory size");
 					}
 					break;
+				case 'r': //parse cache file
+					if (i + 1 == argc) {
+						throw std::runtime_error("bad command line");
+					}
+					cfg.arena_.path_ = argv[++i];
+					break;
+				case 'S': //parse snapshot file
+					if (i + 1 == argc) {
+						throw std::runtime_error("bad command line");
+					}
+					snapshot_path = argv[++i];
+					break;
+				case 'H': //parse hot key read cache
+					if (i + 1 == argc) {
+						throw std::runtime_error("bad command line");
+					}
+					parse_l1(argv[++i], cfg);
+					break;
+				case 'D': //parse namespace delimiter
+					if (i + 1 == argc) {
+						throw std::runtime_error("bad command line");
+					}
+					++i;
+					if (strlen(argv[i]) != 1) {
+						throw std::runtime_error("the namespace delimiter must be one character");
+					}
+					cfg.ns_delimiter_ = argv[i][0];
+					break;
+				case 'i': //parse index size at the start
+					if (i + 1 == argc) {
+						throw std::runtime_error("bad command line");
+					}
+					cfg.index_items_ = parse_number(argv[++i]);
+					break;
+				case 'F': //parse flash file and size
+					if (i + 1 == argc) {
+						throw std::runtime_error("bad command line");
+					}
+					parse_flash(argv[++i], cfg);
+					break;
 				case 'l': //parse listen IP
 					if (i + 1 == argc) {
 						throw std::runtime_error("bad command line");
@@ -330,11 +608,42 @@ int main(int argc, char* argv[])
         }
     }
 
-	std::clog << "ver: " << mc::VER << " listen: " << ip << ":" << port << " threads:" << threads << " cachmem:" << cachemem << "MB" << " connections:" << max_connections << std::endl;
+	if (!snapshot_path.empty()) { //before any thread starts, they all inherit the mask
+		sigset_t set;
+		sigemptyset(&set);
+		sigaddset(&set, SIGUSR1);
+		pthread_sigmask(SIG_BLOCK, &set, nullptr);
+	}
+
+	if (!cfg.shards_) { //a few shards per thread keeps the lock collisions low, as many as the memory is enough for
+		cfg.shards_ = std::min<size_t>(threads > 1 ? threads*4 : 1, mc::cache::max_shards(cfg, size_t(cachemem)*1024*1024));
+	}
+	if (numa_mode) { //the nodes that get a server thread at least, the shards too if there are enough of them
+		unsigned int servers = threads > 1 ? threads - 1 : 1;
+		cfg.numa_nodes_ = std::min<size_t>({mc::numa::host().nodes(), servers, cfg.shards_});
+		std::clog << "numa: " << mc::numa::host().nodes() << " nodes, " << cfg.numa_nodes_ << " used" << std::endl;
+	}
+
+	std::clog << "ver: " << mc::VER << " listen: " << ip << ":" << port << " threads:" << threads << " cachmem:" << cachemem << "MB" << " connections:" << max_connections << " shards:" << cfg.shards_ << std::endl;
 	
 	try {
-		//allocate cache
-		g_cache.reset(new mc::cache(cachemem*1024*1024, threads > 1));
+		//allocate cache, the reclaimer thread and the snapshots need the locks even if there is one server thread
+		g_cache.reset(new mc::cache(size_t(cachemem)*1024*1024, threads > 1 || cfg.high_watermark_ || !snapshot_path.empty(), cfg));
+
+		if (!snapshot_path.empty()) {
+			//the cores are idle before the start, the snapshot loads with all of them
+			if (!g_cache->get_stats().restored_items_ && ::access(snapshot_path.c_str(), F_OK) == 0) {
+				try {
+					mc::snapshot::stats st = mc::snapshot::load(*g_cache, snapshot_path, std::max(1u, std::thread::hardware_concurrency()));
+					std::clog << "snapshot loaded from " << snapshot_path << ": " << st.items_ << " items (" << st.skipped_ << " skipped), "
+						<< st.bytes_/(1024*1024) << "MB in " << st.us_/1000 << "ms" << std::endl;
+				}
+				catch (const std::exception& e) { //the cache starts empty
+					std::clog << "snapshot not loaded: " << e.what() << std::endl;
+				}
+			}
+			std::thread(snapshot_loop, snapshot_path).detach();
+		}
 
 		// bind a TCP socket
 		tcp::socket s(ip, port);
@@ -342,7 +651,7 @@ int main(int argc, char* argv[])
 		std::clog << "socket created..." << std::endl;
 
 		// run it
-		server_loop(s, mc::MAX_EPOLL_EVENTS, threads, max_connections);
+		server_loop(s, mc::MAX_EPOLL_EVENTS, threads, max_connections, cfg.numa_nodes_);
 	}
 	catch (const std::exception& e) {
 		std::clog << e.what() << std::endl;
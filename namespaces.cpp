@@ -0,0 +1,96 @@
+// namespace generations of the keys
+//
+#include "namespaces.h"
+#include "wyhash.h"
+#include <string.h>
+
+using namespace mc;
+
+// the entries in the given memory are taken as they are, the namespaces of the last process
+namespace_table::namespace_table(unsigned char delimiter, size_t max, void* mem)
+	:delimiter_(delimiter)
+	,max_(max)
+	,t_(static_cast<entry*>(mem))
+	,mask_(slots(max) - 1)
+	,count_(0)
+	,invalidations_(0)
+{
+	if (!t_) {
+		own_.reset(new entry[mask_ + 1]);
+		t_ = own_.get();
+		for (size_t i = 0; i <= mask_; ++i) {
+			t_[i].hv_.store(0, std::memory_order_relaxed);
+			t_[i].generation_.store(0, std::memory_order_relaxed);
+		}
+		return;
+	}
+	size_t n = 0;
+	for (size_t i = 0; i <= mask_; ++i) {
+		n += t_[i].hv_.load(std::memory_order_relaxed) != 0;
+	}
+	count_.store(n, std::memory_order_relaxed);
+}
+
+// the table is 3/4 full at most, so a probe for a namespace that isn't there stops early
+size_t namespace_table::slots(size_t max)
+{
+	size_t size = 16;
+	while (size*3 < max*4) {
+		size <<= 1;
+	}
+	return size;
+}
+
+size_t namespace_table::memory(size_t max)
+{
+	return slots(max)*sizeof(entry);
+}
+
+size_t namespace_table::prefix(const unsigned char* d, size_t len) const
+{
+	const void* p = ::memchr(d, delimiter_, len);
+	return p ? static_cast<const unsigned char*>(p) - d : 0;
+}
+
+uint64_t namespace_table::hash(const unsigned char* ns, size_t len)
+{
+	uint64_t hv = wyhash(ns, len, 0);
+	return hv ? hv : 1;
+}
+
+uint32_t namespace_table::generation(const unsigned char* ns, size_t len) const
+{
+	uint64_t hv = hash(ns, len);
+	for (size_t pos = hv & mask_; ; pos = (pos + 1) & mask_) {
+		uint64_t h = t_[pos].hv_.load(std::memory_order_acquire);
+		if (h == hv)
+			return t_[pos].generation_.load(std::memory_order_acquire);
+		if (!h)
+			return 0;
+	}
+}
+
+// a new entry has its generation before the readers see its hash
+bool namespace_table::invalidate(const unsigned char* ns, size_t len)
+{
+	uint64_t hv = hash(ns, len);
+	std::lock_guard<std::mutex> lock(m_);
+	size_t pos = hv & mask_;
+	for (; ; pos = (pos + 1) & mask_) {
+		uint64_t h = t_[pos].hv_.load(std::memory_order_relaxed);
+		if (h == hv) {
+			t_[pos].generation_.fetch_add(1, std::memory_order_acq_rel);
+			++invalidations_;
+			return true;
+		}
+		if (!h)
+			break;
+	}
+	if (count_.load(std::memory_order_relaxed) == max_)
+		return false;
+	t_[pos].generation_.store(1, std::memory_order_relaxed);
+	t_[pos].hv_.store(hv, std::memory_order_release);
+	++count_;
+	++invalidations_;
+	return true;
+}
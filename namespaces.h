@@ -0,0 +1,90 @@
+// namespace generations of the keys
+//
+#ifndef MC_NAMESPACES_H
+#define MC_NAMESPACES_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+namespace mc
+{
+	// The namespace of a key is the part before the first delimiter, a key that doesn't have it
+	// (or starts with it) is in none. Every namespace has a generation, an item keeps the one of its
+	// namespace from the time it's made and it's stale once the generation moves on, so an invalidate
+	// drops all the keys of the namespace at once. The stale items are misses, they go when a lookup
+	// finds them or the eviction gets to them.
+	//
+	// Only the namespaces that were invalidated have an entry, the rest are at generation 0.
+	// A namespace is known by its hash (64 bits, the same hash is the same namespace), open
+	// addressing with linear probing. The table doesn't grow and the entries stay, the lookups
+	// take no lock, the invalidations are serialized by the lock. The table may be in the cache
+	// file (see arena::extra), the generations of the items there stay right after a restart
+	struct namespace_table
+	{
+		//max is the number of namespaces that may be invalidated, the table is in mem if it's given
+		//(memory(max) bytes, zeros or a table of the same max), it's allocated otherwise
+		namespace_table(unsigned char delimiter, size_t max, void* mem = nullptr);
+		static size_t memory(size_t max);
+
+		//the length of the namespace of the key, 0 if it's in none
+		size_t prefix(const unsigned char* d, size_t len) const;
+		//of a namespace, the key without the delimiter
+		uint32_t generation(const unsigned char* ns, size_t len) const;
+		//of the namespace of the key, 0 if it's in none
+		uint32_t key_generation(const unsigned char* d, size_t len) const
+		{
+			size_t n = prefix(d, len);
+			return n ? generation(d, n) : 0;
+		}
+		//moves the generation of the namespace on, returns false if the table is full
+		bool invalidate(const unsigned char* ns, size_t len);
+
+		unsigned char delimiter() const
+		{
+			return delimiter_;
+		}
+		size_t size() const //namespaces invalidated
+		{
+			return count_.load(std::memory_order_relaxed);
+		}
+		size_t max() const //the invalidations of new namespaces fail once size() is there
+		{
+			return max_;
+		}
+		uint64_t invalidations() const
+		{
+			return invalidations_.load(std::memory_order_relaxed);
+		}
+		size_t memory() const
+		{
+			return memory(max_);
+		}
+
+	private:
+		struct entry
+		{
+			std::atomic<uint64_t> hv_; //0 if it's free
+			std::atomic<uint32_t> generation_;
+		};
+
+		const unsigned char delimiter_;
+		const size_t max_;
+		std::unique_ptr<entry[]> own_; //unless the table is in the given memory
+		entry* t_;
+		size_t mask_;
+		std::mutex m_;
+		std::atomic<size_t> count_;
+		std::atomic<uint64_t> invalidations_;
+
+		static uint64_t hash(const unsigned char* ns, size_t len);
+		static size_t slots(size_t max);
+
+		namespace_table(const namespace_table&) = delete;
+		namespace_table& operator=(const namespace_table&) = delete;
+	};
+}
+
+#endif
@@ -0,0 +1,149 @@
+// NUMA topology and placement
+//
+#include "numa.h"
+#include <unistd.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace mc;
+
+namespace
+{
+	const char NODE_DIR[] = "/sys/devices/system/node";
+
+	//numaif.h comes with libnuma, the syscall only needs these
+	const int MPOL_PREFERRED_ = 1;
+	const unsigned int MPOL_MF_MOVE_ = 1 << 1;
+
+	thread_local int current = -1;
+
+	//"0-3,8-11" as sysfs writes the cpu lists
+	std::vector<unsigned int> parse_cpu_list(const std::string& s)
+	{
+		std::vector<unsigned int> cpus;
+		std::stringstream ss(s);
+		std::string range;
+		while (std::getline(ss, range, ',')) {
+			if (range.empty() || range == "\n")
+				continue;
+			char* end = nullptr;
+			unsigned long first = ::strtoul(range.c_str(), &end, 10);
+			unsigned long last = *end == '-' ? ::strtoul(end + 1, nullptr, 10) : first;
+			for (unsigned long c = first; c <= last; ++c) {
+				cpus.push_back(c);
+			}
+		}
+		return cpus;
+	}
+
+	//the node ids in sysfs, they may have holes
+	std::vector<unsigned int> node_ids()
+	{
+		std::vector<unsigned int> ids;
+		DIR* d = ::opendir(NODE_DIR);
+		if (!d)
+			return ids;
+		while (dirent* e = ::readdir(d)) {
+			const char* name = e->d_name;
+			if (::strncmp(name, "node", 4) || !isdigit(name[4]))
+				continue;
+			ids.push_back(::strtoul(name + 4, nullptr, 10));
+		}
+		::closedir(d);
+		std::sort(ids.begin(), ids.end());
+		return ids;
+	}
+}
+
+numa::numa()
+{
+	for (unsigned int id: node_ids()) {
+		std::ifstream f(std::string(NODE_DIR) + "/node" + std::to_string(id) + "/cpulist");
+		std::string s;
+		if (!std::getline(f, s))
+			continue;
+		cpu_list cpus = parse_cpu_list(s);
+		if (cpus.empty()) //memory only, the threads can't run there
+			continue;
+		ids_.push_back(id);
+		cpus_.push_back(cpus);
+	}
+	if (cpus_.empty()) {
+		cpu_list cpus;
+		for (unsigned int c = 0; c != std::max(1u, std::thread::hardware_concurrency()); ++c) {
+			cpus.push_back(c);
+		}
+		ids_.push_back(0);
+		cpus_.push_back(cpus);
+	}
+	for (size_t n = 0; n != cpus_.size(); ++n) {
+		for (unsigned int c: cpus_[n]) {
+			if (c >= cpu_nodes_.size()) {
+				cpu_nodes_.resize(c + 1, -1);
+			}
+			cpu_nodes_[c] = n;
+		}
+	}
+}
+
+const numa& numa::host()
+{
+	static const numa n;
+	return n;
+}
+
+void numa::bind_thread(unsigned int node) const
+{
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (unsigned int c: cpus_[node]) {
+		if (c < CPU_SETSIZE)
+			CPU_SET(c, &set);
+	}
+	int err = ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set);
+	if (err) {
+		std::stringstream se;
+		se << "can't bind the thread to the NUMA node " << ids_[node] << ": " << err;
+		throw std::runtime_error(se.str());
+	}
+#endif
+	current = node;
+}
+
+int numa::current_node()
+{
+	return current;
+}
+
+bool numa::bind_memory(const void* p, size_t len, unsigned int node) const
+{
+#ifdef __linux__
+	static const uintptr_t page = ::sysconf(_SC_PAGESIZE);
+	uintptr_t start = (reinterpret_cast<uintptr_t>(p) + page - 1) & ~(page - 1);
+	uintptr_t end = (reinterpret_cast<uintptr_t>(p) + len) & ~(page - 1);
+	if (end <= start)
+		return true; //not a whole page, it stays where it is
+
+	unsigned int id = ids_[node];
+	std::vector<unsigned long> mask(id/(8*sizeof(unsigned long)) + 1);
+	mask[id/(8*sizeof(unsigned long))] = 1ul << (id % (8*sizeof(unsigned long)));
+	return ::syscall(SYS_mbind, start, end - start, MPOL_PREFERRED_, mask.data(), mask.size()*8*sizeof(unsigned long) + 1, MPOL_MF_MOVE_) == 0;
+#else
+	return false;
+#endif
+}
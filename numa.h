@@ -0,0 +1,57 @@
+// NUMA topology and placement
+//
+#ifndef MC_NUMA_H
+#define MC_NUMA_H
+
+#include <stddef.h>
+#include <vector>
+
+namespace mc
+{
+	// The NUMA nodes of the host and their cpus as sysfs shows them, numbered from 0 (the nodes
+	// without cpus are left out, so the kernel ids may differ). The threads are pinned to the cpus
+	// of a node and the memory is bound to a node with the raw syscalls, there is no libnuma.
+	// A host without NUMA (or without sysfs) is one node of all the cpus.
+	struct numa
+	{
+		//the host topology, read once
+		static const numa& host();
+
+		size_t nodes() const
+		{
+			return cpus_.size();
+		}
+		const std::vector<unsigned int>& cpus(unsigned int node) const
+		{
+			return cpus_[node];
+		}
+		//-1 if the cpu isn't known
+		int node_of_cpu(unsigned int cpu) const
+		{
+			return cpu < cpu_nodes_.size() ? cpu_nodes_[cpu] : -1;
+		}
+
+		//pins the calling thread to the cpus of the node, it's the node of the thread from then on.
+		//Throws if the kernel doesn't take it
+		void bind_thread(unsigned int node) const;
+		//the node of the calling thread (see bind_thread), -1 if it isn't bound
+		static int current_node();
+
+		//the whole pages in the range prefer the node from now on, the ones that are in memory already
+		//move there. Returns false if the kernel doesn't do it (no NUMA support, huge pages cut in the middle)
+		bool bind_memory(const void* p, size_t len, unsigned int node) const;
+
+	private:
+		typedef std::vector<unsigned int> cpu_list;
+		std::vector<unsigned int> ids_; //the kernel ids of the nodes
+		std::vector<cpu_list> cpus_; //per node, only the nodes with cpus
+		std::vector<int> cpu_nodes_; //per cpu
+
+		numa();
+
+		numa(const numa&) = delete;
+		numa& operator=(const numa&) = delete;
+	};
+}
+
+#endif
@@ -36,7 +36,7 @@ namespace mc
 		}
 	
 	private:
-		int fd_[0];
+		int fd_[2];
 
 		void set_fcntl(int fd, int flags)
 		{
@@ -131,9 +131,14 @@ extern "C"
         PROTOCOL_BINARY_CMD_RINCR     = 0x39,
         PROTOCOL_BINARY_CMD_RINCRQ    = 0x3a,
         PROTOCOL_BINARY_CMD_RDECR     = 0x3b,
-        PROTOCOL_BINARY_CMD_RDECRQ    = 0x3c
+        PROTOCOL_BINARY_CMD_RDECRQ    = 0x3c,
         /* End Range operations */
 
+        /* memcacher: drops all the keys of the namespace in the key
+         * (without the delimiter), see the -D option.
+         */
+        PROTOCOL_BINARY_CMD_INVALIDATE = 0x50
+
     } protocol_binary_command;
 
     /**
@@ -1,15 +1,17 @@
 // server thread and session management 
 //
 #include "server.h"
+#include "numa.h"
 #include <functional>
 #include <iostream>
 
 
 using namespace mc;
 
-server::server(size_t mc, bool thread)
+server::server(size_t mc, bool thread, int node)
 	:max_connections_(mc)
 	,thread_(thread)
+	,node_(node)
 {
 }
 
@@ -24,6 +26,20 @@ void server::start()
 {
 	if (thread_)
 		t_.reset( new std::thread(std::bind(&server::process, this)) );
+	else
+		bind_node(); //the caller's thread does the job
+}
+
+void server::bind_node()
+{
+	if (node_ < 0)
+		return;
+	try {
+		numa::host().bind_thread(node_);
+	}
+	catch (const std::exception& e) { //it works anyway, only slower
+		std::clog << e.what() << std::endl;
+	}
 }
 
 void server::register_session(session *s)
@@ -31,7 +47,7 @@ void server::register_session(session *s)
 	assert(sessions_.find(s) == sessions_.end());
 	if (sessions_.size() >= max_connections_)
 	{
-		delete s;
+		s->release();
 		return;
 	}
 	//mark session activity time, just in case we want to enforce an idle timeout later
@@ -126,7 +142,7 @@ std::pair<bool, server::sessions::iterator> server::is_active_session(session* s
 }
 void server::close_session(sessions::iterator sit)
 {
-	delete sit->first; //will close the socket
+	sit->first->release(); //the main loop closes the socket
 	sessions_.erase(sit);
 }
 
@@ -140,6 +156,7 @@ void server::cleanup()
 
 void server::process() //main process thread
 {
+	bind_node();
 	while(true) {
 		auto v = q_.wait_next();
 		assert(v.s_);
@@ -4,9 +4,11 @@
 #include <memory>
 #include <thread>
 #include <map>
+#include <unordered_map>
 #include "config.h"
 #include "session.h"
 #include "safe_queue.h"
+#include "l1.h"
 #include <ctime>
 
 namespace mc
@@ -62,8 +64,10 @@ namespace mc
 		size_t max_connections_;
 		queue q_;
 		bool thread_;
+		int node_; //NUMA node the server thread runs on, -1 if it runs anywhere
+		std::unique_ptr<l1_cache> l1_; //the read cache of the thread for the hot keys, if it's on
 
-		explicit server(size_t mc, bool enable_thread = true);
+		explicit server(size_t mc, bool enable_thread = true, int node = -1);
 		~server();
 
 		void start();
@@ -98,6 +102,7 @@ namespace mc
 
 		void close_session(sessions::iterator sit);
 		void cleanup();
+		void bind_node(); //the calling thread to node_
 
 		void process(); //main process, executed in a thread
 	};
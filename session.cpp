@@ -1,6 +1,7 @@
 // session and request processing
 //
 #include "session.h"
+#include "l1.h"
 #include <assert.h>
 #include <unistd.h>
 #include <iostream>
@@ -8,6 +9,7 @@
 #include <arpa/inet.h>
 #include <string.h>
 #include <algorithm>
+#include <string>
 
 #if !defined(__APPLE__)
 	#include <endian.h>
@@ -33,7 +35,7 @@ namespace
 	}
 #endif
 
-	session::buffer make_response_header(const protocol_binary_request_header& h
+	protocol_binary_response_header response_header(const protocol_binary_request_header& h
 			,unsigned int err, unsigned char extlen, unsigned short keylen, unsigned int body_len)
 	{
 		protocol_binary_response_header r;
@@ -50,7 +52,58 @@ namespace
 		r.response.bodylen = htonl((uint32_t)body_len);
 		r.response.opaque = h.request.opaque;
 		r.response.cas = htonll(h.request.cas);
-		return session::buffer((unsigned char*)&r, (unsigned char*)&r + sizeof(r));
+		return r;
+	}
+
+	session::buffer make_response_header(const protocol_binary_request_header& h
+			,unsigned int err, unsigned char extlen, unsigned short keylen, unsigned int body_len)
+	{
+		protocol_binary_response_header r = response_header(h, err, extlen, keylen, body_len);
+		return session::buffer(r.bytes, r.bytes + sizeof(r));
+	}
+
+	// the request header as it's received, in the host byte order
+	protocol_binary_request_header read_header(const unsigned char* p)
+	{
+		protocol_binary_request_header h;
+		memcpy(&h, p, sizeof(h));
+		h.request.keylen = ntohs(h.request.keylen);
+		h.request.bodylen = ntohl(h.request.bodylen);
+		h.request.cas = ntohll(h.request.cas);
+		return h;
+	}
+
+	bool is_get(uint8_t opcode)
+	{
+		return opcode == PROTOCOL_BINARY_CMD_GET || opcode == PROTOCOL_BINARY_CMD_GETQ
+			|| opcode == PROTOCOL_BINARY_CMD_GETK || opcode == PROTOCOL_BINARY_CMD_GETKQ;
+	}
+
+	//the misses get no response
+	bool is_quiet(uint8_t opcode)
+	{
+		return opcode == PROTOCOL_BINARY_CMD_GETQ || opcode == PROTOCOL_BINARY_CMD_GETKQ || opcode == PROTOCOL_BINARY_CMD_GATQ;
+	}
+
+	//the response has the key
+	bool with_key(uint8_t opcode)
+	{
+		return opcode == PROTOCOL_BINARY_CMD_GETK || opcode == PROTOCOL_BINARY_CMD_GETKQ;
+	}
+
+	bool valid_get(const protocol_binary_request_header& h)
+	{
+		return h.request.extlen == 0 && h.request.keylen != 0 && h.request.bodylen == h.request.keylen;
+	}
+
+	// one STAT response packet, the name goes in the key
+	void append_stat(session::buffer& b, const protocol_binary_request_header& h
+			,const std::string& name, const std::string& value)
+	{
+		session::buffer hdr = make_response_header(h, 0, 0, name.size(), name.size() + value.size());
+		b.insert(b.end(), hdr.begin(), hdr.end());
+		b.insert(b.end(), name.begin(), name.end());
+		b.insert(b.end(), value.begin(), value.end());
 	}
 
 	// for logs
@@ -67,11 +120,16 @@ namespace
 	*/
 }
 
-session::session(int fd, int ctl_pipe, void* user, cache& c)
+session::session(int fd, int ctl_pipe, void* user, cache& c, l1_cache* l1)
 	:fd_(fd)
 	,ctl_pipe_(ctl_pipe)
 	,user_(user)
 	,c_(c)
+	,l1_(l1)
+	,start_(0)
+	,parsed_(false)
+	,wait_writable_(false)
+	,swallow_(0)
 {
 	assert(fd_ != -1);
 }
@@ -80,13 +138,24 @@ session::~session()
 	::close(fd_);
 }
 
-bool session::control(buffer b) //control event on the session
+// the main loop may be reading the socket still, so it's the one that closes it,
+// the descriptor isn't reused while the loop has it
+void session::release()
 {
-	if (!wctl_.is_active()) {
-		assert(false);
-		return false; //must only be write controls for now
+	mc::sysevent ev(mc::sysevent::close, this);
+	buffer b = serialize_sysevent(ev);
+	ssize_t cnt = ::write(ctl_pipe_, &b[0], b.size());
+	if (cnt == -1) { //there is no main loop anymore
+		delete this;
 	}
-	return continue_write();
+}
+
+bool session::control(buffer b) //control event on the session
+{
+	//write controls, the one of a writable socket may come when the response is already written
+	if (wctl_.is_active() && !continue_write())
+		return false;
+	return wctl_.is_active() || process_requests(); //the requests that came meanwhile
 }
 
 //returns false if the session is to be closed
@@ -97,54 +166,149 @@ bool session::process_chunk(buffer b)
 	if (b.empty())
 		return true;
 
-	if (wctl_.is_active()) { //received data while a write is in progress, not good
-		assert(false);
-		return false; //will close the session
+	const unsigned char* d = b.data();
+	size_t len = b.size();
+	if (upload_ || swallow_) { //the rest of a large SET value, the next requests may follow it
+		size_t n = std::min(len, upload_ ? upload_.left() : swallow_);
+		if (!continue_upload(d, n))
+			return false;
+		d += n;
+		len -= n;
+		if (!len)
+			return true;
 	}
-	size_t old_size = request_.size();
 
-	if (request_.empty()) { //new request?
-		//check the magic number
-		if (b[0] != PROTOCOL_BINARY_REQ) {
-			return false; //close session
+	request_.insert(request_.end(), d, d + len);
+	if (wctl_.is_active()) //the requests wait for the response that is being written
+		return true;
+	return process_requests();
+}
+
+// The requests that are there in the buffer one after another (the clients pipeline them),
+// a run of GETs is looked up at once. A response that is written over several events
+// stops it, the rest waits for it (see control)
+bool session::process_requests()
+{
+	bool ret = true;
+	while (ret && !wctl_.is_active() && !upload_ && !swallow_) {
+		if (batch_.pending()) { //the responses after a big value of the last batch
+			ret = write_batch();
+			continue;
+		}
+		size_t left = request_.size() - start_;
+		if (left < sizeof(header_)) //wait for complete header
+			break;
+
+		if (!parsed_) {
+			if (*packet() != PROTOCOL_BINARY_REQ) {
+				return false; //close session
+			}
+			header_ = read_header(packet());
+			parsed_ = true;
+			if (!validate_request())
+				return false;
 		}
+
+		if (is_upload()) {
+			if (left < sizeof(header_) + header_.request.extlen + header_.request.keylen) //wait for the key
+				break;
+			ret = begin_upload();
+			continue;
+		}
+		if (left < packet_len()) //wait completion
+			break;
+		ret = is_get(header_.request.opcode) ? handle_get_batch() : handle_request();
 	}
-	
-	request_.insert(request_.end(), b.begin(), b.end()); 
 
-	//wait for complete header
-	if (request_.size() < sizeof(protocol_binary_request_header))
-		return true;
+	//the buffer is reused unless it got too big
+	if (start_ == request_.size()) {
+		if (request_.capacity() > MAX_REQUEST_BUFFER) {
+			buffer().swap(request_);
+		}
+		else {
+			request_.clear();
+		}
+		start_ = 0;
+	}
+	else if (start_) {
+		request_.erase(request_.begin(), request_.begin() + start_);
+		start_ = 0;
+	}
+	return ret;
+}
 
-	if (old_size < sizeof(header_)) { //got full header
-		protocol_binary_request_header* h = (protocol_binary_request_header*)(&request_[0]);
+void session::next_request()
+{
+	start_ += packet_len();
+	parsed_ = false;
+}
 
-		memcpy(&header_, h, sizeof(header_));
+//a SET of a value that is stored in chunks
+bool session::is_upload() const
+{
+	return header_.request.opcode == PROTOCOL_BINARY_CMD_SET
+		&& c_.chunked(header_.request.keylen, header_.request.bodylen - header_.request.extlen - header_.request.keylen);
+}
 
-		header_.request.keylen = ntohs(h->request.keylen);
-		header_.request.bodylen = ntohl(h->request.bodylen);
-		header_.request.cas = ntohll(h->request.cas);
+//makes the item once the key is there, the rest of the packet goes to it
+bool session::begin_upload()
+{
+	size_t prefix = sizeof(header_) + header_.request.extlen + header_.request.keylen;
+	size_t value_len = header_.request.bodylen - header_.request.extlen - header_.request.keylen;
+	try {
+		upload_ = c_.begin_set(cache::request(packet(), prefix, header_), value_len);
+	}
+	catch(const std::bad_alloc&) { //the value doesn't fit in the cache memory, it's dropped as it comes
+		swallow_ = value_len;
+	}
+	catch(const std::exception& e) { //some system error
+		std::cerr << e.what() << std::endl;
+		return false; //log and disconnect
+	}
 
-		if (!validate_request())
-			return false;
+	//the value that is here, the next requests may follow it
+	const unsigned char* d = packet() + prefix;
+	size_t len = std::min(request_.size() - start_ - prefix, value_len);
+	start_ += prefix + len;
+	parsed_ = false;
+	return continue_upload(d, len);
+}
+
+bool session::continue_upload(const unsigned char* d, size_t len)
+{
+	size_t left = upload_ ? upload_.left() : swallow_;
+	assert(len <= left);
+	if (upload_) {
+		upload_.write(d, len);
+	}
+	else {
+		swallow_ -= len;
 	}
+	if (len < left) //wait completion
+		return true;
 
-	return handle_request();
+	if (!upload_) {
+		error_response(PROTOCOL_BINARY_RESPONSE_ENOMEM);
+		return true;
+	}
+	bool ret = handle_request_set();
+	reset();
+	return ret;
 }
 
 bool session::handle_request_delete()
 {
-	cache::item item(std::move(request_), header_);
+	cache::request req(packet(), packet_len(), header_);
 
 	try {
-		if (!c_.remove(item, header_.request.cas)) {
+		if (!c_.remove(req, header_.request.cas)) {
 			error_response(PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS);
 			return true;
 		}
 
-		//generate response
-		buffer resp = make_response_header(header_, 0, 0, 0, 0);
-		if (!socket_write(resp.data(), resp.size())) {
+		//generate response, the header alone is made on the stack
+		protocol_binary_response_header resp = response_header(header_, 0, 0, 0, 0);
+		if (!socket_write(resp.bytes, sizeof(resp))) {
 			return false;
 		}
 	}
@@ -155,27 +319,54 @@ bool session::handle_request_delete()
 	return true;
 }
 
-bool session::handle_request_set()
+// the key is the namespace, it can't have the delimiter
+bool session::handle_request_invalidate()
 {
-	cache::item item(std::move(request_), header_);
+	cache::key ns(packet() + sizeof(header_), header_.request.keylen);
+	unsigned char delimiter = c_.get_config().ns_delimiter_;
+	if (!delimiter) {
+		error_response(PROTOCOL_BINARY_RESPONSE_UNKNOWN_COMMAND);
+		return true;
+	}
+	if (memchr(ns.d_, delimiter, ns.len_)) {
+		error_response(PROTOCOL_BINARY_RESPONSE_EINVAL);
+		return true;
+	}
+	if (!c_.invalidate(ns)) { //too many namespaces
+		error_response(PROTOCOL_BINARY_RESPONSE_ENOMEM);
+		return true;
+	}
+	protocol_binary_response_header resp = response_header(header_, 0, 0, 0, 0);
+	return socket_write(resp.bytes, sizeof(resp));
+}
 
+bool session::handle_request_set()
+{
 	try {
-		if (header_.request.cas) {
-			if (!c_.cas(std::move(item), header_.request.cas)) {
-				error_response(PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS);
-				return true;
-			}
+		bool stored = true;
+		if (upload_) { //the value is in the item already
+			stored = c_.store(upload_, header_.request.cas);
+		}
+		else if (header_.request.cas) {
+			stored = c_.cas(cache::request(packet(), packet_len(), header_), header_.request.cas);
 		}
 		else {
-			c_.set(std::move(item));
+			c_.set(cache::request(packet(), packet_len(), header_));
+		}
+		if (!stored) {
+			error_response(PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS);
+			return true;
 		}
 
-		//generate response
-		buffer resp = make_response_header(header_, 0, 0, 0, 0);
-		if (!socket_write(resp.data(), resp.size())) {
+		//generate response, the header alone is made on the stack
+		protocol_binary_response_header resp = response_header(header_, 0, 0, 0, 0);
+		if (!socket_write(resp.bytes, sizeof(resp))) {
 			return false;
 		}
 	}
+	catch(const std::bad_alloc&) { //the item doesn't fit in the cache memory
+		error_response(PROTOCOL_BINARY_RESPONSE_ENOMEM);
+	}
 	catch(const std::exception& e) { //some system error
 		std::cerr << e.what() << std::endl;
 		return false; //log and disconnect
@@ -185,72 +376,339 @@ bool session::handle_request_set()
 
 bool session::handle_request_get()
 {
-	typedef uint32_t flag_t;
-
-	std::shared_ptr<cache::item> itm;
+	cache::item_view itm; //keeps the item while it's copied out
 
 	{ //find item
-		cache::item req(std::move(request_), header_);
-		itm = c_.get(req.get_key());
+		cache::request req(packet(), packet_len(), header_);
+		itm = l1_ ? l1_->get(req.get_key(), req.hv_) : c_.get(req.get_key(), req.hv_);
 		if (!itm) {
-			error_response(PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
-			return true;
+			if (is_quiet(header_.request.opcode))
+				return true;
+			buffer resp;
+			append_miss(resp, header_, req.get_key());
+			return socket_write(resp.data(), resp.size());
+		}
+	}
+
+	return write_item(itm);
+}
+
+// A run of GETs that are there whole (a multi-get is a run of GETKQs and a NOOP) is looked up
+// at once, the keys of a shard under one lock. The responses are written in the order
+// of the requests with one write, up to a big value, the ones after it wait for it (see write_batch)
+bool session::handle_get_batch()
+{
+	batch_.clear();
+	size_t pos = start_;
+	protocol_binary_request_header h = header_;
+	for (;;) {
+		size_t end = pos + sizeof(h) + h.request.bodylen;
+		cache::request req(request_.data() + pos, end - pos, h);
+		batch_.keys_.emplace_back(req.get_key(), req.hv_);
+		batch_.headers_.push_back(h);
+		batch_.ends_.push_back(end);
+		if (batch_.keys_.size() == MAX_GET_BATCH)
+			break;
+
+		//the next one if it's a whole GET
+		pos = end;
+		if (request_.size() - pos < sizeof(h) || request_[pos] != PROTOCOL_BINARY_REQ)
+			break;
+		h = read_header(request_.data() + pos);
+		if (!is_get(h.request.opcode) || !valid_get(h) || request_.size() - pos < sizeof(h) + h.request.bodylen)
+			break;
+	}
+	size_t n = batch_.keys_.size();
+	if (n == 1)
+		return handle_request();
+
+	for (auto& l: batch_.keys_) {
+		batch_.lookups_.push_back(&l);
+	}
+	batch_.responses_.resize(n);
+	batch_.items_.resize(n);
+	batch_.rests_.resize(n);
+	auto found = [this](cache::lookup& l) {
+		size_t i = &l - batch_.keys_.data();
+		const protocol_binary_request_header& rh = batch_.headers_[i];
+		size_t from = batch_.out_.size();
+		if (l.it_) {
+			if (append_item(batch_.out_, rh, *l.it_, batch_.rests_[i])) //a big value, the item is kept for the rest
+				batch_.items_[i] = l.it_.hold();
+		}
+		else if (!is_quiet(rh.request.opcode)) {
+			append_miss(batch_.out_, rh, l.k_);
+		}
+		batch_.responses_[i] = std::make_pair(from, batch_.out_.size() - from);
+	};
+	try {
+		if (l1_) {
+			l1_->get(batch_.lookups_, found);
+		}
+		else {
+			c_.get(batch_.lookups_, found);
 		}
 	}
+	catch(const std::exception& e) { //some system error
+		std::cerr << e.what() << std::endl;
+		return false; //log and disconnect
+	}
 
-	wctl_.item_ = itm;
-	size_t value_len = itm->get_value_len();
+	start_ = batch_.ends_[n - 1]; //all of them are answered
+	parsed_ = false;
+	batch_.next_ = 0;
+	return write_batch();
+}
 
-	{ //place header and flags
-		flag_t f = 0;
+// the responses of the batch from next_ on, a big value is written over several events,
+// the responses after it are written once it's done (see process_requests)
+bool session::write_batch()
+{
+	//the responses are joined, they are written as the socket takes them
+	buffer& w = wctl_.hdr_;
+	while (batch_.next_ != batch_.responses_.size()) {
+		size_t i = batch_.next_++;
+		const auto& r = batch_.responses_[i];
+		w.insert(w.end(), batch_.out_.data() + r.first, batch_.out_.data() + r.first + r.second);
+		if (batch_.items_[i]) {
+			wctl_.item_ = std::move(batch_.items_[i]);
+			wctl_.value_ = batch_.rests_[i];
+			break;
+		}
+	}
+	return w.empty() || continue_write();
+}
 
-		buffer hdr = make_response_header(header_, 0, sizeof(f), 0, value_len + sizeof(f));
-		hdr.insert(hdr.end(), (unsigned char*)&f, (unsigned char*)&f+sizeof(f));
-		size_t first_packet_size = std::min(MAX_WRITE_SIZE, value_len);
+void session::get_batch::clear()
+{
+	keys_.clear();
+	lookups_.clear();
+	headers_.clear();
+	ends_.clear();
+	responses_.clear();
+	items_.clear();
+	rests_.clear();
+	next_ = 0;
+	//the buffer is kept unless it got too big
+	if (out_.capacity() > MAX_REQUEST_BUFFER) {
+		buffer().swap(out_);
+	}
+	out_.clear();
+	keys_.reserve(MAX_GET_BATCH); //lookups_ points to them
+}
 
-		const unsigned char *buf = itm->get_data() + itm->h_.request.keylen;
-		hdr.insert(hdr.end(), buf, buf + first_packet_size);
+bool session::handle_request_noop()
+{
+	protocol_binary_response_header resp = response_header(header_, 0, 0, 0, 0);
+	return socket_write(resp.bytes, sizeof(resp));
+}
+
+bool session::handle_request_touch()
+{
+	cache::item_view itm;
 
-		wctl_.hdr_.swap(hdr);
-		wctl_.offset_ = first_packet_size;
+	{ //find item and set the expiration
+		cache::request req(packet(), packet_len(), header_);
+		uint32_t exptime;
+		memcpy(&exptime, packet() + sizeof(header_), sizeof(exptime));
+		itm = c_.touch(req.get_key(), ntohl(exptime), req.hv_);
+		if (!itm) {
+			if (!is_quiet(header_.request.opcode)) { //quiet misses get no response
+				error_response(PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
+			}
+			return true;
+		}
+	}
+
+	if (header_.request.opcode == PROTOCOL_BINARY_CMD_TOUCH) {
+		itm.reset(); //not pinned while writing
+		protocol_binary_response_header resp = response_header(header_, 0, 0, 0, 0);
+		return socket_write(resp.bytes, sizeof(resp));
+	}
+	return write_item(itm);
+}
+
+//GET response with the item flags and value, the first packet is a copy,
+//the item is held only if there is more to write
+bool session::write_item(const cache::item_view& itm)
+{
+	buffer hdr;
+	cache::value_reader rest;
+	if (append_item(hdr, header_, *itm, rest)) {
+		wctl_.item_ = itm.hold();
+		wctl_.value_ = rest;
 	}
+	wctl_.hdr_.swap(hdr);
 
 	// write the response
-	if (!continue_write()) {
-		return false;
+	return continue_write();
+}
+
+//a compressed value is decompressed into the response as a whole
+bool session::append_item(buffer& b, const protocol_binary_request_header& h, const cache::item& it, cache::value_reader& rest)
+{
+	typedef uint32_t flag_t;
+
+	size_t value_len = it.get_raw_len();
+	size_t keylen = with_key(h.request.opcode) ? it.get_key().len_ : 0;
+
+	{ //place header, flags and key
+		flag_t f = htonl(it.flags_);
+
+		protocol_binary_request_header rh = h;
+		rh.request.cas = it.cas_; //the response has the item cas
+		buffer hdr = make_response_header(rh, 0, sizeof(f), keylen, sizeof(f) + keylen + value_len);
+		b.insert(b.end(), hdr.begin(), hdr.end());
+		b.insert(b.end(), (unsigned char*)&f, (unsigned char*)&f + sizeof(f));
+		b.insert(b.end(), it.get_key().d_, it.get_key().d_ + keylen);
 	}
 
+	if (it.compressed_) {
+		c_.read_value(it, b);
+		return false;
+	}
+	cache::value_reader value(it);
+	for (size_t left = std::min(MAX_WRITE_SIZE, value_len); left; ) {
+		auto p = value.next();
+		size_t len = std::min(left, p.second);
+		b.insert(b.end(), p.first, p.first + len);
+		value.move(len);
+		left -= len;
+	}
+	if (!value.next().second)
+		return false;
+	rest = value;
 	return true;
 }
 
-//the request header is ready by now
-bool session::handle_request()
+//GETK gets the key, GET the error text
+void session::append_miss(buffer& b, const protocol_binary_request_header& h, const cache::key& k)
 {
-	//wait for complete packet
-	if (request_.size() > header_.request.bodylen + sizeof(header_)) { //packet tool large
-		error_response(PROTOCOL_BINARY_RESPONSE_EINVAL);
-		return false;
+	static const char errstr[] = "Not found";
+	if (with_key(h.request.opcode)) {
+		buffer hdr = make_response_header(h, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, 0, k.len_, k.len_);
+		b.insert(b.end(), hdr.begin(), hdr.end());
+		b.insert(b.end(), k.d_, k.d_ + k.len_);
+	}
+	else {
+		buffer hdr = make_response_header(h, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, 0, 0, sizeof(errstr) - 1);
+		b.insert(b.end(), hdr.begin(), hdr.end());
+		b.insert(b.end(), errstr, errstr + sizeof(errstr) - 1);
 	}
-	else if (request_.size() < header_.request.bodylen + sizeof(header_)) { //wait completion
+}
+
+bool session::handle_request_stat()
+{
+	if (header_.request.keylen) { //no stat groups
+		error_response(PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
 		return true;
 	}
 
-	//got complete packet
+	cache::stats st = c_.get_stats();
+
+	buffer resp;
+	append_stat(resp, header_, "version", VER);
+	append_stat(resp, header_, "curr_items", std::to_string(st.curr_items_));
+	append_stat(resp, header_, "bytes", std::to_string(st.bytes_));
+	append_stat(resp, header_, "limit_maxbytes", std::to_string(c_.maxmemsize()));
+	append_stat(resp, header_, "mem_total", std::to_string(st.mem_pages_ + st.mem_index_)); //never over limit_maxbytes
+	append_stat(resp, header_, "mem_data", std::to_string(st.mem_data_));
+	append_stat(resp, header_, "mem_metadata", std::to_string(st.mem_metadata_));
+	append_stat(resp, header_, "mem_index", std::to_string(st.mem_index_));
+	append_stat(resp, header_, "mem_fragmentation", std::to_string(st.mem_pages_ - st.mem_data_ - st.mem_metadata_));
+	append_stat(resp, header_, "memory_backing", c_.memory_backing());
+	append_stat(resp, header_, "restored_items", std::to_string(st.restored_items_));
+	append_stat(resp, header_, "restore_us", std::to_string(st.restore_us_));
+	append_stat(resp, header_, "cmd_get", std::to_string(st.get_hits_ + st.get_misses_));
+	append_stat(resp, header_, "get_hits", std::to_string(st.get_hits_));
+	append_stat(resp, header_, "get_misses", std::to_string(st.get_misses_));
+	append_stat(resp, header_, "evictions", std::to_string(st.evictions_));
+	append_stat(resp, header_, "expired", std::to_string(st.expired_));
+	append_stat(resp, header_, "reclaimer_evictions", std::to_string(st.reclaimed_));
+	append_stat(resp, header_, "reclaimer_lag_us", std::to_string(st.reclaimer_lag_us_));
+	append_stat(resp, header_, "flash_items", std::to_string(st.flash_items_));
+	append_stat(resp, header_, "flash_hits", std::to_string(st.flash_hits_));
+	append_stat(resp, header_, "flash_misses", std::to_string(st.flash_misses_));
+	append_stat(resp, header_, "flash_writes", std::to_string(st.flash_writes_));
+	append_stat(resp, header_, "flash_dropped", std::to_string(st.flash_dropped_));
+	append_stat(resp, header_, "flash_bytes_written", std::to_string(st.flash_bytes_));
+	append_stat(resp, header_, "l1_entries", std::to_string(c_.get_config().l1_entries_));
+	append_stat(resp, header_, "l1_threshold", std::to_string(c_.get_config().l1_threshold_));
+	append_stat(resp, header_, "l1_hits", std::to_string(st.l1_hits_));
+	append_stat(resp, header_, "l1_misses", std::to_string(st.l1_misses_));
+	append_stat(resp, header_, "l1_fills", std::to_string(st.l1_fills_));
+	append_stat(resp, header_, "l1_stale", std::to_string(st.l1_stale_));
+	append_stat(resp, header_, "namespaces", std::to_string(st.namespaces_));
+	append_stat(resp, header_, "namespaces_max", std::to_string(st.namespaces_max_));
+	append_stat(resp, header_, "ns_invalidations", std::to_string(st.ns_invalidations_));
+	append_stat(resp, header_, "ns_stale", std::to_string(st.ns_stale_));
+	append_stat(resp, header_, "shards", std::to_string(c_.shard_count()));
+	if (unsigned int nodes = c_.get_config().numa_nodes_) { //the shards of every node, see cache::config::numa_nodes_
+		append_stat(resp, header_, "numa_nodes", std::to_string(nodes));
+		for (unsigned int n = 0; n != nodes; ++n) {
+			cache::stats ns = c_.get_node_stats(n);
+			std::string node = "node" + std::to_string(n) + "_";
+			append_stat(resp, header_, node + "items", std::to_string(ns.curr_items_));
+			append_stat(resp, header_, node + "mem", std::to_string(ns.mem_pages_ + ns.mem_index_));
+			append_stat(resp, header_, node + "get_hits", std::to_string(ns.get_hits_));
+			append_stat(resp, header_, node + "get_misses", std::to_string(ns.get_misses_));
+			append_stat(resp, header_, node + "local_ops", std::to_string(ns.local_ops_));
+			append_stat(resp, header_, node + "remote_ops", std::to_string(ns.remote_ops_));
+		}
+	}
+	append_stat(resp, header_, "eviction_policy", cache::eviction_name(c_.get_config().eviction_));
+	append_stat(resp, header_, "admission", c_.get_config().admission_ ? "tinylfu" : "none");
+	append_stat(resp, header_, "admission_admitted", std::to_string(st.admitted_));
+	append_stat(resp, header_, "admission_rejected", std::to_string(st.rejected_));
+	append_stat(resp, header_, "compress_min", std::to_string(c_.get_config().compress_min_));
+	append_stat(resp, header_, "compressed_sets", std::to_string(st.compressed_));
+	append_stat(resp, header_, "compress_skipped", std::to_string(st.compress_skipped_));
+	append_stat(resp, header_, "compress_bytes_in", std::to_string(st.compress_in_));
+	append_stat(resp, header_, "compress_bytes_out", std::to_string(st.compress_out_));
+	append_stat(resp, header_, "compression_ratio", std::to_string(st.compress_out_ ? double(st.compress_in_)/st.compress_out_ : 1.0));
+	append_stat(resp, header_, "compress_us", std::to_string(st.compress_us_));
+	append_stat(resp, header_, "decompress_us", std::to_string(st.decompress_us_));
+	append_stat(resp, header_, "", ""); //the empty one ends the list
+
+	return socket_write(resp.data(), resp.size());
+}
+
+//the request packet is there whole
+bool session::handle_request()
+{
 	bool ret = true;
 	switch (header_.request.opcode) {
 		case PROTOCOL_BINARY_CMD_SET:
 			ret=handle_request_set();
 			break;
 		case PROTOCOL_BINARY_CMD_GET:
+		case PROTOCOL_BINARY_CMD_GETQ:
+		case PROTOCOL_BINARY_CMD_GETK:
+		case PROTOCOL_BINARY_CMD_GETKQ:
 			ret=handle_request_get();
 			break;
 		case PROTOCOL_BINARY_CMD_DELETE:
 			ret=handle_request_delete();
 			break;
+		case PROTOCOL_BINARY_CMD_STAT:
+			ret=handle_request_stat();
+			break;
+		case PROTOCOL_BINARY_CMD_TOUCH:
+		case PROTOCOL_BINARY_CMD_GAT:
+		case PROTOCOL_BINARY_CMD_GATQ:
+			ret=handle_request_touch();
+			break;
+		case PROTOCOL_BINARY_CMD_NOOP:
+			ret=handle_request_noop();
+			break;
+		case PROTOCOL_BINARY_CMD_INVALIDATE:
+			ret=handle_request_invalidate();
+			break;
 		default:
 			error_response(PROTOCOL_BINARY_RESPONSE_UNKNOWN_COMMAND);
 			break;
 	}
+	next_request();
 	reset();
 	return ret;
 }
@@ -269,12 +727,27 @@ bool session::validate_request()
 				error_response(PROTOCOL_BINARY_RESPONSE_EINVAL);
 				ok = false;
 			}
-			if (header_.request.bodylen > MAX_VALUELEN + header_.request.keylen + 8) {
+			if (header_.request.bodylen > c_.get_config().max_value_len_ + header_.request.keylen + 8) {
 				error_response(PROTOCOL_BINARY_RESPONSE_E2BIG);
 				ok = false;
 			}
 			break;
 		case PROTOCOL_BINARY_CMD_GET:
+		case PROTOCOL_BINARY_CMD_GETQ:
+		case PROTOCOL_BINARY_CMD_GETK:
+		case PROTOCOL_BINARY_CMD_GETKQ:
+			if (!valid_get(header_)) {
+				error_response(PROTOCOL_BINARY_RESPONSE_EINVAL);
+				ok = false;
+			}
+			break;
+		case PROTOCOL_BINARY_CMD_NOOP:
+			if (header_.request.extlen != 0 || header_.request.keylen != 0 || header_.request.bodylen != 0) {
+				error_response(PROTOCOL_BINARY_RESPONSE_EINVAL);
+				ok = false;
+			}
+			break;
+		case PROTOCOL_BINARY_CMD_DELETE:
             if (header_.request.extlen != 0 
 					|| header_.request.keylen == 0 
 					|| header_.request.bodylen != header_.request.keylen
@@ -283,17 +756,36 @@ bool session::validate_request()
 				ok = false;
 			}
 			break;
-		case PROTOCOL_BINARY_CMD_DELETE:
+		case PROTOCOL_BINARY_CMD_INVALIDATE:
+			if (header_.request.extlen != 0
+					|| header_.request.keylen == 0
+					|| header_.request.bodylen != header_.request.keylen
+					|| header_.request.keylen > MAX_KEYLEN
+				) {
+				error_response(PROTOCOL_BINARY_RESPONSE_EINVAL);
+				ok = false;
+			}
+			break;
+		case PROTOCOL_BINARY_CMD_STAT:
             if (header_.request.extlen != 0 
-					|| header_.request.keylen == 0 
 					|| header_.request.bodylen != header_.request.keylen
 				) {
 				error_response(PROTOCOL_BINARY_RESPONSE_EINVAL);
 				ok = false;
 			}
 			break;
-		default:
-			error_response(PROTOCOL_BINARY_RESPONSE_UNKNOWN_COMMAND);
+		case PROTOCOL_BINARY_CMD_TOUCH:
+		case PROTOCOL_BINARY_CMD_GAT:
+		case PROTOCOL_BINARY_CMD_GATQ:
+            if (header_.request.extlen != 4 
+					|| header_.request.keylen == 0 
+					|| header_.request.bodylen != header_.request.keylen + 4
+				) {
+				error_response(PROTOCOL_BINARY_RESPONSE_EINVAL);
+				ok = false;
+			}
+			break;
+		default: //answered once the packet is there, see handle_request
 			break;
 	}
 	return ok;
@@ -320,6 +812,9 @@ void session::error_response(protocol_binary_response_status err)
 		case PROTOCOL_BINARY_RESPONSE_E2BIG:
 			errstr = "Too large";
 			break;
+		case PROTOCOL_BINARY_RESPONSE_ENOMEM:
+			errstr = "Out of memory";
+			break;
 		default:
 			assert(false);
 			break;
@@ -344,20 +839,23 @@ bool session::continue_write()
 		return false;
 	}
 
-	//write a chunk
+	//the copied part goes at once, the rest of the value a chunk at a time
 	auto pnt = wctl_.next();
-	size_t len = std::min(MAX_WRITE_SIZE, pnt.second);
+	size_t len = wctl_.copying() ? pnt.second : std::min(MAX_WRITE_SIZE, pnt.second);
 	if (!len) {
 		wctl_.reset();
 		return true;
 	}
 
+	//set before the write, the socket may get writable before it returns (see writable)
+	wait_writable_ = true;
 	ssize_t cnt = ::write(fd_, pnt.first, len);
 	if (cnt == -1) {
 		if (errno != EAGAIN && errno != EWOULDBLOCK) {
 			std::cerr << "continue write error: fd=" << fd_ << " errno=" << errno << std::endl;
 			return false;
 		}
+		return true; //the socket is full, the main loop resumes it when it's writable
 	}
 	else if (!cnt) {
 		return false;
@@ -367,9 +865,13 @@ bool session::continue_write()
 	wctl_.move(cnt);
 
 	if (!wctl_.is_active()) { //done writing
+		wait_writable_ = false;
 		wctl_.reset();
 		return true;
 	}
+	if (size_t(cnt) < len) //the socket is full
+		return true;
+	wait_writable_ = false;
 
 	//schedule a write control event, it'll give an opportunity
 	//to other sessions handle stuff
@@ -380,26 +882,18 @@ bool session::continue_write()
 	return true;
 }
 
+//a response of one request, what the socket doesn't take goes to wctl_,
+//the next requests wait for it
 bool session::socket_write(const unsigned char* buf, size_t len)
 {
-	while (len) {
-		ssize_t cnt = ::write(fd_, buf, len);
-		if (cnt == -1) {
-			if (errno != EAGAIN && errno != EWOULDBLOCK) {
-				std::cerr << "write error: fd=" << fd_ << " errno=" << errno << std::endl;
-				return false;
-			}
-		}
-		else {
-			assert(cnt <= len);
-			len -= cnt;
-		}
-	}
-	return true;
+	assert(!wctl_.is_active());
+	wctl_.hdr_.assign(buf, buf + len);
+	return continue_write();
 }
 
 void session::reset()
 {
-	request_.clear(); 
+	upload_.reset();
+	swallow_ = 0;
 }
 
@@ -2,6 +2,7 @@
 #define MC_SESSION_H
 
 #include <vector>
+#include <atomic>
 #include <stdint.h>
 #include "protocol_binary.h"
 #include "cache.h"
@@ -10,6 +11,7 @@ namespace mc //for memcache...
 {
 	//forward declarations
 	struct server;
+	struct l1_cache;
 
 	struct session
 	{
@@ -19,82 +21,147 @@ namespace mc //for memcache...
 		int ctl_pipe_; //used for control when writing large data on the socket
 		void* user_; //user data
 		cache& c_;
+		l1_cache* l1_; //the read cache of the server thread for the hot keys, nullptr if it's off
 
-		explicit session(int fd, int ctl_pipe, void* user, cache& c);
+		explicit session(int fd, int ctl_pipe, void* user, cache& c, l1_cache* l1 = nullptr);
 		~session();
 
 		bool process_chunk(buffer b); //returns false if the session is to be closed
 		bool control(buffer b); //control event on the session
+		//the server is done with it, the main loop deletes it (see sysevent::close)
+		void release();
+		//the main loop tells that the socket is writable again, true if a response waits for it
+		bool writable()
+		{
+			return wait_writable_.exchange(false);
+		}
 		
 	private:
-		buffer request_;
+		buffer request_; //the requests as they come, there may be a few of them
+		size_t start_; //of the current request in request_, the ones before it are done
+		bool parsed_; //header_ is the one of the current request
 		protocol_binary_request_header header_; //packet header
+		// the response that is written over several events: the header and the first part
+		// of the value are a copy, the rest is written from the item chunk by chunk
 		struct write_control
 		{
 			buffer hdr_;
-			size_t offset_;
-			std::shared_ptr<cache::item> item_;
+			cache::item_ptr item_; //if there is more to write
+			cache::value_reader value_; //the rest of the value
 
 			write_control()
-				:offset_(0)
-				,pos_(0)
+				:pos_(0)
 			{}
 
-			std::pair<const unsigned char*, size_t> next() 
+			std::pair<const unsigned char*, size_t> next() const
 			{
-				if (!hdr_.empty()) {
-					assert(pos_ < hdr_.size());
+				if (pos_ < hdr_.size()) {
 					return std::make_pair(hdr_.data() + pos_, hdr_.size() - pos_);
 				}
 				assert(item_);
-				assert(item_->get_value_len() > pos_);
-				return std::make_pair(item_->get_value() + pos_, item_->get_value_len() - pos_);
+				return value_.next();
 			}
 			void move(size_t cnt)
 			{
-				if (!hdr_.empty()) {
+				if (pos_ < hdr_.size()) {
 					pos_ += cnt;
-					if (pos_ >= hdr_.size()) {
-						hdr_.clear();
-						pos_ = offset_;
-					}
 				}
 				else {
-					pos_ += cnt;
+					value_.move(cnt);
 				}
 			}
 
+			bool copying() const //the copied part isn't all written
+			{
+				return pos_ < hdr_.size();
+			}
+
 			bool is_active() const
 			{
-				if (!item_) {
-					return !hdr_.empty() && pos_ < hdr_.size();
-				}
-				//header is active
-				if (!hdr_.empty() && pos_ < hdr_.size()) {
+				if (pos_ < hdr_.size()) {
 					return true;
 				}
-				// item is active
-				return pos_ < item_->get_value_len();
+				return item_ && value_.next().second;
 			}
 
 			void reset()
 			{
+				//the buffer is reused unless it got too big
+				if (hdr_.capacity() > MAX_REQUEST_BUFFER)
+					buffer().swap(hdr_);
+				hdr_.clear();
 				item_.reset();
+				value_ = cache::value_reader();
 				pos_ = 0;
-				offset_ = 0;
 			}
 			
 		private:
-			size_t pos_;
+			size_t pos_; //in the header
 		};
 		write_control wctl_;
+		std::atomic<bool> wait_writable_; //the socket is full, the rest of wctl_ is written when it takes more
+		cache::item_writer upload_; //SET of a chunked value, the value goes to the item as it comes
+		size_t swallow_; //the rest of a SET value that didn't fit in the cache
+
+		// a run of GETs looked up at once, kept for the next one
+		struct get_batch
+		{
+			std::vector<cache::lookup> keys_;
+			cache::lookups lookups_;
+			std::vector<protocol_binary_request_header> headers_;
+			std::vector<size_t> ends_; //of the requests in request_
+			std::vector<std::pair<size_t, size_t>> responses_; //in out_
+			std::vector<cache::item_ptr> items_; //of the big values, they are written over several events
+			std::vector<cache::value_reader> rests_; //of the big values, what isn't in out_
+			buffer out_; //the responses as the keys are found
+			size_t next_; //response to write, the ones after a big value wait for it
+
+			get_batch()
+				:next_(0)
+			{}
+
+			void clear();
+			bool pending() const
+			{
+				return next_ != responses_.size();
+			}
+		};
+		get_batch batch_;
 
 		bool handle_request_set();
 		bool handle_request_get();
+		bool handle_get_batch();
+		bool write_batch();
+		bool handle_request_noop();
 		bool handle_request_delete();
-
+		bool handle_request_stat();
+		bool handle_request_touch();
+		bool handle_request_invalidate();
+
+		bool write_item(const cache::item_view& itm);
+		//the response with the item (and the key for GETK) up to MAX_WRITE_SIZE of the value,
+		//returns true if there is more of the value, it's in rest
+		bool append_item(buffer& b, const protocol_binary_request_header& h, const cache::item& it, cache::value_reader& rest);
+		//the miss response of a GET that isn't quiet
+		void append_miss(buffer& b, const protocol_binary_request_header& h, const cache::key& k);
+
+		bool process_requests();
 		bool handle_request();
 		bool validate_request();
+		//the current request
+		const unsigned char* packet() const
+		{
+			return request_.data() + start_;
+		}
+		size_t packet_len() const
+		{
+			return sizeof(header_) + header_.request.bodylen;
+		}
+		void next_request(); //the current one is done
+
+		bool is_upload() const;
+		bool begin_upload();
+		bool continue_upload(const unsigned char* d, size_t len);
 
 		void error_response(protocol_binary_response_status err);
 
@@ -0,0 +1,73 @@
+// access frequency sketch
+//
+#include "sketch.h"
+#include <algorithm>
+
+using namespace mc;
+
+namespace
+{
+	//odd multipliers, one per row, they spread the same hash differently
+	const uint64_t ROW_SEEDS[] = {
+		0xc3a5c85c97cb3127ULL
+		,0xb492b66fbe98f273ULL
+		,0x9ae16a3b2f90404fULL
+		,0x9e3779b97f4a7c15ULL
+	};
+}
+
+frequency_sketch::frequency_sketch(size_t width)
+	:width_(16)
+	,samples_(0)
+{
+	while (width_ < width) {
+		width_ <<= 1;
+	}
+	t_.resize(ROWS*width_/16, 0);
+	sample_size_ = width_*10;
+}
+
+size_t frequency_sketch::index(uint32_t hv, unsigned int row) const
+{
+	uint64_t h = (uint64_t(hv) + ROW_SEEDS[row])*ROW_SEEDS[row];
+	return row*width_ + ((h >> 32) & (width_ - 1));
+}
+
+void frequency_sketch::record(uint32_t hv)
+{
+	size_t idx[ROWS];
+	unsigned int min = MAX_COUNT;
+	for (unsigned int r = 0; r != ROWS; ++r) {
+		idx[r] = index(hv, r);
+		min = std::min(min, counter(idx[r]));
+	}
+	if (min == MAX_COUNT)
+		return;
+
+	//conservative update, only the smallest counters grow
+	for (unsigned int r = 0; r != ROWS; ++r) {
+		if (counter(idx[r]) == min) {
+			t_[idx[r] >> 4] += uint64_t(1) << ((idx[r] & 15) << 2);
+		}
+	}
+	if (++samples_ == sample_size_) {
+		age();
+	}
+}
+
+unsigned int frequency_sketch::estimate(uint32_t hv) const
+{
+	unsigned int min = MAX_COUNT;
+	for (unsigned int r = 0; r != ROWS; ++r) {
+		min = std::min(min, counter(index(hv, r)));
+	}
+	return min;
+}
+
+void frequency_sketch::age()
+{
+	for (auto& w: t_) {
+		w = (w >> 1) & 0x7777777777777777ULL; //halves every counter
+	}
+	samples_ /= 2;
+}
@@ -0,0 +1,53 @@
+// access frequency sketch for the cache admission
+//
+#ifndef MC_SKETCH_H
+#define MC_SKETCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace mc
+{
+	// Count-min sketch of the key access frequencies (TinyLFU). There are 4 rows
+	// of 4 bit counters, a key has one counter per row and its estimate is the smallest one.
+	// Every sample_size records all the counters are halved, so the keys that were
+	// popular long ago fade out.
+	//
+	// Not thread safe, the owner (cache shard) serializes the calls.
+	struct frequency_sketch
+	{
+		//width is the number of counters per row, rounded up to a power of 2,
+		//it's supposed to be about the number of items
+		explicit frequency_sketch(size_t width);
+
+		void record(uint32_t hv);
+		unsigned int estimate(uint32_t hv) const;
+
+		size_t memory() const
+		{
+			return t_.size()*sizeof(uint64_t);
+		}
+
+	private:
+		static const unsigned int ROWS = 4;
+		static const unsigned int MAX_COUNT = 15;
+
+		std::vector<uint64_t> t_; //16 counters per word, the rows follow each other
+		size_t width_;
+		size_t samples_;
+		size_t sample_size_;
+
+		size_t index(uint32_t hv, unsigned int row) const; //counter index in the whole table
+		unsigned int counter(size_t idx) const
+		{
+			return (t_[idx >> 4] >> ((idx & 15) << 2)) & 0xf;
+		}
+		void age();
+
+		frequency_sketch(const frequency_sketch&) = delete;
+		frequency_sketch& operator=(const frequency_sketch&) = delete;
+	};
+}
+
+#endif
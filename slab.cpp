@@ -0,0 +1,274 @@
+// slab allocator
+//
+#include "slab.h"
+#include "numa.h"
+#include <sys/mman.h>
+#include <algorithm>
+#include <stdexcept>
+#include <new>
+
+using namespace mc;
+
+unsigned char* mem_pool::alloc_page(size_t size, int node)
+{
+	unsigned char* p = nullptr;
+	if (arena_ && size == arena_->page_size()) {
+		p = arena_->alloc();
+	}
+	if (!p && numa_) {
+		assert(size == page_size_);
+		void* m = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (m == MAP_FAILED)
+			throw std::bad_alloc();
+		p = static_cast<unsigned char*>(m);
+	}
+	if (!p) {
+		return new unsigned char[size];
+	}
+	if (node >= 0) { //a page of the arena may move there from another node
+		numa::host().bind_memory(p, size, node);
+	}
+	return p;
+}
+
+void mem_pool::free_page(unsigned char* p)
+{
+	if (arena_ && arena_->owns(p)) {
+		arena_->free(p);
+	}
+	else if (numa_) {
+		::munmap(p, page_size_);
+	}
+	else {
+		delete [] p;
+	}
+}
+
+slab_allocator::slab_allocator(mem_pool& pool, const config& cfg)
+	:pool_(pool)
+	,cfg_(cfg)
+	,pending_(nullptr)
+{
+	if (cfg_.factor_ <= 1.0) {
+		throw std::runtime_error("slab growth factor must be greater than 1");
+	}
+	static_assert(sizeof(chunk) <= CHUNK_HEADER, "slab chunk header is too big");
+	if (cfg_.min_chunk_ < CHUNK_HEADER + sizeof(free_links) || cfg_.min_chunk_ >= cfg_.page_size_/2
+			|| cfg_.small_chunk_ > MAX_SMALL_CHUNK) {
+		throw std::runtime_error("bad slab chunk size");
+	}
+
+	//chunks are 8 bytes aligned
+	size_t size = (cfg_.min_chunk_ + 7) & ~size_t(7);
+	while (size < cfg_.page_size_/2) {
+		classes_.push_back(slab_class(size, cfg_.page_size_/size));
+		size_t next = size < cfg_.small_chunk_ ? size + 8 : (size_t(size*cfg_.factor_) + 7) & ~size_t(7);
+		size = std::max(next, size + 8);
+	}
+	classes_.push_back(slab_class(cfg_.page_size_/2, 2)); //the biggest one takes half a page, nothing is wasted
+	classes_.push_back(slab_class(0, 0)); //large
+	assert(classes_.size() < 256);
+}
+
+slab_allocator::~slab_allocator()
+{
+	drain();
+	for (auto& sc: classes_) {
+		for (auto p: sc.pages_) {
+			pool_.free_page(p);
+			pool_.release(cfg_.page_size_);
+		}
+	}
+	//large chunks are owned by the items, they are freed by now
+}
+
+unsigned int slab_allocator::class_of(size_t size) const
+{
+	size += CHUNK_HEADER;
+	//few dozens of classes, binary search
+	auto it = std::lower_bound(classes_.begin(), --classes_.end(), size
+			,[](const slab_class& sc, size_t sz) { return sc.size_ < sz; }
+			);
+	return it - classes_.begin();
+}
+
+void* slab_allocator::alloc(unsigned int cls, size_t size)
+{
+	assert(cls < classes_.size());
+	drain();
+
+	if (cls == large_class()) {
+		size_t total = CHUNK_HEADER + size;
+		if (!pool_.reserve(total))
+			return nullptr;
+		chunk* c = nullptr;
+		try {
+			c = reinterpret_cast<chunk*>(new unsigned char[total]);
+		}
+		catch (const std::bad_alloc&) {
+			pool_.release(total);
+			throw;
+		}
+		c->size_ = size;
+		c->cls_ = cls;
+		c->used_ = 1;
+		return user_data(c);
+	}
+
+	slab_class& sc = classes_[cls];
+	assert(size + CHUNK_HEADER <= sc.size_);
+	if (!sc.free_) { //get a new page
+		if (!pool_.reserve(cfg_.page_size_))
+			return nullptr;
+		unsigned char* page = nullptr;
+		try {
+			page = pool_.alloc_page(cfg_.page_size_, cfg_.node_);
+		}
+		catch (const std::bad_alloc&) {
+			pool_.release(cfg_.page_size_);
+			throw;
+		}
+		add_page(cls, page);
+	}
+
+	chunk* c = sc.free_;
+	unlink_free(sc, c);
+	c->used_ = 1;
+	c->size_ = size;
+	return user_data(c);
+}
+
+void slab_allocator::free(void* p)
+{
+	chunk* c = get_chunk(p);
+	chunk* head = pending_.load(std::memory_order_relaxed);
+	do {
+		links(c)->next_ = head;
+	} while (!pending_.compare_exchange_weak(head, c, std::memory_order_release, std::memory_order_relaxed));
+}
+
+unsigned int slab_allocator::biggest_class(unsigned int except) const
+{
+	unsigned int cls = classes();
+	size_t n = 0;
+	for (unsigned int i = 0; i != large_class(); ++i) {
+		if (i != except && classes_[i].pages_.size() > n) {
+			n = classes_[i].pages_.size();
+			cls = i;
+		}
+	}
+	return cls;
+}
+
+bool slab_allocator::take_free_page(unsigned int victim, unsigned int target)
+{
+	assert(victim != large_class() && victim != target);
+	drain();
+	slab_class& v = classes_[victim];
+	for (size_t idx = 0; idx != v.pages_.size(); ++idx) {
+		unsigned char* page = v.pages_[idx];
+		size_t i = 0;
+		while (i != v.per_page_ && !reinterpret_cast<chunk*>(page + i*v.size_)->used_) {
+			++i;
+		}
+		if (i == v.per_page_) {
+			move_page(victim, idx, target);
+			return true;
+		}
+	}
+	return false;
+}
+
+unsigned int slab_allocator::page_class(const unsigned char* page) const
+{
+	unsigned int cls = reinterpret_cast<const chunk*>(page)->cls_;
+	if (cls >= large_class())
+		return classes();
+	const slab_class& sc = classes_[cls];
+	for (size_t i = 0; i != sc.per_page_; ++i) {
+		const chunk* c = reinterpret_cast<const chunk*>(page + i*sc.size_);
+		if (c->cls_ != cls || c->used_ > 1)
+			return classes();
+	}
+	return cls;
+}
+
+void slab_allocator::drain()
+{
+	chunk* c = pending_.exchange(nullptr, std::memory_order_acquire);
+	while (c) {
+		chunk* next = links(c)->next_;
+		do_free(c);
+		c = next;
+	}
+}
+
+void slab_allocator::do_free(chunk* c)
+{
+	assert(c->used_);
+	if (c->cls_ == large_class()) {
+		pool_.release(CHUNK_HEADER + c->size_);
+		delete [] reinterpret_cast<unsigned char*>(c);
+		return;
+	}
+	c->used_ = 0;
+	push_free(classes_[c->cls_], c);
+}
+
+void slab_allocator::push_free(slab_class& sc, chunk* c)
+{
+	free_links* l = links(c);
+	l->next_ = sc.free_;
+	l->prev_ = nullptr;
+	if (sc.free_)
+		links(sc.free_)->prev_ = c;
+	sc.free_ = c;
+}
+
+void slab_allocator::unlink_free(slab_class& sc, chunk* c)
+{
+	free_links* l = links(c);
+	if (l->prev_)
+		links(l->prev_)->next_ = l->next_;
+	else
+		sc.free_ = l->next_;
+	if (l->next_)
+		links(l->next_)->prev_ = l->prev_;
+}
+
+void slab_allocator::add_page(unsigned int cls, unsigned char* page)
+{
+	slab_class& sc = classes_[cls];
+	sc.pages_.push_back(page);
+	for (size_t i = 0; i != sc.per_page_; ++i) {
+		chunk* c = reinterpret_cast<chunk*>(page + i*sc.size_);
+		c->cls_ = cls;
+		c->used_ = 0;
+		c->size_ = 0;
+		push_free(sc, c);
+	}
+}
+
+void slab_allocator::remove_page(unsigned int cls, size_t idx)
+{
+	slab_class& sc = classes_[cls];
+	unsigned char* page = sc.pages_[idx];
+	for (size_t i = 0; i != sc.per_page_; ++i) {
+		unlink_free(sc, reinterpret_cast<chunk*>(page + i*sc.size_));
+	}
+	sc.pages_[idx] = sc.pages_.back();
+	sc.pages_.pop_back();
+}
+
+void slab_allocator::move_page(unsigned int cls, size_t idx, unsigned int target)
+{
+	unsigned char* page = classes_[cls].pages_[idx];
+	remove_page(cls, idx);
+	if (target == large_class()) {
+		pool_.free_page(page);
+		pool_.release(cfg_.page_size_);
+	}
+	else {
+		add_page(target, page);
+	}
+}
@@ -0,0 +1,298 @@
+// slab allocator for the cache items
+//
+#ifndef MC_SLAB_H
+#define MC_SLAB_H
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+#include <memory>
+#include "config.h"
+#include "arena.h"
+
+namespace mc
+{
+	// memory budget shared by all slab allocators (one per cache shard),
+	// the pages come from the heap or from an arena (see arena.h).
+	// With numa the heap pages are mapped one by one, so they can be bound to the node of their shard
+	struct mem_pool
+	{
+		explicit mem_pool(size_t maxmemsize, size_t page_size = SLAB_PAGE_SIZE, const arena::config& cfg = arena::config(), bool numa = false)
+			:maxmemsize_(maxmemsize)
+			,page_size_(page_size)
+			,numa_(numa)
+			,used_(0)
+		{
+			if (cfg.enabled()) {
+				arena_.reset(new arena(maxmemsize, page_size, cfg));
+			}
+		}
+
+		bool reserve(size_t size)
+		{
+			size_t used = used_.load(std::memory_order_relaxed);
+			do {
+				if (used + size > maxmemsize_)
+					return false;
+			} while (!used_.compare_exchange_weak(used, used + size));
+			return true;
+		}
+
+		//memory that is in use already (the pages of a restored arena), it may go over the budget
+		void take(size_t size)
+		{
+			used_ += size;
+		}
+
+		void release(size_t size)
+		{
+			assert(used_ >= size);
+			used_ -= size;
+		}
+
+		size_t used() const
+		{
+			return used_;
+		}
+		size_t maxmemsize() const
+		{
+			return maxmemsize_;
+		}
+
+		//the memory of a reserved page on the NUMA node (-1 is any), throws std::bad_alloc
+		unsigned char* alloc_page(size_t size, int node = -1);
+		void free_page(unsigned char* p);
+		const arena* get_arena() const //nullptr if the pages are on the heap
+		{
+			return arena_.get();
+		}
+		arena* get_arena()
+		{
+			return arena_.get();
+		}
+
+	private:
+		const size_t maxmemsize_;
+		const size_t page_size_;
+		const bool numa_;
+		std::atomic<size_t> used_;
+		std::unique_ptr<arena> arena_;
+
+		mem_pool(const mem_pool&) = delete;
+		mem_pool& operator=(const mem_pool&) = delete;
+	};
+
+	// Item memory is carved out of big pages, every page is split into equal chunks
+	// of one size class. The chunk sizes grow by 8 bytes from min_chunk up to small_chunk
+	// (the small items, where the rounding would waste most), then by a factor, the biggest class
+	// is half a page, bigger items go to the "large" class and are allocated one by one.
+	// Pages are taken from the shared mem_pool and are only given back when
+	// they are moved to another class (see reclaim_page).
+	//
+	// alloc/reclaim are not thread safe, the owner (cache shard) serializes them.
+	// free may be called by any thread, the chunk is handed back to the owner
+	// through a lock free list and it's put back on the next alloc.
+	struct slab_allocator
+	{
+		struct config
+		{
+			size_t page_size_;
+			size_t min_chunk_; //smallest chunk (including chunk header)
+			size_t small_chunk_; //the chunks grow by 8 bytes up to this size, 0 if they don't
+			double factor_; //chunk size growth factor
+			int node_; //NUMA node of the pages, -1 for any
+
+			config()
+				:page_size_(SLAB_PAGE_SIZE)
+				,min_chunk_(80)
+				,small_chunk_(SMALL_CHUNK)
+				,factor_(1.25)
+				,node_(-1)
+			{}
+		};
+
+		explicit slab_allocator(mem_pool& pool, const config& cfg);
+		~slab_allocator();
+
+		unsigned int classes() const //number of size classes, including the large one
+		{
+			return classes_.size();
+		}
+		unsigned int large_class() const
+		{
+			return classes_.size() - 1;
+		}
+		unsigned int class_of(size_t size) const; //class for the user size
+		size_t chunk_size(unsigned int cls) const
+		{
+			return classes_[cls].size_;
+		}
+		size_t pages(unsigned int cls) const
+		{
+			return classes_[cls].pages_.size();
+		}
+		size_t memory() const //of all the pages
+		{
+			size_t n = 0;
+			for (auto& sc: classes_) {
+				n += sc.pages_.size();
+			}
+			return n*cfg_.page_size_;
+		}
+
+		static const size_t CHUNK_HEADER = 8; //keeps the user data 8 bytes aligned
+
+		//returns nullptr if the memory budget is exhausted, throws std::bad_alloc if the system is out of memory
+		void* alloc(unsigned int cls, size_t size);
+		//any thread
+		void free(void* p);
+
+		//class with the most pages (except the given one), classes() if none
+		unsigned int biggest_class(unsigned int except) const;
+
+		// Takes one page away from the victim class and gives it to the target class
+		// (or back to the pool if the target is the large class).
+		// evict(void* p) is called for every allocated chunk on the page, the owner is supposed to
+		// free it (it may be already freed by another thread and waiting in the pending list),
+		// then flush() lets it free the chunks it held back. If some chunks are still in use after that the page stays where it was.
+		template <typename Evict, typename Flush>
+		bool reclaim_page(unsigned int victim, unsigned int target, Evict evict, Flush flush)
+		{
+			assert(victim != large_class());
+			slab_class& v = classes_[victim];
+			if (v.pages_.empty())
+				return false;
+			size_t idx = v.cursor_++ % v.pages_.size();
+			unsigned char* page = v.pages_[idx];
+
+			for (size_t i = 0; i != v.per_page_; ++i) {
+				chunk* c = reinterpret_cast<chunk*>(page + i*v.size_);
+				if (c->used_)
+					evict(user_data(c));
+			}
+			flush();
+			drain();
+			for (size_t i = 0; i != v.per_page_; ++i) {
+				if (reinterpret_cast<chunk*>(page + i*v.size_)->used_)
+					return false; //someone is still using it, try later
+			}
+
+			move_page(victim, idx, target);
+			return true;
+		}
+
+		// Moves a page of the victim class that has no chunks in use to the target class
+		// (or back to the pool), it checks every chunk, so it's meant for the classes of few big chunks.
+		// Returns false if there is no such page
+		bool take_free_page(unsigned int victim, unsigned int target);
+
+		//the page of a restored arena (see arena.h) is what a slab allocator like this one left there:
+		//the class of its chunks, classes() if the chunk headers don't make sense
+		unsigned int page_class(const unsigned char* page) const;
+
+		//calls f(void* p) for every allocated chunk of a page of the class, the page doesn't have to be taken yet
+		template <typename F>
+		void for_each_used(unsigned char* page, unsigned int cls, F f) const
+		{
+			const slab_class& sc = classes_[cls];
+			for (size_t i = 0; i != sc.per_page_; ++i) {
+				chunk* c = reinterpret_cast<chunk*>(page + i*sc.size_);
+				if (c->used_)
+					f(user_data(c));
+			}
+		}
+
+		// Takes a page of a restored arena with its chunks as they are: the ones keep(void* p) returns
+		// true for stay allocated, the rest go to the free list. The page is counted in the pool even over the budget
+		template <typename Keep>
+		void adopt_page(unsigned char* page, unsigned int cls, Keep keep)
+		{
+			assert(cls < large_class());
+			slab_class& sc = classes_[cls];
+			pool_.take(cfg_.page_size_);
+			sc.pages_.push_back(page);
+			for (size_t i = 0; i != sc.per_page_; ++i) {
+				chunk* c = reinterpret_cast<chunk*>(page + i*sc.size_);
+				if (c->used_ && keep(user_data(c)))
+					continue;
+				c->used_ = 0;
+				c->size_ = 0;
+				push_free(sc, c);
+			}
+		}
+
+		static bool used(const void* p) //the chunk is allocated
+		{
+			return reinterpret_cast<const chunk*>(static_cast<const unsigned char*>(p) - CHUNK_HEADER)->used_ != 0;
+		}
+
+	private:
+		//every chunk starts with this header, the user data follows
+		struct chunk
+		{
+			uint32_t size_; //user size for large chunks
+			uint8_t cls_;
+			uint8_t used_;
+		};
+
+		// the links of the free lists live in the user data, it's not used by then
+		struct free_links
+		{
+			chunk* next_; //free list or pending free list
+			chunk* prev_; //free list only
+		};
+
+		struct slab_class
+		{
+			size_t size_; //chunk size, 0 for the large class
+			size_t per_page_;
+			chunk* free_; //doubly linked free list
+			std::vector<unsigned char*> pages_;
+			size_t cursor_; //round robin over pages for reclaiming
+
+			explicit slab_class(size_t size, size_t per_page)
+				:size_(size)
+				,per_page_(per_page)
+				,free_(nullptr)
+				,cursor_(0)
+			{}
+		};
+
+		typedef std::vector<slab_class> slab_classes;
+
+		mem_pool& pool_;
+		const config cfg_;
+		slab_classes classes_;
+		std::atomic<chunk*> pending_; //freed by other threads
+
+		static void* user_data(chunk* c)
+		{
+			return reinterpret_cast<unsigned char*>(c) + CHUNK_HEADER;
+		}
+		static chunk* get_chunk(void* p)
+		{
+			return reinterpret_cast<chunk*>(static_cast<unsigned char*>(p) - CHUNK_HEADER);
+		}
+		static free_links* links(chunk* c)
+		{
+			return static_cast<free_links*>(user_data(c));
+		}
+
+		void drain();
+		void do_free(chunk* c);
+
+		void push_free(slab_class& sc, chunk* c);
+		void unlink_free(slab_class& sc, chunk* c);
+
+		void add_page(unsigned int cls, unsigned char* page);
+		void remove_page(unsigned int cls, size_t idx);
+		void move_page(unsigned int cls, size_t idx, unsigned int target);
+
+		slab_allocator(const slab_allocator&) = delete;
+		slab_allocator& operator=(const slab_allocator&) = delete;
+	};
+}
+
+#endif
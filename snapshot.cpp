@@ -0,0 +1,412 @@
+// cache snapshots
+//
+#include "snapshot.h"
+#include "wyhash.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <assert.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+using namespace mc;
+
+namespace
+{
+	const char MAGIC[8] = {'m', 'c', 's', 'n', 'a', 'p', '1', '\n'};
+	const size_t BLOCK_SIZE = 1024*1024; //the items of a block
+	const size_t SEGMENT = 1024*1024; //the check is chained over the segments of a block
+	const size_t BATCH = 256; //index slots looked at under a shard lock
+
+	struct file_header
+	{
+		char magic_[8];
+		uint64_t created_; //unix time
+	};
+
+	// the items follow it, then the check of them (uint64_t), len_ 0 ends the file
+	struct block_header
+	{
+		uint32_t len_;
+		uint32_t items_;
+	};
+
+	// the key and the value follow it
+	struct record
+	{
+		uint64_t cas_;
+		uint32_t flags_;
+		uint32_t exptime_; //unix time, 0 if it never expires
+		uint32_t value_len_;
+		uint8_t keylen_;
+		uint8_t compressed_;
+		uint16_t unused_;
+	};
+
+	static_assert(sizeof(record) == 24, "the snapshot record has padding");
+
+	std::runtime_error file_error(const char* what, const std::string& path)
+	{
+		std::stringstream se;
+		se << what << " " << path << ": " << errno;
+		return std::runtime_error(se.str());
+	}
+
+	uint64_t check(const unsigned char* d, size_t len, uint64_t seed)
+	{
+		for (size_t off = 0; off < len; off += SEGMENT) {
+			seed = wyhash(d + off, std::min(SEGMENT, len - off), seed);
+		}
+		return seed;
+	}
+
+	// writes the blocks, a block of one big item is checked segment by segment as it goes
+	struct writer
+	{
+		explicit writer(int fd, const std::string& path)
+			:fd_(fd)
+			,path_(path)
+			,bytes_(0)
+			,check_(0)
+		{}
+
+		uint64_t bytes() const
+		{
+			return bytes_;
+		}
+
+		void write(const void* d, size_t len)
+		{
+			iovec v = {const_cast<void*>(d), len};
+			writev(&v, 1);
+		}
+
+		//a whole block of items
+		void block(const std::vector<unsigned char>& d, uint32_t items)
+		{
+			block_header h = {uint32_t(d.size()), items};
+			uint64_t ch = check(d.data(), d.size(), 0);
+			iovec v[3] = {{&h, sizeof(h)}, {const_cast<unsigned char*>(d.data()), d.size()}, {&ch, sizeof(ch)}};
+			writev(v, 3);
+		}
+
+		//a block that is written piece by piece, len is known up front
+		void begin(uint32_t len, uint32_t items)
+		{
+			block_header h = {len, items};
+			write(&h, sizeof(h));
+			check_ = 0;
+			seg_.clear();
+		}
+		void put(const void* d, size_t len)
+		{
+			const unsigned char* p = static_cast<const unsigned char*>(d);
+			while (len) {
+				size_t n = std::min(len, SEGMENT - seg_.size());
+				seg_.insert(seg_.end(), p, p + n);
+				p += n;
+				len -= n;
+				if (seg_.size() == SEGMENT) {
+					flush();
+				}
+			}
+		}
+		void end()
+		{
+			flush();
+			write(&check_, sizeof(check_));
+		}
+
+	private:
+		int fd_;
+		const std::string path_;
+		uint64_t bytes_;
+		uint64_t check_;
+		std::vector<unsigned char> seg_;
+
+		void flush()
+		{
+			if (seg_.empty())
+				return;
+			check_ = wyhash(seg_.data(), seg_.size(), check_);
+			write(seg_.data(), seg_.size());
+			seg_.clear();
+		}
+
+		void writev(iovec* v, int n)
+		{
+			while (n) {
+				ssize_t w = ::writev(fd_, v, n);
+				if (w < 0) {
+					if (errno == EINTR)
+						continue;
+					throw file_error("can't write the snapshot", path_);
+				}
+				bytes_ += w;
+				for (; n && size_t(w) >= v->iov_len; --n, ++v) {
+					w -= v->iov_len;
+				}
+				if (n) {
+					v->iov_base = static_cast<unsigned char*>(v->iov_base) + w;
+					v->iov_len -= w;
+				}
+			}
+		}
+
+		writer(const writer&) = delete;
+		writer& operator=(const writer&) = delete;
+	};
+
+	record make_record(const cache::item& it)
+	{
+		record r;
+		r.cas_ = it.cas_;
+		r.flags_ = it.flags_;
+		r.exptime_ = it.exptime_;
+		r.value_len_ = it.get_value_len();
+		r.keylen_ = it.keylen_;
+		r.compressed_ = it.compressed_;
+		r.unused_ = 0;
+		return r;
+	}
+
+	template <typename Put>
+	void put_item(const cache::item& it, const record& r, Put put)
+	{
+		put(&r, sizeof(r));
+		put(it.get_data(), it.keylen_);
+		cache::value_reader pos(it);
+		for (auto p = pos.next(); p.second; p = pos.next()) {
+			put(p.first, p.second);
+			pos.move(p.second);
+		}
+	}
+
+	// the items of a block whose check is right, the ones that aren't whole make it broken
+	bool load_block(cache& c, const unsigned char* d, size_t len, uint32_t now, snapshot::stats& st)
+	{
+		const unsigned char* end = d + len;
+		while (d != end) {
+			record r;
+			if (size_t(end - d) < sizeof(r))
+				return false;
+			::memcpy(&r, d, sizeof(r));
+			d += sizeof(r);
+			if (r.keylen_ > MAX_KEYLEN || size_t(end - d) < size_t(r.keylen_) + r.value_len_)
+				return false;
+			const unsigned char* k = d;
+			d += r.keylen_ + size_t(r.value_len_);
+			if (r.exptime_ && int32_t(r.exptime_ - now) <= 0) {
+				++st.skipped_;
+				continue;
+			}
+			try {
+				c.put(cache::key(k, r.keylen_), r.flags_, r.exptime_, r.cas_, k + r.keylen_, r.value_len_, r.compressed_ != 0);
+				++st.items_;
+			}
+			catch (const std::exception&) { //too big for the memory or a broken compressed value
+				++st.skipped_;
+			}
+		}
+		return true;
+	}
+}
+
+snapshot::stats snapshot::dump(cache& c, const std::string& path)
+{
+	auto start = std::chrono::steady_clock::now();
+	std::string tmp = path + ".tmp";
+	int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1) {
+		throw file_error("can't create the snapshot", tmp);
+	}
+
+	stats st;
+	try {
+		writer w(fd, tmp);
+		file_header fh;
+		::memcpy(fh.magic_, MAGIC, sizeof(MAGIC));
+		fh.created_ = cache::now();
+		w.write(&fh, sizeof(fh));
+
+		std::vector<unsigned char> block;
+		block.reserve(BLOCK_SIZE);
+		uint32_t n = 0;
+		std::vector<cache::item_ptr> items;
+		for (size_t s = 0; s != c.shard_count(); ++s) {
+			size_t pos = 0;
+			bool more = true;
+			while (more) {
+				items.clear(); //the references of the last batch go
+				more = c.next_items(s, pos, BATCH, items);
+				for (auto& it: items) {
+					record r = make_record(*it);
+					size_t size = sizeof(r) + r.keylen_ + r.value_len_;
+					if (n && block.size() + size > BLOCK_SIZE) {
+						w.block(block, n);
+						block.clear();
+						n = 0;
+					}
+					if (size > BLOCK_SIZE) {
+						w.begin(size, 1);
+						put_item(*it, r, [&](const void* d, size_t len) { w.put(d, len); });
+						w.end();
+					}
+					else {
+						put_item(*it, r, [&](const void* d, size_t len) {
+								const unsigned char* p = static_cast<const unsigned char*>(d);
+								block.insert(block.end(), p, p + len);
+							});
+						++n;
+					}
+					++st.items_;
+				}
+			}
+		}
+		items.clear();
+		if (n) {
+			w.block(block, n);
+		}
+		block_header eof = {0, 0};
+		w.write(&eof, sizeof(eof));
+		st.bytes_ = w.bytes();
+
+		if (::fsync(fd)) {
+			throw file_error("can't write the snapshot", tmp);
+		}
+		if (::close(fd)) {
+			fd = -1;
+			throw file_error("can't write the snapshot", tmp);
+		}
+		fd = -1;
+		if (::rename(tmp.c_str(), path.c_str())) {
+			throw file_error("can't rename the snapshot to", path);
+		}
+	}
+	catch (const std::exception&) {
+		if (fd != -1) {
+			::close(fd);
+		}
+		::unlink(tmp.c_str());
+		throw;
+	}
+	st.us_ = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+	return st;
+}
+
+snapshot::stats snapshot::load(cache& c, const std::string& path, unsigned int threads)
+{
+	auto start = std::chrono::steady_clock::now();
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		throw file_error("can't open the snapshot", path);
+	}
+	struct stat fs;
+	if (::fstat(fd, &fs)) {
+		::close(fd);
+		throw file_error("can't stat the snapshot", path);
+	}
+	size_t size = fs.st_size;
+	if (size < sizeof(file_header)) {
+		::close(fd);
+		throw std::runtime_error("not a snapshot: " + path);
+	}
+	void* p = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (p == MAP_FAILED) {
+		throw file_error("can't map the snapshot", path);
+	}
+	const unsigned char* d = static_cast<const unsigned char*>(p);
+	::madvise(p, size, MADV_SEQUENTIAL); //the threads go through it in the block order
+
+	stats st;
+	st.bytes_ = size;
+	size_t broken = 0;
+	try {
+		if (::memcmp(d, MAGIC, sizeof(MAGIC))) {
+			throw std::runtime_error("not a snapshot: " + path);
+		}
+
+		//the block headers only, the threads take the blocks one by one
+		std::vector<size_t> blocks;
+		bool whole = false;
+		size_t off = sizeof(file_header);
+		while (size - off >= sizeof(block_header)) {
+			block_header h;
+			::memcpy(&h, d + off, sizeof(h));
+			if (!h.len_) {
+				whole = true;
+				break;
+			}
+			if (size - off - sizeof(h) < h.len_ + sizeof(uint64_t))
+				break;
+			blocks.push_back(off);
+			off += sizeof(h) + h.len_ + sizeof(uint64_t);
+		}
+		if (!whole) {
+			std::clog << "warning: the snapshot " << path << " is cut short, it loads what's there" << std::endl;
+		}
+
+		threads = std::max<size_t>(1, std::min<size_t>(threads, blocks.size()));
+		uint32_t now = cache::now();
+		std::atomic<size_t> next(0);
+		std::atomic<size_t> broken_blocks(0);
+		std::vector<stats> ts_stats(threads);
+		std::vector<std::exception_ptr> errors(threads);
+		auto run = [&](size_t t) {
+			try {
+				for (size_t b = next++; b < blocks.size(); b = next++) {
+					block_header h;
+					::memcpy(&h, d + blocks[b], sizeof(h));
+					const unsigned char* items = d + blocks[b] + sizeof(h);
+					uint64_t ch;
+					::memcpy(&ch, items + h.len_, sizeof(ch));
+					if (check(items, h.len_, 0) != ch || !load_block(c, items, h.len_, now, ts_stats[t])) {
+						++broken_blocks;
+						ts_stats[t].skipped_ += h.items_; //some of them may be loaded already
+					}
+				}
+			}
+			catch (...) {
+				errors[t] = std::current_exception();
+			}
+		};
+		std::vector<std::thread> ts;
+		for (size_t t = 1; t < threads; ++t) {
+			ts.emplace_back(run, t);
+		}
+		run(0);
+		for (auto& t: ts) {
+			t.join();
+		}
+		for (size_t t = 0; t != threads; ++t) {
+			if (errors[t])
+				std::rethrow_exception(errors[t]);
+			st.items_ += ts_stats[t].items_;
+			st.skipped_ += ts_stats[t].skipped_;
+		}
+		broken = broken_blocks;
+	}
+	catch (const std::exception&) {
+		::munmap(p, size);
+		throw;
+	}
+	::munmap(p, size);
+
+	if (broken) {
+		std::clog << "warning: " << broken << " broken blocks in the snapshot " << path << " are skipped" << std::endl;
+	}
+	st.us_ = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+	return st;
+}
@@ -0,0 +1,49 @@
+// cache snapshots
+//
+#ifndef MC_SNAPSHOT_H
+#define MC_SNAPSHOT_H
+
+#include <stdint.h>
+#include <string>
+#include "cache.h"
+
+namespace mc
+{
+	// The items of a cache in a file, to warm up a new process or another node.
+	// The file is a header and blocks of whole items, every block is checked (wyhash),
+	// so the blocks load in parallel and a broken one is skipped. A block is about 1MB,
+	// an item that doesn't fit goes to a block of its own and streams through without being
+	// copied in one piece. The values are as they are stored (compressed or not),
+	// the numbers are in the host byte order.
+	//
+	// The dump walks the index of every shard a few slots at a time, the shard is locked
+	// only to take references to the items, they are written out of the lock. It's not
+	// a point in time copy: the items changed during the dump may be missing or older,
+	// an index that grows meanwhile may give some of them twice (the later one wins the load).
+	struct snapshot
+	{
+		struct stats
+		{
+			uint64_t items_;
+			uint64_t bytes_; //of the file
+			uint64_t skipped_; //expired, too big for the cache or in the broken blocks
+			uint64_t us_;
+
+			stats()
+				:items_(0)
+				,bytes_(0)
+				,skipped_(0)
+				,us_(0)
+			{}
+		};
+
+		//writes the file next to the path and renames it at the end, the cache is used meanwhile.
+		//Throws on the file errors
+		static stats dump(cache& c, const std::string& path);
+		//loads the items with that many threads (the cache has to be thread safe for more than one),
+		//throws if the file can't be read or it's not a snapshot
+		static stats load(cache& c, const std::string& path, unsigned int threads);
+	};
+}
+
+#endif
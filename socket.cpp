@@ -92,6 +92,11 @@ socket::socket(const std::string& ip, int port)
 		if (err != 0) {
 			std::cerr << "setsockopt error" << std::endl;
 		}
+		//a restart (see -r) binds the port again while the connections of the last process wait to go
+		err = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
+		if (err != 0) {
+			std::cerr << "setsockopt error" << std::endl;
+		}
 
 		err = ::bind(fd, info->ai_addr, info->ai_addrlen); 
 		if (!err) //bind worked
@@ -220,3 +225,14 @@ bool tcp::accept_connection(connection_info& info, tcp::socket& s, tcp::epoll& e
 
 	return true;
 }
+
+int tcp::incoming_cpu(int fd)
+{
+#ifdef SO_INCOMING_CPU
+	int cpu = -1;
+	socklen_t len = sizeof(cpu);
+	if (::getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0)
+		return cpu;
+#endif
+	return -1;
+}
@@ -62,6 +62,9 @@ namespace tcp
 		std::string port_;
 	};
 	bool accept_connection(connection_info& info, tcp::socket& s, tcp::epoll& ep);
+
+	//the cpu that handled the last packets of the connection, -1 if the system doesn't tell
+	int incoming_cpu(int fd);
 }
 
 #endif
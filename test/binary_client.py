@@ -0,0 +1,131 @@
+import socket
+import struct
+import subprocess
+import time
+
+# the requests the client library doesn't do: quiet GETs and pipelining, INVALIDATE,
+# and servers with their own options next to the one of conftest
+
+SERVER = '../../build/memcacher'
+
+HEADER = '>BBHBBHIIQ'
+HEADER_LEN = 24
+REQ_MAGIC = 0x80
+
+GET = 0x00
+SET = 0x01
+DELETE = 0x04
+GETQ = 0x09
+NOOP = 0x0a
+GETK = 0x0c
+GETKQ = 0x0d
+STAT = 0x10
+INVALIDATE = 0x50
+
+SUCCESS = 0x00
+KEY_ENOENT = 0x01
+EINVAL = 0x04
+UNKNOWN_COMMAND = 0x81
+ENOMEM = 0x82
+
+
+def start_server(port, *args):
+    p = subprocess.Popen([SERVER, '-p', str(port)] + list(args),
+                         stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    for _ in range(100):  # it may load a file first
+        try:
+            socket.create_connection(('127.0.0.1', port)).close()
+            return p
+        except socket.error:
+            time.sleep(0.05)
+    p.kill()
+    raise RuntimeError('the server on port %d did not start' % port)
+
+
+def stop_server(p):
+    p.kill()
+    p.wait()
+
+
+class Response(object):
+    def __init__(self, opcode, status, extras, key, value, cas, opaque):
+        self.opcode = opcode
+        self.status = status
+        self.extras = extras
+        self.key = key
+        self.value = value
+        self.cas = cas
+        self.opaque = opaque
+
+
+def request(opcode, key=b'', value=b'', extras=b'', cas=0, opaque=0):
+    body = extras + key + value
+    return struct.pack(HEADER, REQ_MAGIC, opcode, len(key), len(extras), 0, 0,
+                       len(body), opaque, cas) + body
+
+
+def set_request(key, value, exptime=0, flags=0, cas=0, opaque=0):
+    return request(SET, key, value, struct.pack('>II', flags, exptime), cas, opaque)
+
+
+class Client(object):
+    def __init__(self, port):
+        self.s = socket.create_connection(('127.0.0.1', port))
+        self.s.settimeout(10)
+
+    def close(self):
+        self.s.close()
+
+    def send(self, *packets):
+        self.s.sendall(b''.join(packets))
+
+    def recv(self, n):
+        b = b''
+        while len(b) < n:
+            chunk = self.s.recv(n - len(b))
+            if not chunk:
+                raise EOFError('the server closed the connection')
+            b += chunk
+        return b
+
+    def response(self):
+        magic, opcode, keylen, extlen, _, status, bodylen, opaque, cas = \
+            struct.unpack(HEADER, self.recv(HEADER_LEN))
+        body = self.recv(bodylen)
+        return Response(opcode, status, body[:extlen], body[extlen:extlen + keylen],
+                        body[extlen + keylen:], cas, opaque)
+
+    # the responses up to the one of the NOOP that ends a pipeline, without it
+    def responses_to_noop(self):
+        rs = []
+        while True:
+            r = self.response()
+            if r.opcode == NOOP:
+                return rs
+            rs.append(r)
+
+    def call(self, packet):
+        self.send(packet)
+        return self.response()
+
+    def set(self, key, value, exptime=0, flags=0, cas=0):
+        return self.call(set_request(key, value, exptime, flags, cas)).status
+
+    def get(self, key):
+        r = self.call(request(GET, key))
+        return r.value if r.status == SUCCESS else None
+
+    def delete(self, key, cas=0):
+        return self.call(request(DELETE, key, cas=cas)).status
+
+    def invalidate(self, ns):
+        return self.call(request(INVALIDATE, ns)).status
+
+    def stats(self):
+        self.send(request(STAT))
+        st = {}
+        while True:
+            r = self.response()
+            if not r.key:
+                return st
+            st[r.key.decode()] = r.value.decode()
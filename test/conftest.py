@@ -5,9 +5,9 @@ import time
 
 @pytest.yield_fixture(scope='session', autouse=True)
 def memcached_standard_port():
-    p = subprocess.Popen(['../../build/memcacher', "-t", "1"], stdout=subprocess.PIPE, stderr=subprocess.PIPE);
+    p = subprocess.Popen(['../../build/memcacher', "-t", "1", "-z", "1024", "-I", "8"], stdout=subprocess.PIPE, stderr=subprocess.PIPE);
     #fl = open('testlog.txt', 'w');
-    #p = subprocess.Popen(['../../build/memcacher', "-t", "1"], stdout=fl, stderr=fl);
+    #p = subprocess.Popen(['../../build/memcacher', "-t", "1", "-z", "1024", "-I", "8"], stdout=fl, stderr=fl);
     time.sleep(0.1)
     yield p
     p.kill()
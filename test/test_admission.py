@@ -0,0 +1,43 @@
+import unittest
+
+from binary_client import *
+
+PORT = 11318
+HOT = 200
+SCAN = 8000  # 32MB of keys that are set once, into 16MB of memory
+
+
+class AdmissionTests(unittest.TestCase):
+    def start(self, *args):
+        self.server = start_server(PORT, '-m', '16', *args)
+        self.client = Client(PORT)
+
+    def tearDown(self):
+        self.client.close()
+        stop_server(self.server)
+
+    # the hot keys that are left after a scan
+    def scan(self):
+        for i in range(HOT):
+            self.assertEqual(self.client.set(b'hot%d' % i, b'h' * 4000), SUCCESS)
+        for _ in range(5):
+            for i in range(HOT):
+                self.assertEqual(self.client.get(b'hot%d' % i), b'h' * 4000)
+        for i in range(SCAN):
+            self.assertEqual(self.client.set(b'scan%d' % i, b's' * 4000), SUCCESS)
+        return sum(self.client.get(b'hot%d' % i) is not None for i in range(HOT))
+
+    def testScanKeepsHotKeys(self):
+        self.start('-a')
+        self.assertEqual(self.scan(), HOT)
+        st = self.client.stats()
+        self.assertEqual(st['admission'], 'tinylfu')
+        self.assertTrue(int(st['admission_rejected']) > 0)
+
+    def testScanWithoutAdmission(self):
+        # the LRU alone gives the memory to the scan
+        self.start()
+        self.assertTrue(self.scan() < HOT)
+        st = self.client.stats()
+        self.assertEqual(st['admission'], 'none')
+        self.assertEqual(st['admission_rejected'], '0')
@@ -0,0 +1,59 @@
+import os
+import shutil
+import struct
+import tempfile
+import time
+import unittest
+
+from binary_client import *
+
+PORT = 11316
+ITEMS = 6000  # 24MB into 16MB of memory
+
+
+def value(i):
+    return (b'flash%d-' % i) * 400
+
+
+class FlashTests(unittest.TestCase):
+    def setUp(self):
+        self.dir = tempfile.mkdtemp()
+        self.server = start_server(PORT, '-m', '16', '-F', os.path.join(self.dir, 'flash') + ',64')
+        self.client = Client(PORT)
+
+    def tearDown(self):
+        self.client.close()
+        stop_server(self.server)
+        shutil.rmtree(self.dir)
+
+    def testHitAfterEviction(self):
+        for i in range(ITEMS):
+            self.assertEqual(self.client.set(b'flash_key%d' % i, value(i), flags=i), SUCCESS)
+        time.sleep(0.5)  # the evicted items are written in the background
+        st = self.client.stats()
+        self.assertTrue(int(st['evictions']) > 0)
+        self.assertTrue(int(st['flash_writes']) > 0)
+
+        # the first keys are out of the memory, they come from the flash as they were set
+        found = 0
+        for i in range(ITEMS // 4):
+            r = self.client.call(request(GET, b'flash_key%d' % i))
+            if r.status == KEY_ENOENT:
+                continue
+            self.assertEqual(r.status, SUCCESS)
+            self.assertEqual(r.value, value(i))
+            self.assertEqual(struct.unpack('>I', r.extras)[0], i)
+            found += 1
+        self.assertTrue(found > 0)
+        self.assertTrue(int(self.client.stats()['flash_hits']) > 0)
+
+    def testDeleteOnFlash(self):
+        for i in range(ITEMS):
+            self.assertEqual(self.client.set(b'flash_key%d' % i, value(i)), SUCCESS)
+        time.sleep(0.5)
+
+        # a deleted or a set again item doesn't come back from the flash
+        self.client.delete(b'flash_key1')
+        self.assertEqual(self.client.get(b'flash_key1'), None)
+        self.assertEqual(self.client.set(b'flash_key2', b'new'), SUCCESS)
+        self.assertEqual(self.client.get(b'flash_key2'), b'new')
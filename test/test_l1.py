@@ -0,0 +1,58 @@
+import time
+import unittest
+
+from binary_client import *
+
+PORT = 11317
+CLIENTS = 4
+
+
+class L1Tests(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        cls.server = start_server(PORT, '-t', '2', '-H', '64,2')
+
+    @classmethod
+    def tearDownClass(cls):
+        stop_server(cls.server)
+
+    def setUp(self):
+        self.clients = [Client(PORT) for _ in range(CLIENTS)]
+
+    def tearDown(self):
+        for c in self.clients:
+            c.close()
+
+    # every connection reads the key, that makes it hot
+    def read(self, key, n=100):
+        values = set()
+        for _ in range(n):
+            for c in self.clients:
+                values.add(c.get(key))
+        return values
+
+    def testHotKeyIsServedFromL1(self):
+        self.assertEqual(self.clients[0].set(b'l1_hot', b'v1'), SUCCESS)
+        self.assertEqual(self.read(b'l1_hot'), {b'v1'})
+        st = self.clients[0].stats()
+        self.assertTrue(int(st['l1_hits']) > 0)
+        self.assertTrue(int(st['l1_fills']) > 0)
+
+    def testUpdatesAreSeenAtOnce(self):
+        self.assertEqual(self.clients[0].set(b'l1_key', b'v0'), SUCCESS)
+        self.read(b'l1_key')
+
+        # a SET from any connection is seen by the next GET of all of them
+        for n in range(1, 20):
+            v = b'v%d' % n
+            self.assertEqual(self.clients[n % CLIENTS].set(b'l1_key', v), SUCCESS)
+            self.assertEqual(self.read(b'l1_key', 1), {v})
+
+        self.assertEqual(self.clients[1].delete(b'l1_key'), SUCCESS)
+        self.assertEqual(self.read(b'l1_key', 1), {None})
+
+    def testExpiredHotKey(self):
+        self.assertEqual(self.clients[0].set(b'l1_expiring', b'soon', exptime=1), SUCCESS)
+        self.assertEqual(self.read(b'l1_expiring'), {b'soon'})
+        time.sleep(2.1)
+        self.assertEqual(self.read(b'l1_expiring', 1), {None})
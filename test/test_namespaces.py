@@ -0,0 +1,89 @@
+import unittest
+
+from binary_client import *
+
+PORT = 11312
+MAX_NAMESPACES = 48*1024
+
+
+class NamespaceTests(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        cls.server = start_server(PORT, '-t', '2', '-D', ':')
+
+    @classmethod
+    def tearDownClass(cls):
+        stop_server(cls.server)
+
+    def setUp(self):
+        self.client = Client(PORT)
+
+    def tearDown(self):
+        self.client.close()
+
+    def testInvalidateDropsPrefix(self):
+        for i in range(20):
+            self.assertEqual(self.client.set(b'tenant1:key%d' % i, b'one%d' % i), SUCCESS)
+            self.assertEqual(self.client.set(b'tenant2:key%d' % i, b'two%d' % i), SUCCESS)
+        self.assertEqual(self.client.set(b'tenant1', b'no namespace'), SUCCESS)
+        self.assertEqual(self.client.set(b'tenant10:key0', b'other'), SUCCESS)
+        before = self.client.stats()
+
+        self.assertEqual(self.client.invalidate(b'tenant1'), SUCCESS)
+        for i in range(20):
+            self.assertEqual(self.client.get(b'tenant1:key%d' % i), None)
+            self.assertEqual(self.client.get(b'tenant2:key%d' % i), b'two%d' % i)
+        # the key without the delimiter and the longer prefix are in other namespaces
+        self.assertEqual(self.client.get(b'tenant1'), b'no namespace')
+        self.assertEqual(self.client.get(b'tenant10:key0'), b'other')
+
+        after = self.client.stats()
+        self.assertEqual(int(after['ns_invalidations']) - int(before['ns_invalidations']), 1)
+        self.assertEqual(int(after['ns_stale']) - int(before['ns_stale']), 20)
+        self.assertTrue(int(after['namespaces']) >= 1)
+        self.assertEqual(int(after['namespaces_max']), MAX_NAMESPACES)
+
+    def testSetAfterInvalidate(self):
+        self.assertEqual(self.client.set(b'tenant3:key', b'first'), SUCCESS)
+        self.assertEqual(self.client.invalidate(b'tenant3'), SUCCESS)
+        self.assertEqual(self.client.get(b'tenant3:key'), None)
+
+        self.assertEqual(self.client.set(b'tenant3:key', b'second'), SUCCESS)
+        self.assertEqual(self.client.get(b'tenant3:key'), b'second')
+
+        # a CAS on the stale item is as good as on a missing one
+        self.assertEqual(self.client.invalidate(b'tenant3'), SUCCESS)
+        self.assertEqual(self.client.set(b'tenant3:key', b'third', cas=12345), SUCCESS)
+        self.assertEqual(self.client.get(b'tenant3:key'), b'third')
+
+    def testInvalidateBadNamespace(self):
+        self.assertEqual(self.client.set(b'tenant4:key', b'value'), SUCCESS)
+        self.assertEqual(self.client.invalidate(b'tenant4:'), EINVAL)
+        self.assertEqual(self.client.invalidate(b'tenant4:key'), EINVAL)
+        self.assertEqual(self.client.get(b'tenant4:key'), b'value')
+
+        # a malformed request, no namespace at all, ends the connection like the others
+        self.assertEqual(self.client.invalidate(b''), EINVAL)
+
+    def testNamespacesOff(self):
+        # the server of conftest has no -D
+        client = Client(11211)
+        self.assertEqual(client.invalidate(b'tenant1'), UNKNOWN_COMMAND)
+        client.close()
+
+    def testTableFull(self):
+        server = start_server(PORT + 1, '-D', ':')
+        try:
+            client = Client(PORT + 1)
+            for start in range(0, MAX_NAMESPACES, 1024):
+                client.send(*[request(INVALIDATE, b'ns%d' % i) for i in range(start, start + 1024)])
+                for i in range(1024):
+                    self.assertEqual(client.response().status, SUCCESS)
+            self.assertEqual(client.stats()['namespaces'], str(MAX_NAMESPACES))
+
+            # the namespaces that are there still move on, a new one doesn't fit
+            self.assertEqual(client.invalidate(b'ns0'), SUCCESS)
+            self.assertEqual(client.invalidate(b'one_more'), ENOMEM)
+            client.close()
+        finally:
+            stop_server(server)
@@ -0,0 +1,101 @@
+import os
+import unittest
+
+from binary_client import *
+
+PORT = 11311
+
+
+class PipelineTests(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        # no compression, the big values are written over several events
+        cls.server = start_server(PORT, '-t', '2')
+
+    @classmethod
+    def tearDownClass(cls):
+        stop_server(cls.server)
+
+    def setUp(self):
+        self.client = Client(PORT)
+
+    def tearDown(self):
+        self.client.close()
+
+    def testQuietMissesAndOrder(self):
+        self.assertEqual(self.client.set(b'pipe_key1', b'value1'), SUCCESS)
+        self.assertEqual(self.client.set(b'pipe_key3', b'value3'), SUCCESS)
+
+        self.client.send(request(GETQ, b'pipe_key1', opaque=1),
+                         request(GETQ, b'pipe_missing2', opaque=2),
+                         request(GETK, b'pipe_key3', opaque=3),
+                         request(GETKQ, b'pipe_missing4', opaque=4),
+                         request(GET, b'pipe_missing5', opaque=5),
+                         request(GETKQ, b'pipe_key1', opaque=6),
+                         request(NOOP, opaque=7))
+        rs = self.client.responses_to_noop()
+
+        # the quiet misses have no response, the rest come in the order of the requests
+        self.assertEqual([r.opaque for r in rs], [1, 3, 5, 6])
+        self.assertEqual([r.status for r in rs], [SUCCESS, SUCCESS, KEY_ENOENT, SUCCESS])
+        self.assertEqual(rs[0].value, b'value1')
+        self.assertEqual(rs[0].key, b'')
+        self.assertEqual(rs[1].key, b'pipe_key3')
+        self.assertEqual(rs[1].value, b'value3')
+        self.assertEqual(rs[3].key, b'pipe_key1')
+
+    def testPipelinedSetsAndGets(self):
+        self.client.send(*[set_request(b'pipe_set%d' % i, b'v%d' % i, opaque=i) for i in range(50)])
+        rs = [self.client.response() for i in range(50)]
+        self.assertEqual([r.opaque for r in rs], list(range(50)))
+
+        self.client.send(*([request(GETKQ, b'pipe_set%d' % i, opaque=i) for i in range(50)]
+                           + [request(NOOP)]))
+        rs = self.client.responses_to_noop()
+        self.assertEqual([r.key for r in rs], [b'pipe_set%d' % i for i in range(50)])
+        self.assertEqual([r.value for r in rs], [b'v%d' % i for i in range(50)])
+
+    def testBigValuesInBatch(self):
+        small = [b'small%d' % i for i in range(3)]
+        big = [os.urandom(100*1024), os.urandom(300*1024)]
+        for i, v in enumerate(small):
+            self.assertEqual(self.client.set(b'batch_small%d' % i, v), SUCCESS)
+        for i, v in enumerate(big):
+            self.assertEqual(self.client.set(b'batch_big%d' % i, v), SUCCESS)
+        before = self.client.stats()
+
+        keys = [b'batch_small0', b'batch_big0', b'batch_small1', b'batch_big1',
+                b'batch_missing', b'batch_small2']
+        self.client.send(*([request(GETKQ, k, opaque=i) for i, k in enumerate(keys)]
+                           + [request(NOOP)]))
+        rs = self.client.responses_to_noop()
+
+        # the responses after a big value wait for it, nothing is looked up twice
+        self.assertEqual([r.key for r in rs], [k for k in keys if k != b'batch_missing'])
+        self.assertEqual([r.value for r in rs], [small[0], big[0], small[1], big[1], small[2]])
+        after = self.client.stats()
+        self.assertEqual(int(after['get_hits']) - int(before['get_hits']), 5)
+        self.assertEqual(int(after['get_misses']) - int(before['get_misses']), 1)
+
+        # the connection goes on after the batch
+        self.assertEqual(self.client.get(b'batch_small1'), small[1])
+
+    def testSlowReader(self):
+        for i in range(100):
+            self.assertEqual(self.client.set(b'slow_key%d' % i, b's' * 1000), SUCCESS)
+
+        # 20MB of responses that aren't read, the socket is full
+        n = 20000
+        self.client.send(*([request(GETKQ, b'slow_key%d' % (i % 100)) for i in range(n)]
+                           + [request(NOOP)]))
+
+        # the server threads serve the other connections meanwhile, one of them is on the same thread
+        others = [Client(PORT) for _ in range(2)]
+        for c in others:
+            self.assertEqual(c.set(b'slow_other', b'v'), SUCCESS)
+            self.assertEqual(c.get(b'slow_other'), b'v')
+            c.close()
+
+        rs = self.client.responses_to_noop()
+        self.assertEqual(len(rs), n)
+        self.assertEqual(rs[-1].value, b's' * 1000)
@@ -0,0 +1,63 @@
+import os
+import time
+import unittest
+
+from binary_client import *
+
+PORT = 11319
+ITEMS = 6000  # 24MB into 16MB of memory
+
+
+class ReclaimerTests(unittest.TestCase):
+    def start(self, *args):
+        self.server = start_server(PORT, '-m', '16', *args)
+        self.client = Client(PORT)
+
+    def tearDown(self):
+        self.client.close()
+        stop_server(self.server)
+
+    def fill(self):
+        for i in range(ITEMS):
+            self.assertEqual(self.client.set(b'reclaim_key%d' % i, b'v' * 4000), SUCCESS)
+        time.sleep(0.2)  # the reclaimer gets down to the low watermark
+        return self.client.stats()
+
+    def testEvictsInBackground(self):
+        self.start('-w', '50,60')
+        st = self.fill()
+        # the memory is kept under the high watermark, the SETs don't wait for the evictions
+        self.assertTrue(int(st['reclaimer_evictions']) > 0)
+        self.assertTrue(int(st['bytes']) <= int(st['limit_maxbytes']) * 60 // 100)
+        self.assertEqual(self.client.get(b'reclaim_key%d' % (ITEMS - 1)), b'v' * 4000)
+
+    def testNoReclaimer(self):
+        self.start()
+        st = self.fill()
+        self.assertTrue(int(st['evictions']) > 0)
+        self.assertEqual(st['reclaimer_evictions'], '0')
+
+    def testStartsWithFirstExpiringItem(self):
+        # no watermarks, the reclaimer only removes the expired items
+        self.start('-t', '2')
+        threads = len(os.listdir('/proc/%d/task' % self.server.pid))
+        self.assertEqual(self.client.set(b'reclaim_forever', b'v'), SUCCESS)
+        self.assertEqual(len(os.listdir('/proc/%d/task' % self.server.pid)), threads)
+
+        self.assertEqual(self.client.set(b'reclaim_expiring', b'v', exptime=1), SUCCESS)
+        self.assertEqual(len(os.listdir('/proc/%d/task' % self.server.pid)), threads + 1)
+        time.sleep(2.5)  # removed without a GET
+        st = self.client.stats()
+        self.assertEqual(st['expired'], '1')
+        self.assertEqual(st['curr_items'], '1')
+
+    def testSoonerItemWakesReclaimer(self):
+        # the reclaimer sleeps until the far one expires, the one set later expires first
+        self.start('-t', '2')
+        self.assertEqual(self.client.set(b'reclaim_far', b'v', exptime=100), SUCCESS)
+        time.sleep(0.2)
+        self.assertEqual(self.client.set(b'reclaim_soon', b'v', exptime=1), SUCCESS)
+        time.sleep(2.5)
+        st = self.client.stats()
+        self.assertEqual(st['expired'], '1')
+        self.assertEqual(st['curr_items'], '1')
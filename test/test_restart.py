@@ -0,0 +1,69 @@
+import os
+import shutil
+import struct
+import tempfile
+import time
+import unittest
+
+from binary_client import *
+
+PORT = 11314
+
+
+class RestartTests(unittest.TestCase):
+    def setUp(self):
+        self.dir = tempfile.mkdtemp()
+        self.path = os.path.join(self.dir, 'cache')
+        self.server = None
+
+    def tearDown(self):
+        if self.server:
+            stop_server(self.server)
+        shutil.rmtree(self.dir)
+
+    def start(self, *args):
+        self.server = start_server(PORT, '-m', '64', '-r', self.path, *args)
+        return Client(PORT)
+
+    def fill(self, client, n):
+        for i in range(n):
+            self.assertEqual(client.set(b'restart_key%d' % i, b'value%d' % i * (i % 50 + 1), flags=i), SUCCESS)
+
+    def testRestartAfterKill(self):
+        client = self.start()
+        self.fill(client, 2000)
+        self.assertEqual(client.set(b'restart_expiring', b'soon', exptime=1), SUCCESS)
+        self.assertEqual(client.delete(b'restart_key7'), SUCCESS)
+        client.close()
+        stop_server(self.server)  # kill -9, nothing is written at the exit
+
+        time.sleep(1.5)
+        client = self.start()
+        for i in range(2000):
+            r = client.call(request(GET, b'restart_key%d' % i))
+            if i == 7:
+                self.assertEqual(r.status, KEY_ENOENT)
+                continue
+            self.assertEqual(r.status, SUCCESS)
+            self.assertEqual(r.value, b'value%d' % i * (i % 50 + 1))
+            self.assertEqual(struct.unpack('>I', r.extras)[0], i)
+        self.assertEqual(client.get(b'restart_expiring'), None)
+        # the deleted and the expired ones aren't taken back
+        self.assertEqual(int(client.stats()['restored_items']), 1999)
+
+        # the restored cache works as usual
+        self.assertEqual(client.set(b'restart_key7', b'again'), SUCCESS)
+        self.assertEqual(client.get(b'restart_key7'), b'again')
+        client.close()
+
+    def testOtherLayoutStartsOver(self):
+        client = self.start()
+        self.fill(client, 100)
+        client.close()
+        stop_server(self.server)
+
+        # the items of another slab layout aren't taken
+        client = self.start('-f', '1.5')
+        self.assertEqual(client.get(b'restart_key1'), None)
+        self.assertEqual(int(client.stats()['restored_items']), 0)
+        client.close()
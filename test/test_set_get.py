@@ -1,3 +1,6 @@
+import binascii
+import os
+import time
 import unittest
 import bmemcached
 from bmemcached.compat import long, unicode
@@ -60,3 +63,71 @@ class MemcachedTests(unittest.TestCase):
         # If the correct CAS value is supplied, the key is deleted.
         self.assertTrue(self.client.delete('test_key_del', cas=cas))
         self.assertEqual(None, self.client.get('test_key_del'))
+
+    def testCasExpired(self):
+        self.client = bmemcached.Client(self.server, 'user', 'password',
+                                        socket_timeout=None)
+
+        cas = 789
+        self.assertTrue(self.client.cas('test_key_cas_exp', 'test1', cas))
+        self.assertTrue(self.client.set('test_key_cas_exp', 'test2', time=1))
+        time.sleep(2.5)
+
+        # the expired item is as good as missing, whatever its cas
+        self.assertTrue(self.client.cas('test_key_cas_exp', 'test3', cas + 1))
+        self.assertEqual(self.client.get('test_key_cas_exp'), 'test3')
+
+    def testExpiration(self):
+        self.client = bmemcached.Client(self.server, 'user', 'password',
+                                        socket_timeout=None)
+
+        self.assertTrue(self.client.set('test_key_exp', 'test', time=2))
+        self.assertTrue(self.client.set('test_key_touch', 'test', time=2))
+        self.assertEqual(self.client.get('test_key_exp'), 'test')
+
+        # touch extends the expiration
+        self.assertTrue(self.client.touch('test_key_touch', 60))
+        self.assertFalse(self.client.touch('test_key_touch_missing', 60))
+
+        time.sleep(3.5)
+        self.assertEqual(self.client.get('test_key_exp'), None)
+        self.assertEqual(self.client.get('test_key_touch'), 'test')
+
+    def testStats(self):
+        self.client = bmemcached.Client(self.server, 'user', 'password',
+                                        socket_timeout=None)
+
+        self.assertTrue(self.client.set('test_key_stats', 'test'))
+        self.assertEqual(self.client.get('test_key_stats'), 'test')
+        self.assertEqual(self.client.get('test_key_stats_missing'), None)
+
+        stats = dict((k.decode() if isinstance(k, bytes) else k, v)
+                     for k, v in self.client.stats()[self.server].items())
+        self.assertTrue(int(stats['get_hits']) >= 1)
+        self.assertTrue(int(stats['get_misses']) >= 1)
+        self.assertTrue(int(stats['curr_items']) >= 1)
+
+    def testLargeValue(self):
+        self.client = bmemcached.Client(self.server, 'user', 'password',
+                                        socket_timeout=None)
+
+        # larger than one write, compressed by the server if the client didn't
+        value = ''.join('{"id": %d, "name": "user%d"}' % (x, x % 7) for x in range(20000))
+        self.assertTrue(self.client.set('test_key_large', value))
+        self.assertEqual(self.client.get('test_key_large'), value)
+
+        stats = dict((k.decode() if isinstance(k, bytes) else k, v)
+                     for k, v in self.client.stats()[self.server].items())
+        self.assertEqual(int(stats['compress_min']), 1024)
+        self.assertTrue(float(stats['compression_ratio']) >= 1)
+
+    def testChunkedValue(self):
+        self.client = bmemcached.Client(self.server, 'user', 'password',
+                                        socket_timeout=None)
+
+        # the server takes up to 8MB (-I 8), random data stays big if the client compresses it
+        value = binascii.hexlify(os.urandom(2*1024*1024)).decode()
+        self.assertTrue(self.client.set('test_key_chunked', value))
+        self.assertEqual(self.client.get('test_key_chunked'), value)
+        self.assertTrue(self.client.set('test_key_chunked', 'small now'))
+        self.assertEqual(self.client.get('test_key_chunked'), 'small now')
@@ -0,0 +1,80 @@
+import os
+import shutil
+import signal
+import struct
+import tempfile
+import time
+import unittest
+
+from binary_client import *
+
+PORT = 11315
+ITEMS = 3000  # 3MB, the snapshot has some blocks of 1MB
+FILE_HEADER_LEN = 16
+BLOCK_HEADER_LEN = 8
+
+
+def value(i):
+    return (b'snap%d-' % i) * 128
+
+
+class SnapshotTests(unittest.TestCase):
+    def setUp(self):
+        self.dir = tempfile.mkdtemp()
+        self.path = os.path.join(self.dir, 'snapshot')
+        self.server = None
+
+    def tearDown(self):
+        if self.server:
+            stop_server(self.server)
+        shutil.rmtree(self.dir)
+
+    def start(self):
+        self.server = start_server(PORT, '-m', '64', '-S', self.path)
+        return Client(PORT)
+
+    def dump(self, client):
+        for i in range(ITEMS):
+            self.assertEqual(client.set(b'snap_key%d' % i, value(i), flags=i), SUCCESS)
+        self.server.send_signal(signal.SIGUSR1)
+        for _ in range(100):  # the file is renamed to the path when it's whole
+            if os.path.exists(self.path):
+                break
+            time.sleep(0.05)
+        self.assertTrue(os.path.exists(self.path))
+        client.close()
+        stop_server(self.server)
+
+    # the number of the items that are there, each of them as it was set
+    def read_back(self, client):
+        found = 0
+        for i in range(ITEMS):
+            r = client.call(request(GET, b'snap_key%d' % i))
+            if r.status == KEY_ENOENT:
+                continue
+            self.assertEqual(r.status, SUCCESS)
+            self.assertEqual(r.value, value(i))
+            self.assertEqual(struct.unpack('>I', r.extras)[0], i)
+            found += 1
+        return found
+
+    def testRoundTrip(self):
+        self.dump(self.start())
+
+        client = self.start()
+        self.assertEqual(self.read_back(client), ITEMS)
+        client.close()
+
+    def testBrokenBlockIsSkipped(self):
+        self.dump(self.start())
+        with open(self.path, 'r+b') as f:
+            f.seek(FILE_HEADER_LEN + BLOCK_HEADER_LEN + 100)
+            b = f.read(1)
+            f.seek(-1, os.SEEK_CUR)
+            f.write(bytes([b[0] ^ 0xff]))
+
+        # the items of the first block are gone, the other blocks are loaded
+        client = self.start()
+        found = self.read_back(client)
+        self.assertTrue(0 < found < ITEMS)
+        client.close()
@@ -0,0 +1,110 @@
+//-----------------------------------------------------------------------------
+// wyhash was written by Wang Yi, and is released into the public domain
+// (The Unlicense). This is the final version 4 of the function, the keys
+// hash to the same values as with the original wyhash.h.
+
+#include "wyhash.h"
+#include <string.h>
+
+namespace
+{
+	const uint64_t SECRET[4] = {
+		0x2d358dccaa6c78a5ull
+		,0x8bb84b93962eacc9ull
+		,0x4b33a62ed433d4a3ull
+		,0x4d5a2da51de1aa47ull
+	};
+
+	//128 bit product of a and b, the low half goes to a, the high one to b
+	inline void mum(uint64_t& a, uint64_t& b)
+	{
+#if defined(__SIZEOF_INT128__)
+		__uint128_t r = a;
+		r *= b;
+		a = uint64_t(r);
+		b = uint64_t(r >> 64);
+#else
+		uint64_t ha = a >> 32, hb = b >> 32, la = uint32_t(a), lb = uint32_t(b);
+		uint64_t rh = ha*hb, rm0 = ha*lb, rm1 = hb*la, rl = la*lb;
+		uint64_t t = rl + (rm0 << 32);
+		uint64_t c = t < rl;
+		uint64_t lo = t + (rm1 << 32);
+		c += lo < t;
+		uint64_t hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+		a = lo;
+		b = hi;
+#endif
+	}
+
+	inline uint64_t mix(uint64_t a, uint64_t b)
+	{
+		mum(a, b);
+		return a ^ b;
+	}
+
+	//little endian reads, the machines we run on are
+	inline uint64_t read8(const uint8_t* p)
+	{
+		uint64_t v;
+		::memcpy(&v, p, sizeof(v));
+		return v;
+	}
+
+	inline uint64_t read4(const uint8_t* p)
+	{
+		uint32_t v;
+		::memcpy(&v, p, sizeof(v));
+		return v;
+	}
+
+	//1 to 3 bytes
+	inline uint64_t read3(const uint8_t* p, size_t k)
+	{
+		return (uint64_t(p[0]) << 16) | (uint64_t(p[k >> 1]) << 8) | p[k - 1];
+	}
+}
+
+uint64_t wyhash(const void *key, size_t length, uint64_t seed)
+{
+	const uint8_t* p = (const uint8_t*)key;
+	seed ^= mix(seed ^ SECRET[0], SECRET[1]);
+	uint64_t a, b;
+	if (length <= 16) {
+		if (length >= 4) {
+			a = (read4(p) << 32) | read4(p + ((length >> 3) << 2));
+			b = (read4(p + length - 4) << 32) | read4(p + length - 4 - ((length >> 3) << 2));
+		}
+		else if (length > 0) {
+			a = read3(p, length);
+			b = 0;
+		}
+		else {
+			a = b = 0;
+		}
+	}
+	else {
+		size_t i = length;
+		if (i >= 48) {
+			uint64_t see1 = seed, see2 = seed;
+			do {
+				seed = mix(read8(p) ^ SECRET[1], read8(p + 8) ^ seed);
+				see1 = mix(read8(p + 16) ^ SECRET[2], read8(p + 24) ^ see1);
+				see2 = mix(read8(p + 32) ^ SECRET[3], read8(p + 40) ^ see2);
+				p += 48;
+				i -= 48;
+			} while (i >= 48);
+			seed ^= see1 ^ see2;
+		}
+		while (i > 16) {
+			seed = mix(read8(p) ^ SECRET[1], read8(p + 8) ^ seed);
+			i -= 16;
+			p += 16;
+		}
+		a = read8(p + i - 16);
+		b = read8(p + i - 8);
+	}
+	a ^= SECRET[1];
+	b ^= seed;
+	mum(a, b);
+	return mix(a ^ SECRET[0] ^ length, b ^ SECRET[1]);
+}
@@ -0,0 +1,20 @@
+//-----------------------------------------------------------------------------
+// wyhash was written by Wang Yi, and is released into the public domain
+// (The Unlicense). This is the final version 4 of the function, the keys
+// hash to the same values as with the original wyhash.h.
+
+#ifndef WYHASH_H
+#define WYHASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//-----------------------------------------------------------------------------
+
+// 64 bit hash, it reads 8 bytes at a time and keeps three independent
+// multiply chains for the longer keys
+uint64_t wyhash(const void *key, size_t length, uint64_t seed);
+
+//-----------------------------------------------------------------------------
+
+#endif // WYHASH_H